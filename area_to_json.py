@@ -1,7 +1,6 @@
 #!/usr/bin/env python3
 
 import networkx
-import psycopg2
 import sys
 import json
 import random
@@ -17,11 +16,26 @@ import itertools
 
 G = networkx.MultiDiGraph()
 
-conn = psycopg2.connect('dbname=batmud')
+# usage: area_to_json.py [--sqlite file] area
+args = sys.argv[1:]
+if len(args) != (3 if args[:1] == ['--sqlite'] else 1):
+    sys.exit('usage: area_to_json.py [--sqlite file] area')
+if sys.argv[1] == '--sqlite':
+    import sqlite3
+    conn = sqlite3.connect(sys.argv[2])
+    area = sys.argv[3]
+    param = '?'
+else:
+    import psycopg2
+    conn = psycopg2.connect('dbname=batmud')
+    area = sys.argv[1]
+    param = '%s'
 cur = conn.cursor()
 
-cur.execute('select room.id, shortdesc, longdesc, indoors, exits from room '
-            'where area=%s', (sys.argv[1],))
+cur.execute('select room.id, s.text, l.text, indoors, exits from room '
+            'join description s on s.hash=shortdesc '
+            'join description l on l.hash=longdesc '
+            'where area=' + param, (area,))
 # as nodes, we use the room identifiers, but add json-serializable data
 # formatted for sigma.js as node attrs
 for row in cur:
@@ -29,8 +43,9 @@ for row in cur:
     node['size'] = 1
     G.add_node(node['id'], **node)
 
-cur.execute('select direction, source, destination from exit left join room '
-            'on room.id=source where room.area=%s', (sys.argv[1],))
+cur.execute('select direction, src.id, dst.id from exit '
+            'join room src on src.key=source join room dst on dst.key=destination '
+            'where src.area=' + param, (area,))
 for row in cur:
     direction, src, tgt = row
     G.add_edge(src, tgt, key=direction)
@@ -8,6 +8,7 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <netdb.h>
 #include <poll.h>
@@ -15,16 +16,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "charset.h"
 #include "client_parser.h"
+#include "coalesce.h"
 #include "config.h"
 #include "db.h"
+#include "events.h"
+#include "fanout.h"
+#include "gmcp.h"
+#include "graph.h"
+#include "latency.h"
+#include "livemap.h"
+#include "logstore.h"
+#include "mapexport.h"
+#include "metrics.h"
 #include "net.h"
+#include "outq.h"
 #include "parser.h"
 #include "postgres.h"
 #include "proxy.h"
 #include "room.h"
+#include "trigger.h"
+#ifdef HAVE_SQLITE3
+#include "sqlite.h"
+#endif
+#ifdef HAVE_IO_URING
+#include "uring.h"
+#endif
 
 /*
  * Binds to loopback address using TCP and the provided servname, printing
@@ -80,26 +101,37 @@ cleanup:
 	return sock;
 }
 #define BUFSZ (64*1024)
+/* Longest wait for a client to read its output after the server is gone */
+#define DRAIN_TIMEOUT	5000
 
-static int
-handle_connection(int client, int dumpfd, struct bc_parser *parser)
+static volatile sig_atomic_t metrics_requested;
+
+static void
+request_metrics(int sig)
 {
-	char *ibuf, *convbuf;
-	int status = -1;
-	int server = -1;
-	struct tls *ctx;
-	struct proxy_state *st = parser->data;
-	ssize_t recvd, sent, bytes_to_send;
+	metrics_requested = 1;
+}
 
-	ibuf = malloc(BUFSZ);
-	convbuf = malloc(BUFSZ);
-	if (!ibuf || !convbuf)
-		errx(1, "failed to allocate buffers");
+/*
+ * Writes the metrics to stderr, for SIGUSR1.
+ */
+static void
+dump_metrics(void)
+{
+	buffer *out = buffer_new(4096);
 
-	if ((ctx = connect_batmud(&server)) == NULL)
-		errx(1, "failed to connect");
-	warnx("connected to batmud");
+	metrics_write(out);
+	fwrite(out->data, 1, out->len, stderr);
+	buffer_free(out);
+}
 
+/*
+ * Prepares the sockets for the proxy loop and offers GMCP and CHARSET to the
+ * client. Returns -1 on error.
+ */
+static int
+connection_start(int client, int server, struct proxy_state *st)
+{
 	/*
 	 * Set the fd's nonblocking by default and use blocking mode only when
 	 * writing.
@@ -121,23 +153,197 @@ handle_connection(int client, int dumpfd, struct bc_parser *parser)
 			err(1, "setsockopt TCP_NODELAY");
 	}
 
+	/*
+	 * Offer GMCP to the client; status tags are sent as marker lines until
+	 * the client agrees.
+	 */
+	if (sendall(client, GMCP_WILL, strlen(GMCP_WILL)) == -1)
+		return -1;
+	st->gmcp_offer = 1;
+	/* Likewise CHARSET; text is UTF-8 until the client accepts another */
+	if (!st->charset_fixed) {
+		if (sendall(client, CHARSET_WILL, strlen(CHARSET_WILL)) == -1)
+			return -1;
+		st->charset_offer = 1;
+	}
+	return 0;
+}
+
+/*
+ * Passes len bytes read from the server on to the client. If client is -1,
+ * the output is only queued, for the io_uring loop to send. Returns -1 on
+ * error.
+ */
+static int
+server_input(struct bc_parser *parser, int client, int dumpfd, const char *buf,
+    size_t len)
+{
+	struct proxy_state *st = parser->data;
+	const char *p = buf;
+	size_t left = len;
+
+	while (dumpfd >= 0 && left > 0) {
+		ssize_t nw;
+		if ((nw = write(dumpfd, p, left)) < 0)
+			err(1, "writing dumpfile");
+		p += nw;
+		left -= nw;
+	}
+	if (proxy_passthrough(st, parser, buf, len)) {
+		metrics_add(METRIC_PASSTHROUGH_CHUNKS, 1);
+		metrics_add(METRIC_PASSTHROUGH_BYTES, len);
+		latency_phase(st->latency, LATENCY_PARSE);
+		if (client == -1)
+			outq_text(st->outq, buf, len);
+		else if (outq_send(st->outq, client, buf, len) == -1)
+			return -1;
+		latency_phase(st->latency, LATENCY_WRITE);
+		latency_end(st->latency, outq_stats(st->outq)->sent,
+		    outq_pending(st->outq));
+		return 0;
+	}
+	metrics_add(METRIC_PARSED_CHUNKS, 1);
+	/* parser handles ISO-8859-1->UTF-8 conversion */
+	bc_parse(parser, buf, len);
+	latency_phase(st->latency, LATENCY_PARSE);
+	proxy_flush(st);
+	latency_phase(st->latency, LATENCY_FLUSH);
+	if (client != -1 && outq_flush(st->outq, client) == -1)
+		return -1;
+	latency_phase(st->latency, LATENCY_WRITE);
+	latency_end(st->latency, outq_stats(st->outq)->sent,
+	    outq_pending(st->outq));
+	return 0;
+}
+
+/*
+ * Sends the client the output still queued for it once the server has
+ * disconnected. Gives up if the client takes none of it for DRAIN_TIMEOUT
+ * milliseconds.
+ */
+static void
+drain_client(struct proxy_state *st, int client)
+{
+	struct pollfd pfd = { .fd = client, .events = POLLOUT };
+	int n;
+
+	proxy_finish(st);
+	for (;;) {
+		if (outq_flush(st->outq, client) == -1 ||
+		    !outq_pending(st->outq))
+			return;
+		n = poll(&pfd, 1, DRAIN_TIMEOUT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			err(1, "poll");
+		if (n == 0) {
+			warnx("client not reading; dropped %zu bytes",
+			    outq_pending(st->outq));
+			return;
+		}
+	}
+}
+
+/*
+ * Handles len bytes read from the client and converts what is left of them
+ * for the server into *convbuf, which is grown as needed. Returns the number
+ * of bytes to send.
+ */
+static size_t
+client_input(struct proxy_state *st, const char *buf, size_t len,
+    char **convbuf, size_t *convsz)
+{
+	size_t n;
+
+	/* proxy commands may add to the input */
+	buffer_clear(st->sbuf);
+	proxy_client_input(st, buf, len);
+	if (2 * st->sbuf->len + 2 > *convsz) {
+		*convsz = 2 * st->sbuf->len + 2;
+		if (!(*convbuf = realloc(*convbuf, *convsz)))
+			err(1, "realloc");
+	}
+	n = client_to_iso8859_1(*convbuf, st->sbuf->data, st->sbuf->len,
+	    proxy_client_telnet, st);
+	assert(n <= 2 * st->sbuf->len + 2);
+	latency_phase(st->latency, LATENCY_PARSE);
+	proxy_flush(st);
+	return n;
+}
+
+static int
+handle_connection(int client, int dumpfd, struct bc_parser *parser)
+{
+	char *ibuf, *convbuf;
+	size_t convsz;
+	int status = -1;
+	int server = -1;
+	struct tls *ctx;
+	struct proxy_state *st = parser->data;
+	ssize_t recvd, sent, bytes_to_send;
+
+	ibuf = malloc(BUFSZ);
+	/* client_to_iso8859_1 may write twice what it reads, and 2 more */
+	convsz = 2 * BUFSZ + 2;
+	convbuf = malloc(convsz);
+	if (!ibuf || !convbuf)
+		errx(1, "failed to allocate buffers");
+
+	if ((ctx = connect_batmud(&server)) == NULL)
+		errx(1, "failed to connect");
+	warnx("connected to batmud");
+
+	if (connection_start(client, server, st) == -1)
+		goto out;
+
 	for(;;) {
-		struct pollfd pfd[2];
+		struct pollfd pfd[2 + EVENTS_NPOLLFDS + LIVEMAP_NPOLLFDS +
+		    FANOUT_NPOLLFDS];
+		int npfd = 2, nevents, nlivemap, nfanout;
 		int nready;
 		int from, to;
 
+		if (metrics_requested) {
+			metrics_requested = 0;
+			dump_metrics();
+		}
+		/*
+		 * Stop reading from the server while the client is not keeping
+		 * up; the output queue would grow without bounds otherwise.
+		 */
 		pfd[0].fd = server;
-		pfd[0].events = POLLIN;
+		pfd[0].events = outq_full(st->outq) ? 0 : POLLIN;
 		pfd[1].fd = client;
 		pfd[1].events = POLLIN;
+		if (outq_pending(st->outq))
+			pfd[1].events |= POLLOUT;
+		npfd += nevents = events_pollfds(st->events, pfd + npfd);
+		npfd += nlivemap = livemap_pollfds(st->livemap, pfd + npfd);
+		npfd += nfanout = fanout_pollfds(st->fanout, pfd + npfd);
 
-		nready = poll(pfd, 2, -1);
-		if (nready == -1)
+		nready = poll(pfd, npfd, coalesce_timeout(st->coalesce));
+		if (nready == -1) {
+			if (errno == EINTR)
+				continue;
 			err(1, "poll");
+		}
 		if (pfd[0].revents & (POLLERR|POLLNVAL))
 			errx(1, "bad server fd %d", pfd[0].fd);
 		if (pfd[1].revents & (POLLERR|POLLNVAL))
 			errx(1, "bad client fd %d", pfd[1].fd);
+		events_handle(st->events, pfd + 2, nevents);
+		livemap_handle(st->livemap, pfd + 2 + nevents, nlivemap);
+		fanout_handle(st->fanout, pfd + 2 + nevents + nlivemap,
+		    nfanout);
+		proxy_expire(st);
+		if (outq_flush(st->outq, client) == -1)
+			goto out;
+		latency_sent(st->latency, outq_stats(st->outq)->sent,
+		    outq_pending(st->outq));
+		if (!(pfd[0].revents & (POLLIN|POLLHUP)) &&
+		    !(pfd[1].revents & (POLLIN|POLLHUP)))
+			continue;
 		if (pfd[0].revents & POLLIN) {
 			from = server;
 			to = client;
@@ -147,19 +353,33 @@ handle_connection(int client, int dumpfd, struct bc_parser *parser)
 				continue;
 			if (recvd == -1)
 				warnx("tls_read: %s", tls_error(ctx));
+			else if (recvd > 0) {
+				latency_start(st->latency, LATENCY_SERVER,
+				    ibuf, recvd);
+				metrics_add(METRIC_SERVER_READ, recvd);
+				metrics_observe(METRIC_TLS_READ_BYTES, recvd);
+			}
 		} else if (pfd[1].revents & POLLIN) {
 			from = client;
 			to = server;
 			recvd = recv(from, ibuf, BUFSZ, 0);
 			if (recvd == -1)
 				warn("recv");
+			else {
+				latency_start(st->latency, LATENCY_CLIENT,
+				    ibuf, recvd);
+				metrics_add(METRIC_CLIENT_READ, recvd);
+			}
 		}
 
 		if (recvd == -1)
 			goto out;
 
-		if (pfd[0].revents & POLLHUP || recvd == 0) {
+		/* what the server sent before hanging up is read first */
+		if ((from == server && recvd == 0) ||
+		    (pfd[0].revents & (POLLHUP|POLLIN)) == POLLHUP) {
 			warnx("server disconnect");
+			drain_client(st, client);
 			status = 0;
 			goto out;
 		}
@@ -170,32 +390,24 @@ handle_connection(int client, int dumpfd, struct bc_parser *parser)
 		}
 
 		if (from == client) {
-			bytes_to_send = client_utf8_to_iso8859_1(convbuf, ibuf,
-			    recvd);
-			assert(bytes_to_send <= recvd);
+			bytes_to_send = client_input(st, ibuf, recvd, &convbuf,
+			    &convsz);
+			if (outq_flush(st->outq, client) == -1)
+				goto out;
+			latency_phase(st->latency, LATENCY_FLUSH);
 			sent = tls_sendall(ctx, to, convbuf, bytes_to_send);
-		} else {
-			size_t len = recvd;
-			const char *buf = ibuf;
-			while (dumpfd >= 0 && len > 0) {
-				ssize_t nw;
-				if ((nw = write(dumpfd, buf, len)) < 0)
-					err(1, "writing dumpfile");
-				buf += nw;
-				len -= nw;
+			latency_phase(st->latency, LATENCY_WRITE);
+			latency_end(st->latency, 0, 0);
+			if (sent > 0)
+				metrics_add(METRIC_SERVER_WRITTEN, sent);
+			if (sent != bytes_to_send) {
+				warnx("sent only %zd of %zd bytes to server",
+				    sent, bytes_to_send);
+				goto out;
 			}
-			/* parser handles ISO-8859-1->UTF-8 conversion */
-			bc_parse(parser, ibuf, recvd);
-			bytes_to_send = st->obuf->len;
-			sent = sendall(to, st->obuf->data, bytes_to_send);
-			buffer_clear(st->obuf);
-		}
-		if (sent != bytes_to_send) {
-			warnx("sent only %zd of %zd bytes to %s", sent,
-			    bytes_to_send,
-			    to == client ? "client" : "server");
+		} else if (server_input(parser, client, dumpfd, ibuf,
+		    recvd) == -1)
 			goto out;
-		}
 	}
 
 out:
@@ -208,6 +420,388 @@ out:
 	return status;
 }
 
+#ifdef HAVE_IO_URING
+/* Submissions the io_uring loop may need at once */
+#define URING_ENTRIES	128
+/* Provided buffers for receiving from the client */
+#define CLIENT_BUFS	16
+#define CLIENT_BUFSZ	4096
+
+/* Registered buffers */
+enum {
+	BUF_TLS,		/* records from the server */
+	BUF_CLIENT,		/* output being sent to the client */
+};
+
+/* Ring operations, in the low byte of their user_data */
+enum {
+	OP_SERVER_READ,
+	OP_SERVER_WRITE,
+	OP_CLIENT_RECV,
+	OP_CLIENT_WRITE,
+	OP_POLL,		/* event feed, live map and spectator sockets */
+	OP_POLL_REMOVE,
+};
+
+#define OP_DATA(op, gen, i) \
+	((op) | (uint64_t)((gen) & 0xffffff) << 8 | (uint64_t)(i) << 32)
+
+/*
+ * TLS records to and from BatMUD. The callbacks use the socket directly for
+ * the handshake; after that, they only take the records read by the ring and
+ * queue the records for it to send.
+ */
+struct tls_io {
+	int		fd;
+	int		ring;
+	const char	*in;
+	size_t		inlen;
+	buffer		*out;
+};
+
+static ssize_t
+tls_io_read(struct tls *ctx, void *buf, size_t len, void *arg)
+{
+	struct tls_io *io = arg;
+	ssize_t n;
+
+	if (!io->ring) {
+		n = read(io->fd, buf, len);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return TLS_WANT_POLLIN;
+		return n;
+	}
+	if (!io->inlen)
+		return TLS_WANT_POLLIN;
+	n = len < io->inlen ? len : io->inlen;
+	memcpy(buf, io->in, n);
+	io->in += n;
+	io->inlen -= n;
+	return n;
+}
+
+static ssize_t
+tls_io_write(struct tls *ctx, const void *buf, size_t len, void *arg)
+{
+	struct tls_io *io = arg;
+	ssize_t n;
+
+	if (!io->ring) {
+		n = write(io->fd, buf, len);
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return TLS_WANT_POLLOUT;
+		return n;
+	}
+	buffer_append(io->out, buf, len);
+	return len;
+}
+
+/*
+ * Sends the client what is left of its output once the server has
+ * disconnected: waits for the write in flight, if sending, discarding other
+ * completions, and then sends the rest of the queue directly.
+ */
+static void
+uring_drain_client(struct uring *ring, struct proxy_state *st, int client,
+    int sending)
+{
+	struct io_uring_cqe *cqe;
+
+	while (sending) {
+		if (uring_wait(ring, -1) == -1)
+			err(1, "io_uring_enter");
+		while ((cqe = uring_cqe(ring))) {
+			if ((cqe->user_data & 0xff) == OP_CLIENT_WRITE) {
+				sending = 0;
+				if (cqe->res > 0)
+					outq_sent(st->outq, cqe->res);
+			}
+			uring_seen(ring);
+		}
+	}
+	drain_client(st, client);
+}
+
+/*
+ * The proxy loop on io_uring: one io_uring_enter submits everything that is
+ * ready to go and waits for the next completion. BatMUD's records are read
+ * into a registered buffer and decrypted by libtls from there, the client's
+ * input arrives through a multishot receive, and the client's output is
+ * copied from the output queue to a registered buffer to be written. Each
+ * socket has at most one write in flight, so the order of writes is kept.
+ * Frees ring.
+ */
+static int
+handle_connection_uring(struct uring *ring, int client, int dumpfd,
+    struct bc_parser *parser)
+{
+	struct pollfd pfd[EVENTS_NPOLLFDS + LIVEMAP_NPOLLFDS + FANOUT_NPOLLFDS];
+	struct pollfd polled[EVENTS_NPOLLFDS + LIVEMAP_NPOLLFDS +
+	    FANOUT_NPOLLFDS];
+	int armed[EVENTS_NPOLLFDS + LIVEMAP_NPOLLFDS + FANOUT_NPOLLFDS];
+	struct proxy_state *st = parser->data;
+	struct tls_io io = { .fd = -1 };
+	struct io_uring_cqe *cqe;
+	struct tls *ctx;
+	char *ibuf, *tlsbuf, *cbuf, *convbuf;
+	buffer *sending;
+	size_t convsz, sendoff = 0;
+	int reading = 0, writing = 0, csending = 0, receiving = 0;
+	int npfd = 0, nevents = 0, gen = 0, fired = 0;
+	int status = -1;
+
+	ibuf = malloc(BUFSZ);
+	tlsbuf = malloc(BUFSZ);
+	cbuf = malloc(BUFSZ);
+	/* client_to_iso8859_1 may write twice what it reads, and 2 more */
+	convsz = 2 * BUFSZ + 2;
+	convbuf = malloc(convsz);
+	io.out = buffer_new(BUFSZ);
+	sending = buffer_new(BUFSZ);
+	if (!ibuf || !tlsbuf || !cbuf || !convbuf || !io.out || !sending)
+		errx(1, "failed to allocate buffers");
+
+	if ((ctx = connect_batmud_cbs(&io.fd, tls_io_read, tls_io_write,
+	    &io)) == NULL)
+		errx(1, "failed to connect");
+	warnx("connected to batmud");
+
+	if (connection_start(client, io.fd, st) == -1)
+		goto out;
+	io.ring = 1;
+	struct iovec iov[] = {
+		[BUF_TLS] = { tlsbuf, BUFSZ },
+		[BUF_CLIENT] = { cbuf, BUFSZ },
+	};
+	if (uring_register(ring, iov, 2) == -1 ||
+	    uring_provide(ring, CLIENT_BUFSZ, CLIENT_BUFS) == -1)
+		err(1, "io_uring_register");
+
+	for (;;) {
+		int nfds, nlivemap, nfanout;
+
+		if (metrics_requested) {
+			metrics_requested = 0;
+			dump_metrics();
+		}
+		if (!receiving) {
+			uring_recv_multishot(ring, client,
+			    OP_DATA(OP_CLIENT_RECV, 0, 0));
+			receiving = 1;
+		}
+		/*
+		 * Stop reading from the server while the client is not keeping
+		 * up; the output queue would grow without bounds otherwise.
+		 */
+		if (!reading && !outq_full(st->outq)) {
+			uring_read_fixed(ring, io.fd, tlsbuf, BUFSZ, BUF_TLS,
+			    OP_DATA(OP_SERVER_READ, 0, 0));
+			reading = 1;
+		}
+		if (!csending && outq_pending(st->outq)) {
+			size_t n = outq_peek(st->outq, cbuf, BUFSZ);
+			uring_write_fixed(ring, client, cbuf, n, BUF_CLIENT,
+			    OP_DATA(OP_CLIENT_WRITE, 0, 0));
+			csending = 1;
+		}
+		if (!writing && sendoff == sending->len && io.out->len) {
+			buffer *tmp = sending;
+			sending = io.out;
+			io.out = tmp;
+			buffer_clear(io.out);
+			sendoff = 0;
+		}
+		if (!writing && sendoff < sending->len) {
+			uring_send(ring, io.fd, sending->data + sendoff,
+			    sending->len - sendoff,
+			    OP_DATA(OP_SERVER_WRITE, 0, 0));
+			writing = 1;
+		}
+		/*
+		 * The event feed, live map and spectator sockets are polled
+		 * with one-shot polls. Once one of them fires, or the sockets
+		 * to poll change, what is left of the previous polls is
+		 * cancelled and they are all polled afresh, like poll(2)
+		 * would; a socket closed and another opened with the same
+		 * number in between can only happen after one fired.
+		 */
+		nfds = nevents = events_pollfds(st->events, pfd);
+		nfds += nlivemap = livemap_pollfds(st->livemap, pfd + nfds);
+		nfds += nfanout = fanout_pollfds(st->fanout, pfd + nfds);
+		for (int i = 0; i < nfds; i++) {
+			pfd[i].revents = 0;
+			if (i < npfd && (pfd[i].fd != polled[i].fd ||
+			    pfd[i].events != polled[i].events))
+				fired = 1;
+		}
+		if (fired || nfds != npfd) {
+			for (int i = 0; i < npfd; i++)
+				if (armed[i])
+					uring_poll_remove(ring,
+					    OP_DATA(OP_POLL, gen, i),
+					    OP_DATA(OP_POLL_REMOVE, gen, i));
+			gen++;
+			for (int i = 0; i < nfds; i++) {
+				uring_poll(ring, pfd[i].fd, pfd[i].events,
+				    OP_DATA(OP_POLL, gen, i));
+				armed[i] = 1;
+				polled[i] = pfd[i];
+			}
+			npfd = nfds;
+			fired = 0;
+		}
+
+		if (uring_wait(ring, coalesce_timeout(st->coalesce)) == -1)
+			err(1, "io_uring_enter");
+		while ((cqe = uring_cqe(ring))) {
+			uint64_t data = cqe->user_data;
+			unsigned flags = cqe->flags;
+			int res = cqe->res;
+			ssize_t n;
+
+			uring_seen(ring);
+			switch (data & 0xff) {
+			case OP_SERVER_READ:
+				reading = 0;
+				if (res < 0) {
+					errno = -res;
+					warn("read");
+					goto out;
+				}
+				io.in = tlsbuf;
+				io.inlen = res;
+				for (;;) {
+					n = tls_read(ctx, ibuf, BUFSZ);
+					if (n == TLS_WANT_POLLIN ||
+					    n == TLS_WANT_POLLOUT)
+						break;
+					if (n == -1) {
+						warnx("tls_read: %s",
+						    tls_error(ctx));
+						goto out;
+					}
+					if (n == 0) {
+						warnx("server disconnect");
+						uring_drain_client(ring, st,
+						    client, csending);
+						status = 0;
+						goto out;
+					}
+					latency_start(st->latency,
+					    LATENCY_SERVER, ibuf, n);
+					metrics_add(METRIC_SERVER_READ, n);
+					metrics_observe(METRIC_TLS_READ_BYTES,
+					    n);
+					if (server_input(parser, -1, dumpfd,
+					    ibuf, n) == -1)
+						goto out;
+				}
+				if (res == 0) {
+					warnx("server disconnect");
+					uring_drain_client(ring, st, client,
+					    csending);
+					status = 0;
+					goto out;
+				}
+				break;
+			case OP_SERVER_WRITE:
+				writing = 0;
+				if (res < 0) {
+					errno = -res;
+					warn("send");
+					goto out;
+				}
+				sendoff += res;
+				break;
+			case OP_CLIENT_RECV: {
+				const char *buf, *p;
+				size_t len;
+				unsigned bid;
+
+				if (!(flags & IORING_CQE_F_MORE))
+					receiving = 0;
+				if (res == -ENOBUFS)
+					break;
+				if (res < 0) {
+					errno = -res;
+					warn("recv");
+					goto out;
+				}
+				if (res == 0) {
+					warnx("client disconnect");
+					status = 0;
+					goto out;
+				}
+				bid = flags >> IORING_CQE_BUFFER_SHIFT;
+				buf = uring_buffer(ring, bid);
+				latency_start(st->latency, LATENCY_CLIENT, buf,
+				    res);
+				metrics_add(METRIC_CLIENT_READ, res);
+				len = client_input(st, buf, res, &convbuf,
+				    &convsz);
+				uring_recycle(ring, bid);
+				latency_phase(st->latency, LATENCY_FLUSH);
+				for (p = convbuf; p < convbuf + len; p += n) {
+					n = tls_write(ctx, p, convbuf + len -
+					    p);
+					if (n < 0) {
+						warnx("tls_write: %s",
+						    tls_error(ctx));
+						goto out;
+					}
+				}
+				metrics_add(METRIC_SERVER_WRITTEN, len);
+				latency_phase(st->latency, LATENCY_WRITE);
+				latency_end(st->latency, 0, 0);
+				break;
+			}
+			case OP_CLIENT_WRITE:
+				csending = 0;
+				if (res < 0) {
+					errno = -res;
+					warn("send");
+					goto out;
+				}
+				outq_sent(st->outq, res);
+				latency_sent(st->latency,
+				    outq_stats(st->outq)->sent,
+				    outq_pending(st->outq));
+				break;
+			case OP_POLL:
+				if (((data >> 8) & 0xffffff) !=
+				    (gen & 0xffffff) || res < 0)
+					break;
+				pfd[data >> 32].revents = res;
+				armed[data >> 32] = 0;
+				fired = 1;
+				break;
+			}
+		}
+		events_handle(st->events, pfd, nevents);
+		livemap_handle(st->livemap, pfd + nevents, nlivemap);
+		fanout_handle(st->fanout, pfd + nevents + nlivemap, nfanout);
+		proxy_expire(st);
+	}
+
+out:
+	shutdown(io.fd, SHUT_RDWR);
+	shutdown(client, SHUT_RDWR);
+	close(io.fd);
+	close(client);
+	/* freeing the ring cancels requests, but only asynchronously */
+	if (uring_drain(ring) == -1)
+		err(1, "io_uring_enter");
+	uring_free(ring);
+	free(ibuf);
+	free(tlsbuf);
+	free(cbuf);
+	free(convbuf);
+	buffer_free(io.out);
+	buffer_free(sending);
+	return status;
+}
+#endif /* HAVE_IO_URING */
+
 static int
 test_parser(size_t bufsz, struct bc_parser *parser)
 {
@@ -219,6 +813,7 @@ test_parser(size_t bufsz, struct bc_parser *parser)
 		err(1, "test_parser: malloc");
 	while ((n = read(STDIN_FILENO, buf, bufsz)) > 0) {
 		bc_parse(parser, buf, n);
+		proxy_flush(st);
 		write(STDOUT_FILENO, st->obuf->data, st->obuf->len);
 		buffer_clear(st->obuf);
 	}
@@ -226,10 +821,31 @@ test_parser(size_t bufsz, struct bc_parser *parser)
 	return 0;
 }
 
+/*
+ * Parses a decimal number from an option argument, exiting with an error
+ * mentioning what if it is invalid or not within [min, max].
+ */
+static long
+parse_number(const char *s, long min, long max, const char *what)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (errno || *s == '\0' || *end != '\0' || n < min || n > max)
+		errx(1, "invalid %s: %s", what, s);
+	return n;
+}
+
 static void
 usage(void)
 {
-	errx(1, "usage: bcproxy [-w file] listening_port");
+	errx(1, "usage: bcproxy [-b depth:size:arg] [-C charset] [-c window] "
+	    "[-d backend]\n"
+	    "               [-e socket] [-f spectators] [-l dir] [-m port] "
+	    "[-s ms:file]\n"
+	    "               [-t file] [-u] [-w file] listening_port");
 }
 
 extern char *optarg;
@@ -240,7 +856,130 @@ struct db postgres_db = {
 	.dbp_free = postgres_free,
 	.add_room = postgres_add_room,
 	.add_exit = postgres_add_exit,
+	.flush = postgres_flush,
+	.load = postgres_load,
+	.rooms = postgres_rooms,
+};
+
+#ifdef HAVE_SQLITE3
+struct db sqlite_db = {
+	.dbp_init = sqlite_init,
+	.dbp_free = sqlite_free,
+	.add_room = sqlite_add_room,
+	.add_exit = sqlite_add_exit,
+	.flush = sqlite_flush,
+	.load = sqlite_load,
+	.rooms = sqlite_rooms,
 };
+#endif
+
+/* mapping disabled */
+struct db null_db;
+
+/*
+ * Returns the backend named by spec ("postgres", "sqlite" or "none"),
+ * optionally followed by ":" and a parameter for the backend, which is stored
+ * in param.
+ */
+static struct db *
+select_db(const char *spec, const char **param)
+{
+	size_t len = strcspn(spec, ":");
+
+	*param = spec[len] ? spec + len + 1 : NULL;
+	if (strncmp(spec, "postgres", len) == 0 && len == strlen("postgres"))
+		return &postgres_db;
+#ifdef HAVE_SQLITE3
+	if (strncmp(spec, "sqlite", len) == 0 && len == strlen("sqlite"))
+		return &sqlite_db;
+#endif
+	if (strncmp(spec, "none", len) == 0 && len == strlen("none"))
+		return &null_db;
+	errx(1, "unknown database backend: %s", spec);
+}
+
+/*
+ * Main for the mapexport name: writes the map as JSON for render.html.
+ */
+static int
+export_main(int argc, char **argv)
+{
+	struct db *db = &postgres_db;
+	const char *dbparam = NULL;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "d:")) != -1) {
+		switch (ch) {
+		case 'd':
+			db = select_db(optarg, &dbparam);
+			break;
+		default:
+			errx(1, "usage: mapexport [-d backend] [area]");
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		errx(1, "usage: mapexport [-d backend] [area]");
+	return mapexport(db, dbparam, argc ? argv[0] : NULL);
+}
+
+/*
+ * Returns the time given as "YYYY-MM-DD", optionally followed by " HH:MM" or
+ * " HH:MM:SS", in local time, or as a number of days ago followed by "d".
+ */
+static time_t
+parse_time(const char *s)
+{
+	struct tm tm = { .tm_isdst = -1 };
+	const char *end;
+	size_t len = strlen(s);
+
+	if (len > 1 && s[len - 1] == 'd' && strspn(s, "0123456789") == len - 1)
+		return time(NULL) - strtol(s, NULL, 10) * 86400;
+	if ((end = strptime(s, "%Y-%m-%d", &tm)) && *end)
+		end = strptime(end, " %H:%M", &tm);
+	if (end && *end)
+		end = strptime(end, ":%S", &tm);
+	if (!end || *end)
+		errx(1, "invalid time: %s", s);
+	return mktime(&tm);
+}
+
+/*
+ * Main for the logsearch name: prints lines of the session log.
+ */
+static int
+search_main(int argc, char **argv)
+{
+	const char *type = NULL;
+	time_t since = 0, until = LLONG_MAX;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "s:t:u:")) != -1) {
+		switch (ch) {
+		case 's':
+			since = parse_time(optarg);
+			break;
+		case 't':
+			type = optarg;
+			break;
+		case 'u':
+			until = parse_time(optarg);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || argc > 2)
+		goto usage;
+	return logstore_search(argv[0], type, since, until,
+	    argc > 1 ? argv[1] : NULL);
+usage:
+	errx(1, "usage: logsearch [-s since] [-t type] [-u until] dir [text]");
+}
 
 int
 main(int argc, char **argv)
@@ -249,8 +988,25 @@ main(int argc, char **argv)
 	int listenfd = -1;
 	int conn = -1;
 	int dumpfd = -1;
-	struct db *db;
-	int testmode = 0;
+	const struct charset *charset = NULL;
+	const char *eventpath = NULL;
+	const char *logdir = NULL;
+	const char *mapport = NULL;
+	const char *triggerpath = NULL;
+	const char *slowpath = NULL;
+	const char *dbparam = NULL;
+	char *colon, *limits[3];
+	int status;
+#ifdef HAVE_IO_URING
+	int use_uring = 0;
+#endif
+	long tag_max = PROXY_TAG_MAX, arg_max = PROXY_ARG_MAX;
+	int window = 0;
+	int slow_ms = 0;
+	int spectators = 0;
+	struct db *db = &postgres_db;
+	struct graph *graph;
+	struct proxy_state *st;
 
 	struct bc_parser parser = {
 		.on_open = on_open,
@@ -260,34 +1016,101 @@ main(int argc, char **argv)
 		.on_close = on_close,
 		.on_prompt = on_prompt,
 		.on_telnet_command = on_telnet_command,
+		.max_depth = PROXY_TAG_DEPTH,
 	};
 
 	if (!setlocale(LC_CTYPE, ""))
 		err(1, "setlocale");
 
-	if (strcmp("test_parser", getprogname()) == 0) {
-		testmode = 1;
-		db = &(struct db) {
-			.dbp = NULL,
-			.dbp_init = NULL,
-			.dbp_free = NULL,
-			.add_room = NULL,
-			.add_exit = NULL,
-		};
-	} else
-		db = &postgres_db;
-
-	db_init(db);
-	parser.data = proxy_state_new(BUFSZ, db);
-	if (!parser.data)
-		errx(1, "failed to initialize proxy_state");
+	/*
+	 * The mode is picked by the name the proxy is run as, taken from
+	 * argv[0] since getprogname is missing on some systems, or by a
+	 * subcommand where links are inconvenient.
+	 */
+	const char *name = strrchr(argv[0], '/');
+	name = name ? name + 1 : argv[0];
+	if (argc > 1 && (strcmp("mapexport", argv[1]) == 0 ||
+	    strcmp("logsearch", argv[1]) == 0)) {
+		name = argv[1];
+		argc--;
+		argv++;
+	}
 
-	if (testmode)
+	int ch;
+	if (strcmp("test_parser", name) == 0) {
+		parser.data = st = proxy_state_new(BUFSZ, &null_db);
+		if (!st)
+			errx(1, "failed to initialize proxy_state");
+		while ((ch = getopt(argc, argv, "t:")) != -1) {
+			if (ch != 't')
+				errx(1, "usage: test_parser [-t file]");
+			triggerpath = optarg;
+		}
+		st->triggers = triggers_new(triggerpath);
 		return test_parser(BUFSZ, &parser);
+	}
+	if (strcmp("mapexport", name) == 0)
+		return export_main(argc, argv);
+	if (strcmp("logsearch", name) == 0)
+		return search_main(argc, argv);
 
-	int ch;
-	while ((ch = getopt(argc, argv, "w:")) != -1) {
+	while ((ch = getopt(argc, argv, "b:C:c:d:e:f:l:m:s:t:uw:")) != -1) {
 		switch (ch) {
+		case 'b':
+			limits[0] = strsep(&optarg, ":");
+			limits[1] = strsep(&optarg, ":");
+			limits[2] = strsep(&optarg, ":");
+			if (!limits[1] || !limits[2] || optarg)
+				usage();
+			parser.max_depth = parse_number(limits[0], 1, 1000,
+			    "tag depth limit");
+			tag_max = parse_number(limits[1], 64, 1 << 30,
+			    "tag size limit");
+			arg_max = parse_number(limits[2], 16, 1 << 20,
+			    "tag argument limit");
+			break;
+		case 'C':
+			if (!(charset = charset_find(optarg, strlen(optarg))))
+				errx(1, "unknown charset: %s", optarg);
+			break;
+		case 'c':
+			window = parse_number(optarg, 1, 60000,
+			    "coalescing window");
+			break;
+		case 'd':
+			db = select_db(optarg, &dbparam);
+			break;
+		case 'e':
+			eventpath = optarg;
+			break;
+		case 'f':
+			spectators = parse_number(optarg, 1, FANOUT_MAX_CLIENTS,
+			    "number of spectators");
+			break;
+		case 'l':
+			logdir = optarg;
+			break;
+		case 'm':
+			mapport = optarg;
+			break;
+		case 's':
+			if (!(colon = strchr(optarg, ':')))
+				usage();
+			*colon = '\0';
+			slow_ms = parse_number(optarg, 1, 60000,
+			    "slow chunk threshold");
+			slowpath = colon + 1;
+			break;
+		case 't':
+			triggerpath = optarg;
+			break;
+		case 'u':
+#ifdef HAVE_IO_URING
+			use_uring = 1;
+#else
+			warnx("built without io_uring, using poll");
+#endif
+			break;
 		case 'w':
 			if ((dumpfd = open(optarg, O_WRONLY|O_CREAT, 0644)) < 0)
 				err(1, "%s", optarg);
@@ -302,10 +1125,43 @@ main(int argc, char **argv)
 	if (argc != 1)
 		usage();
 
+	graph = graph_new();
+	db_init(db, dbparam, graph_load, graph);
+	graph_compact(graph);
+	parser.data = st = proxy_state_new(BUFSZ, db);
+	if (!st)
+		errx(1, "failed to initialize proxy_state");
+	st->graph = graph;
+	st->tag_max = tag_max;
+	st->arg_max = arg_max;
+	st->triggers = triggers_new(triggerpath);
+	st->latency = latency_new(slow_ms, slowpath);
+	st->log = logstore_new(logdir);
+	if (charset) {
+		st->charset = charset;
+		st->charset_fixed = 1;
+		client_charset(charset);
+	}
+
 	/* send() may cause SIGPIPE so ignore that */
 	sigaction(SIGPIPE,
 	    &(const struct sigaction) { .sa_handler = SIG_IGN, .sa_flags = SA_RESTART },
 	    NULL);
+	/* no SA_RESTART, so that poll returns to dump the metrics */
+	sigaction(SIGUSR1,
+	    &(const struct sigaction) { .sa_handler = request_metrics },
+	    NULL);
+
+	st->events = events_new(eventpath);
+	events_set_handler(st->events, proxy_request, st);
+	if (mapport) {
+		int fd = bindall(mapport);
+		if (fd < 0)
+			goto exit;
+		st->livemap = livemap_new(fd);
+	}
+	st->coalesce = coalesce_new(window);
+	st->outq = outq_new(OUTQ_MAX);
 
 	listenfd = bindall(argv[0]);
 	if (listenfd < 0)
@@ -320,9 +1176,35 @@ retry_accept:
 			goto retry_accept;
 		err(1, "accept");
 	}
+	st->fanout = fanout_new(listenfd, spectators, st->outq);
 
-	exit_status = handle_connection(conn, dumpfd, &parser) == 0 ? 0 : 1;
-	proxy_state_free((struct proxy_state *)parser.data);
+#ifdef HAVE_IO_URING
+	struct uring *ring = NULL;
+	if (use_uring && !(ring = uring_new(URING_ENTRIES)))
+		warn("io_uring_setup, using poll");
+	if (ring)
+		status = handle_connection_uring(ring, conn, dumpfd, &parser);
+	else
+		status = handle_connection(conn, dumpfd, &parser);
+#else
+	status = handle_connection(conn, dumpfd, &parser);
+#endif
+	exit_status = status == 0 ? 0 : 1;
+	if (st->coalesce) {
+		const struct coalesce_stats *cs = coalesce_stats(st->coalesce);
+		warnx("coalesced %lu status updates into %lu lines",
+		    cs->updates, cs->emitted);
+	}
+	coalesce_free(st->coalesce);
+	fanout_free(st->fanout);
+	outq_free(st->outq);
+	graph_free(st->graph);
+	events_free(st->events);
+	livemap_free(st->livemap);
+	triggers_free(st->triggers);
+	latency_free(st->latency);
+	logstore_free(st->log);
+	proxy_state_free(st);
 	db_free(db);
 exit:
 	if (conn != -1)
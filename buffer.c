@@ -4,6 +4,7 @@
 #include <string.h>
 #include <unistd.h>
 #include "buffer.h"
+#include "metrics.h"
 
 buffer *
 buffer_new(size_t initial_size)
@@ -12,6 +13,7 @@ buffer_new(size_t initial_size)
 	char *data = malloc(initial_size);
 	if (!buf || !data)
 		errx(1, "buffer_new: malloc failed");
+	metrics_add(METRIC_BUFFER_ALLOCS, 1);
 	buf->data = data;
 	buf->len = 0;
 	buf->sz = initial_size;
@@ -39,6 +41,7 @@ buffer_append(buffer *buf, const char *input, size_t len)
 		char *newp = realloc(buf->data, newsz);
 		if (!newp)
 			err(1, "buffer_append: realloc");
+		metrics_add(METRIC_BUFFER_ALLOCS, 1);
 		buf->data = newp;
 		buf->sz = newsz;
 	}
@@ -57,6 +60,7 @@ buffer_append_iso8859_1(buffer *buf, const char *input, size_t len)
 		char *newp = realloc(buf->data, newsz);
 		if (!newp)
 			err(1, "buffer_append_iso8859_1: realloc");
+		metrics_add(METRIC_BUFFER_ALLOCS, 1);
 		buf->data = newp;
 		buf->sz = newsz;
 	}
@@ -84,6 +88,36 @@ buffer_append_iso8859_1(buffer *buf, const char *input, size_t len)
 	return 0;
 }
 
+/*
+ * Appends input (UTF-8) as a quoted JSON string, escaping quotes, backslashes
+ * and control characters.
+ */
+int
+buffer_append_json_str(buffer *buf, const char *input, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *p, *start;
+
+	buffer_append(buf, "\"", 1);
+	for (start = p = input; p < input + len; p++) {
+		uint8_t ch = *p;
+		if (ch >= 0x20 && ch != '"' && ch != '\\')
+			continue;
+		buffer_append(buf, start, p - start);
+		start = p + 1;
+		if (ch == '"' || ch == '\\') {
+			char esc[2] = { '\\', ch };
+			buffer_append(buf, esc, 2);
+		} else {
+			char esc[6] = { '\\', 'u', '0', '0', hex[ch >> 4],
+			    hex[ch & 0xf] };
+			buffer_append(buf, esc, 6);
+		}
+	}
+	buffer_append(buf, start, p - start);
+	return buffer_append(buf, "\"", 1);
+}
+
 int
 buffer_append_buf(buffer *buf, const buffer *ibuf)
 {
@@ -14,6 +14,7 @@ void		buffer_free(buffer *);
 int		buffer_append(buffer *, const char *, size_t);
 int		buffer_append_buf(buffer *, const buffer *);
 int		buffer_append_iso8859_1(buffer *, const char *, size_t);
+int		buffer_append_json_str(buffer *, const char *, size_t);
 int		buffer_append_str(buffer *, const char *);
 void		buffer_clear(buffer *);
 
@@ -0,0 +1,294 @@
+#include <stdint.h>
+#include <string.h>
+#include "buffer.h"
+#include "charset.h"
+
+/*
+ * Character sets for the client. The server sends and expects ISO-8859-1,
+ * which clients that use it get as is; UTF-8 is converted by
+ * buffer_append_iso8859_1 and client_to_iso8859_1, and other single-byte
+ * charsets through tables built from the code points of their upper half.
+ * Characters that the other side has no byte for become '?'. Text that the
+ * proxy keeps or passes on elsewhere, such as tag contents, stays in UTF-8
+ * and is converted with charset_append_utf8 when it is output.
+ */
+
+static const uint16_t cp437[128] = {
+	0x00c7, 0x00fc, 0x00e9, 0x00e2, 0x00e4, 0x00e0, 0x00e5, 0x00e7,
+	0x00ea, 0x00eb, 0x00e8, 0x00ef, 0x00ee, 0x00ec, 0x00c4, 0x00c5,
+	0x00c9, 0x00e6, 0x00c6, 0x00f4, 0x00f6, 0x00f2, 0x00fb, 0x00f9,
+	0x00ff, 0x00d6, 0x00dc, 0x00a2, 0x00a3, 0x00a5, 0x20a7, 0x0192,
+	0x00e1, 0x00ed, 0x00f3, 0x00fa, 0x00f1, 0x00d1, 0x00aa, 0x00ba,
+	0x00bf, 0x2310, 0x00ac, 0x00bd, 0x00bc, 0x00a1, 0x00ab, 0x00bb,
+	0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x2561, 0x2562, 0x2556,
+	0x2555, 0x2563, 0x2551, 0x2557, 0x255d, 0x255c, 0x255b, 0x2510,
+	0x2514, 0x2534, 0x252c, 0x251c, 0x2500, 0x253c, 0x255e, 0x255f,
+	0x255a, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256c, 0x2567,
+	0x2568, 0x2564, 0x2565, 0x2559, 0x2558, 0x2552, 0x2553, 0x256b,
+	0x256a, 0x2518, 0x250c, 0x2588, 0x2584, 0x258c, 0x2590, 0x2580,
+	0x03b1, 0x00df, 0x0393, 0x03c0, 0x03a3, 0x03c3, 0x00b5, 0x03c4,
+	0x03a6, 0x0398, 0x03a9, 0x03b4, 0x221e, 0x03c6, 0x03b5, 0x2229,
+	0x2261, 0x00b1, 0x2265, 0x2264, 0x2320, 0x2321, 0x00f7, 0x2248,
+	0x00b0, 0x2219, 0x00b7, 0x221a, 0x207f, 0x00b2, 0x25a0, 0x00a0,
+};
+
+static const uint16_t cp850[128] = {
+	0x00c7, 0x00fc, 0x00e9, 0x00e2, 0x00e4, 0x00e0, 0x00e5, 0x00e7,
+	0x00ea, 0x00eb, 0x00e8, 0x00ef, 0x00ee, 0x00ec, 0x00c4, 0x00c5,
+	0x00c9, 0x00e6, 0x00c6, 0x00f4, 0x00f6, 0x00f2, 0x00fb, 0x00f9,
+	0x00ff, 0x00d6, 0x00dc, 0x00f8, 0x00a3, 0x00d8, 0x00d7, 0x0192,
+	0x00e1, 0x00ed, 0x00f3, 0x00fa, 0x00f1, 0x00d1, 0x00aa, 0x00ba,
+	0x00bf, 0x00ae, 0x00ac, 0x00bd, 0x00bc, 0x00a1, 0x00ab, 0x00bb,
+	0x2591, 0x2592, 0x2593, 0x2502, 0x2524, 0x00c1, 0x00c2, 0x00c0,
+	0x00a9, 0x2563, 0x2551, 0x2557, 0x255d, 0x00a2, 0x00a5, 0x2510,
+	0x2514, 0x2534, 0x252c, 0x251c, 0x2500, 0x253c, 0x00e3, 0x00c3,
+	0x255a, 0x2554, 0x2569, 0x2566, 0x2560, 0x2550, 0x256c, 0x00a4,
+	0x00f0, 0x00d0, 0x00ca, 0x00cb, 0x00c8, 0x0131, 0x00cd, 0x00ce,
+	0x00cf, 0x2518, 0x250c, 0x2588, 0x2584, 0x00a6, 0x00cc, 0x2580,
+	0x00d3, 0x00df, 0x00d4, 0x00d2, 0x00f5, 0x00d5, 0x00b5, 0x00fe,
+	0x00de, 0x00da, 0x00db, 0x00d9, 0x00fd, 0x00dd, 0x00af, 0x00b4,
+	0x00ad, 0x00b1, 0x2017, 0x00be, 0x00b6, 0x00a7, 0x00f7, 0x00b8,
+	0x00b0, 0x00a8, 0x00b7, 0x00b9, 0x00b3, 0x00b2, 0x25a0, 0x00a0,
+};
+
+static const uint16_t cp1252[128] = {
+	0x20ac, 0xfffd, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+	0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0xfffd, 0x017d, 0xfffd,
+	0xfffd, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+	0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0xfffd, 0x017e, 0x0178,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x00a4, 0x00a5, 0x00a6, 0x00a7,
+	0x00a8, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x00b4, 0x00b5, 0x00b6, 0x00b7,
+	0x00b8, 0x00b9, 0x00ba, 0x00bb, 0x00bc, 0x00bd, 0x00be, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+	0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+	0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+	0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+	0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff,
+};
+
+static const uint16_t iso8859_15[128] = {
+	0x0080, 0x0081, 0x0082, 0x0083, 0x0084, 0x0085, 0x0086, 0x0087,
+	0x0088, 0x0089, 0x008a, 0x008b, 0x008c, 0x008d, 0x008e, 0x008f,
+	0x0090, 0x0091, 0x0092, 0x0093, 0x0094, 0x0095, 0x0096, 0x0097,
+	0x0098, 0x0099, 0x009a, 0x009b, 0x009c, 0x009d, 0x009e, 0x009f,
+	0x00a0, 0x00a1, 0x00a2, 0x00a3, 0x20ac, 0x00a5, 0x0160, 0x00a7,
+	0x0161, 0x00a9, 0x00aa, 0x00ab, 0x00ac, 0x00ad, 0x00ae, 0x00af,
+	0x00b0, 0x00b1, 0x00b2, 0x00b3, 0x017d, 0x00b5, 0x00b6, 0x00b7,
+	0x017e, 0x00b9, 0x00ba, 0x00bb, 0x0152, 0x0153, 0x0178, 0x00bf,
+	0x00c0, 0x00c1, 0x00c2, 0x00c3, 0x00c4, 0x00c5, 0x00c6, 0x00c7,
+	0x00c8, 0x00c9, 0x00ca, 0x00cb, 0x00cc, 0x00cd, 0x00ce, 0x00cf,
+	0x00d0, 0x00d1, 0x00d2, 0x00d3, 0x00d4, 0x00d5, 0x00d6, 0x00d7,
+	0x00d8, 0x00d9, 0x00da, 0x00db, 0x00dc, 0x00dd, 0x00de, 0x00df,
+	0x00e0, 0x00e1, 0x00e2, 0x00e3, 0x00e4, 0x00e5, 0x00e6, 0x00e7,
+	0x00e8, 0x00e9, 0x00ea, 0x00eb, 0x00ec, 0x00ed, 0x00ee, 0x00ef,
+	0x00f0, 0x00f1, 0x00f2, 0x00f3, 0x00f4, 0x00f5, 0x00f6, 0x00f7,
+	0x00f8, 0x00f9, 0x00fa, 0x00fb, 0x00fc, 0x00fd, 0x00fe, 0x00ff,
+};
+
+/* In order of preference: the first needs no conversion */
+static struct charset charsets[] = {
+	{ .name = "ISO-8859-1", .alias = "LATIN1", .kind = CHARSET_LATIN1 },
+	{ .name = "UTF-8", .kind = CHARSET_UTF8 },
+	{ .name = "WINDOWS-1252", .alias = "CP1252", .kind = CHARSET_TABLE,
+	    .high = cp1252 },
+	{ .name = "ISO-8859-15", .alias = "LATIN9", .kind = CHARSET_TABLE,
+	    .high = iso8859_15 },
+	{ .name = "CP850", .alias = "IBM850", .kind = CHARSET_TABLE,
+	    .high = cp850 },
+	{ .name = "CP437", .alias = "IBM437", .kind = CHARSET_TABLE,
+	    .high = cp437 },
+};
+
+#define NCHARSETS	(sizeof(charsets) / sizeof(charsets[0]))
+
+/*
+ * Returns whether the len bytes at s name name, ignoring case and any
+ * characters other than letters and digits, so that eg. "iso_8859-1" is
+ * "ISO-8859-1".
+ */
+static int
+same_name(const char *s, size_t len, const char *name)
+{
+	const char *end = s + len;
+
+	if (!name)
+		return 0;
+	for (;;) {
+		while (s < end && !(*s >= '0' && *s <= '9') &&
+		    !((*s | 0x20) >= 'a' && (*s | 0x20) <= 'z'))
+			s++;
+		while (*name && !(*name >= '0' && *name <= '9') &&
+		    !((*name | 0x20) >= 'a' && (*name | 0x20) <= 'z'))
+			name++;
+		if (s == end || !*name)
+			return s == end && !*name;
+		if ((*s | 0x20) != (*name | 0x20))
+			return 0;
+		s++;
+		name++;
+	}
+}
+
+static void
+build(struct charset *cs)
+{
+	memset(cs->from_latin1, '?', sizeof(cs->from_latin1));
+	for (int b = 0; b < 128; b++) {
+		uint16_t cp = cs->high[b];
+		if (cp >= 0x80 && cp <= 0xff)
+			cs->from_latin1[cp - 0x80] = 0x80 + b;
+		cs->to_latin1[b] = cp <= 0xff ? cp : '?';
+	}
+	cs->built = 1;
+}
+
+/*
+ * Returns the charset named by the len bytes at name, or NULL if there is
+ * none.
+ */
+const struct charset *
+charset_find(const char *name, size_t len)
+{
+	for (size_t i = 0; i < NCHARSETS; i++) {
+		struct charset *cs = &charsets[i];
+		if (!same_name(name, len, cs->name) &&
+		    !same_name(name, len, cs->alias))
+			continue;
+		if (cs->kind == CHARSET_TABLE && !cs->built)
+			build(cs);
+		return cs;
+	}
+	return NULL;
+}
+
+/*
+ * Appends the names of the charsets in order of preference to buf, each
+ * preceded by sep, as in a CHARSET REQUEST.
+ */
+void
+charset_list(buffer *buf, char sep)
+{
+	for (size_t i = 0; i < NCHARSETS; i++) {
+		buffer_append(buf, &sep, 1);
+		buffer_append_str(buf, charsets[i].name);
+	}
+}
+
+/*
+ * Appends len bytes of ISO-8859-1 text at s to buf in the charset cs.
+ */
+void
+charset_append(const struct charset *cs, buffer *buf, const char *s,
+    size_t len)
+{
+	size_t start = buf->len;
+
+	switch (cs->kind) {
+	case CHARSET_UTF8:
+		buffer_append_iso8859_1(buf, s, len);
+		break;
+	case CHARSET_LATIN1:
+		buffer_append(buf, s, len);
+		break;
+	case CHARSET_TABLE:
+		buffer_append(buf, s, len);
+		for (size_t i = start; i < buf->len; i++) {
+			unsigned char c = buf->data[i];
+			if (c >= 0x80)
+				buf->data[i] = cs->from_latin1[c - 0x80];
+		}
+		break;
+	}
+}
+
+/*
+ * Appends len bytes of UTF-8 text at s to buf in the charset cs. Characters
+ * outside ISO-8859-1 and invalid sequences become '?'.
+ */
+void
+charset_append_utf8(const struct charset *cs, buffer *buf, const char *s,
+    size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+
+	if (cs->kind == CHARSET_UTF8) {
+		buffer_append(buf, s, len);
+		return;
+	}
+	while (p < end) {
+		const unsigned char *q = p;
+		uint32_t cp;
+		char c;
+
+		while (q < end && *q < 0x80)
+			q++;
+		buffer_append(buf, (const char *)p, q - p);
+		if (q == end)
+			break;
+		p = q;
+		/* only 2-byte sequences can be in ISO-8859-1 */
+		if ((*p & 0xe0) == 0xc0 && p + 1 < end &&
+		    (p[1] & 0xc0) == 0x80)
+			cp = (*p & 0x1f) << 6 | (p[1] & 0x3f);
+		else
+			cp = 0;
+		p++;
+		while (p < end && (*p & 0xc0) == 0x80)
+			p++;
+		if (cp < 0xa0 || cp > 0xff)
+			c = '?';
+		else if (cs->kind == CHARSET_TABLE)
+			c = cs->from_latin1[cp - 0x80];
+		else
+			c = cp;
+		buffer_append(buf, &c, 1);
+	}
+}
+
+/*
+ * Appends len bytes of text in the charset cs at s to buf as UTF-8.
+ */
+void
+charset_to_utf8(const struct charset *cs, buffer *buf, const char *s,
+    size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s, *end = p + len;
+
+	switch (cs->kind) {
+	case CHARSET_UTF8:
+		buffer_append(buf, s, len);
+		return;
+	case CHARSET_LATIN1:
+		buffer_append_iso8859_1(buf, s, len);
+		return;
+	case CHARSET_TABLE:
+		break;
+	}
+	while (p < end) {
+		const unsigned char *q = p;
+		char u[3];
+		uint16_t cp;
+
+		while (q < end && *q < 0x80)
+			q++;
+		buffer_append(buf, (const char *)p, q - p);
+		if (q == end)
+			break;
+		cp = cs->high[*q - 0x80];
+		if (cp < 0x800) {
+			u[0] = 0xc0 | cp >> 6;
+			u[1] = 0x80 | (cp & 0x3f);
+			buffer_append(buf, u, 2);
+		} else {
+			u[0] = 0xe0 | cp >> 12;
+			u[1] = 0x80 | (cp >> 6 & 0x3f);
+			u[2] = 0x80 | (cp & 0x3f);
+			buffer_append(buf, u, 3);
+		}
+		p = q + 1;
+	}
+}
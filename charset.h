@@ -0,0 +1,46 @@
+#ifndef CHARSET_H
+#define CHARSET_H
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/* TELNET option for character set negotiation (RFC 2066) */
+#define TELOPT_CHARSET		42
+#define CHARSET_WILL		"\xff\xfb\x2a"
+#define CHARSET_WONT		"\xff\xfc\x2a"
+#define CHARSET_DO		"\xff\xfd\x2a"
+#define CHARSET_DONT		"\xff\xfe\x2a"
+
+/* CHARSET subnegotiation commands */
+#define CHARSET_REQUEST		1
+#define CHARSET_ACCEPTED	2
+#define CHARSET_REJECTED	3
+#define CHARSET_TTABLE_IS	4
+#define CHARSET_TTABLE_REJECTED	5
+
+enum charset_kind {
+	CHARSET_UTF8,		/* converted from and to ISO-8859-1 */
+	CHARSET_LATIN1,		/* the server's own; passed as is */
+	CHARSET_TABLE,		/* other single-byte charsets */
+};
+
+struct charset {
+	const char		*name;
+	const char		*alias;
+	enum charset_kind	kind;
+	const uint16_t		*high;		/* code points of 0x80-0xff */
+	int			built;		/* the tables below are set */
+	unsigned char		from_latin1[128];	/* for 0x80-0xff */
+	unsigned char		to_latin1[128];
+};
+
+const struct charset	*charset_find(const char *, size_t);
+void			charset_list(buffer *, char);
+void			charset_append(const struct charset *, buffer *,
+			    const char *, size_t);
+void			charset_append_utf8(const struct charset *, buffer *,
+			    const char *, size_t);
+void			charset_to_utf8(const struct charset *, buffer *,
+			    const char *, size_t);
+
+#endif /* CHARSET_H */
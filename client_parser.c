@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "charset.h"
 #include "client_parser.h"
 
 enum client_state {
@@ -13,20 +14,69 @@ enum client_state {
 	s_utf8_continuation,
 	s_iac,		/* TELNET IAC (\xff) */
 	s_iac_3byte,	/* TELNET IAC + WILL/WONT/DO/DONT */
+	s_sb_opt,	/* TELNET IAC SB */
+	s_sb,		/* inside subnegotiation */
+	s_sb_iac,	/* TELNET IAC inside subnegotiation */
 };
 
+/* Longest subnegotiation the proxy handles itself; excess is dropped */
+#define SB_MAX 4096
+
 static enum client_state state = s_text;
 static enum client_state stored_state = s_text;
 static unsigned continuation_bytes_left = 0;
 static uint32_t codepoint = 0;
+static char cmd[3] = { '\xff' };
+static char sb[SB_MAX];
+static size_t sblen = 0;
+static int sb_claimed = 0;
+static const struct charset *charset;	/* NULL for UTF-8 */
+
+static char *
+sb_byte(char *dst, char ch)
+{
+	if (!sb_claimed)
+		*dst++ = ch;
+	else if (sblen < SB_MAX - 2)
+		sb[sblen++] = ch;
+	return dst;
+}
+
+/*
+ * Writes the ISO-8859-1 character ch to dst for the server, escaping 0xff as
+ * IAC IAC. Returns the new end of dst.
+ */
+static char *
+put_latin1(char *dst, unsigned char ch)
+{
+	if (ch == 0xff)
+		*dst++ = '\xff';
+	*dst++ = ch;
+	return dst;
+}
 
 /*
- * Convert UTF-8 to ISO-8859-1, but pass telnet commands as-is.
- * dst should be at least the same size as src (ie. len bytes long).
+ * Sets the charset that the client sends text in; UTF-8 if cs is NULL or
+ * until this is called.
+ */
+void
+client_charset(const struct charset *cs)
+{
+	charset = cs && cs->kind != CHARSET_UTF8 ? cs : NULL;
+}
+
+/*
+ * Convert the client's charset to ISO-8859-1, but pass telnet commands as-is
+ * unless cb (if not NULL) claims them. cb may change the charset for the rest
+ * of the input.
+ * A telnet command split over two calls is only written once it is complete,
+ * and a character that is 0xff in ISO-8859-1 is sent as IAC IAC, so dst
+ * should be at least 2 * len + 2 bytes long.
  * Returns the number of bytes written to dst.
 */
 size_t
-client_utf8_to_iso8859_1(char *dst, const char *src, size_t len)
+client_to_iso8859_1(char *dst, const char *src, size_t len,
+    client_telnet_cb cb, void *arg)
 {
 	char *origdst = dst;
 	const char *p;
@@ -38,15 +88,26 @@ client_utf8_to_iso8859_1(char *dst, const char *src, size_t len)
 		 * utf8 character's bytes (though that is maybe unlikely). So
 		 * special-case it here and store current state.
 		 */
-		if (ch == 0xff && state != s_iac && state != s_iac_3byte) {
+		if (ch == 0xff && (state == s_text ||
+		    state == s_utf8_continuation)) {
 			stored_state = state;
 			state = s_iac;
 			continue;
 		}
 		switch (state) {
 		case s_text:
-			if (ch < 0x80) {
+			if (charset && charset->kind == CHARSET_LATIN1) {
+				/* the rest of the text up to an IAC as is */
+				const char *q = memchr(p, 0xff, src + len - p);
+				size_t n = (q ? q : src + len) - p;
+				memcpy(dst, p, n);
+				dst += n;
+				p += n - 1;
+			} else if (ch < 0x80) {
 				*dst++ = ch;
+			} else if (charset) {
+				dst = put_latin1(dst,
+				    charset->to_latin1[ch - 0x80]);
 			} else if ((ch & 0xe0) == 0xc0) {
 				/* first 3 bits: 110 */
 				state = s_utf8_continuation;
@@ -86,7 +147,7 @@ client_utf8_to_iso8859_1(char *dst, const char *src, size_t len)
 			codepoint |= (newbits << (continuation_bytes_left * 6));
 			if (!continuation_bytes_left) {
 				if (codepoint >= 0xa0 && codepoint <= 0xff)
-					*dst++ = codepoint;
+					dst = put_latin1(dst, codepoint);
 				else
 					*dst++ = '?';
 				codepoint = 0;
@@ -96,31 +157,88 @@ client_utf8_to_iso8859_1(char *dst, const char *src, size_t len)
 		case s_iac:
 			if (ch == 0xff) {
 				/*
-				 * TELNET-escaped 0xff byte - this makes no
-				 * sense coming from the client as utf-8
-				 * strings cannot contain 0xff (and the client
-				 * does not send xterm control sequences or
-				 * other binary to the server). Treat this as
-				 * invalid byte.
+				 * TELNET-escaped 0xff byte - a character in
+				 * single-byte charsets, but utf-8 strings
+				 * cannot contain 0xff (and the client does
+				 * not send xterm control sequences or other
+				 * binary to the server), so there treat this
+				 * as invalid byte.
 				 */
-				*dst++ = '?';
+				if (!charset)
+					*dst++ = '?';
+				else if (charset->kind == CHARSET_LATIN1)
+					dst = put_latin1(dst, 0xff);
+				else
+					dst = put_latin1(dst,
+					    charset->to_latin1[0x7f]);
 				state = stored_state;
 				continue;
 			}
-			*dst++ = '\xff';
-			*dst++ = ch;
-			/* IAC WILL/WONT/DO/DONT */
-			if (ch == 0xfb || ch == 0xfc || ch == 0xfc ||
-			    ch == 0xfe)
+			cmd[1] = ch;
+			if (ch == 0xfa) {
+				/* IAC SB */
+				state = s_sb_opt;
+			} else if (ch == 0xfb || ch == 0xfc || ch == 0xfd ||
+			    ch == 0xfe) {
+				/* IAC WILL/WONT/DO/DONT */
 				state = s_iac_3byte;
-			else
+			} else {
+				if (!cb || !cb(arg, cmd, 2)) {
+					*dst++ = '\xff';
+					*dst++ = ch;
+				}
 				state = stored_state;
+			}
 			break;
 		case s_iac_3byte:
 			/* third byte of 3-byte command */
-			*dst++ = ch;
+			cmd[2] = ch;
+			if (!cb || !cb(arg, cmd, 3)) {
+				memcpy(dst, cmd, 3);
+				dst += 3;
+			}
 			state = stored_state;
 			break;
+		case s_sb_opt:
+			cmd[2] = ch;
+			sb_claimed = cb && cb(arg, cmd, 3);
+			if (sb_claimed) {
+				memcpy(sb, cmd, 3);
+				sblen = 3;
+			} else {
+				memcpy(dst, cmd, 3);
+				dst += 3;
+			}
+			state = s_sb;
+			break;
+		case s_sb:
+			if (ch == 0xff)
+				state = s_sb_iac;
+			else
+				dst = sb_byte(dst, ch);
+			break;
+		case s_sb_iac:
+			if (ch == 0xf0) {
+				/* IAC SE */
+				if (sb_claimed) {
+					sb[sblen++] = '\xff';
+					sb[sblen++] = '\xf0';
+					cb(arg, sb, sblen);
+				} else {
+					*dst++ = '\xff';
+					*dst++ = '\xf0';
+				}
+				state = stored_state;
+				break;
+			}
+			/* IAC IAC is an escaped 0xff; pass anything else on */
+			if (!sb_claimed)
+				*dst++ = '\xff';
+			else if (ch != 0xff)
+				dst = sb_byte(dst, '\xff');
+			dst = sb_byte(dst, ch);
+			state = s_sb;
+			break;
 		}
 	}
 	return (dst - origdst);
@@ -1,4 +1,20 @@
 #ifndef CLIENT_PARSER_H
 #define CLIENT_PARSER_H
-size_t client_utf8_to_iso8859_1(char *, const char *, size_t);
+/*
+ * Called with TELNET commands received from the client. Returns nonzero if
+ * the proxy handles the command itself, in which case it is not passed on to
+ * the server.
+ *
+ * Subnegotiations are offered first as the three bytes IAC SB <option>; if
+ * the callback claims that, the complete subnegotiation (IAC SB ... IAC SE,
+ * with IAC IAC unescaped) is passed to the callback once it has been
+ * received. Otherwise the subnegotiation is passed to the server as is.
+ */
+typedef int (*client_telnet_cb)(void *, const char *, size_t);
+
+struct charset;
+
+void	client_charset(const struct charset *);
+size_t	client_to_iso8859_1(char *, const char *, size_t, client_telnet_cb,
+	    void *);
 #endif
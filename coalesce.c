@@ -0,0 +1,243 @@
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "buffer.h"
+#include "coalesce.h"
+#include "config.h"
+#include "status.h"
+
+/*
+ * Coalescing of frequent status updates: instead of being output right away,
+ * an update is held until the next prompt or until the window (in
+ * milliseconds) since the oldest held update has passed. Only the latest
+ * update for each key (tag code plus eg. prot name or party member name) is
+ * output, and only if it differs from what was last output for that key.
+ */
+
+struct entry {
+	int		code;
+	char		key[STATUS_NAME_MAX];
+	buffer		*pending;
+	buffer		*last;
+	int		has_pending;
+	unsigned long	seq;		/* order of first pending update */
+	unsigned long	used;		/* order of the latest update */
+};
+
+struct coalesce {
+	int			window;
+	int			nentries;
+	struct entry		entries[COALESCE_MAX_KEYS];
+	unsigned long		seq;
+	unsigned long		uses;
+	int			npending;
+	struct timespec		deadline;
+	struct coalesce_stats	stats;
+};
+
+struct coalesce *
+coalesce_new(int window)
+{
+	struct coalesce *c;
+
+	if (window <= 0)
+		return NULL;
+	if (!(c = calloc(1, sizeof(struct coalesce))))
+		err(1, "coalesce_new: malloc");
+	c->window = window;
+	return c;
+}
+
+void
+coalesce_free(struct coalesce *c)
+{
+	if (!c)
+		return;
+	for (int i = 0; i < c->nentries; i++) {
+		buffer_free(c->entries[i].pending);
+		buffer_free(c->entries[i].last);
+	}
+	free(c);
+}
+
+static struct entry *
+entry_find(struct coalesce *c, int code, const char *key)
+{
+	for (int i = 0; i < c->nentries; i++)
+		if (c->entries[i].code == code &&
+		    strcmp(c->entries[i].key, key) == 0)
+			return &c->entries[i];
+	return NULL;
+}
+
+/*
+ * Returns the least recently updated entry without a held update, or NULL if
+ * all of them hold one.
+ */
+static struct entry *
+entry_lru(struct coalesce *c)
+{
+	struct entry *lru = NULL;
+
+	for (int i = 0; i < c->nentries; i++)
+		if (!c->entries[i].has_pending &&
+		    (!lru || c->entries[i].used < lru->used))
+			lru = &c->entries[i];
+	return lru;
+}
+
+/*
+ * Returns the entry for code and key, adding it if needed. If all entries are
+ * taken, the least recently updated one is reused. Returns NULL if they all
+ * hold an update.
+ */
+static struct entry *
+entry_get(struct coalesce *c, int code, const char *key)
+{
+	struct entry *e;
+
+	if (!(e = entry_find(c, code, key))) {
+		if (c->nentries < COALESCE_MAX_KEYS) {
+			e = &c->entries[c->nentries++];
+			e->pending = buffer_new(128);
+			e->last = buffer_new(128);
+		} else if ((e = entry_lru(c))) {
+			c->stats.evicted++;
+			buffer_clear(e->last);
+		} else
+			return NULL;
+		e->code = code;
+		strlcpy(e->key, key, sizeof(e->key));
+	}
+	e->used = c->uses++;
+	return e;
+}
+
+static int
+buffer_equal(const buffer *a, const char *data, size_t len)
+{
+	return a->len == len && memcmp(a->data, data, len) == 0;
+}
+
+/*
+ * Offers the output bytes for a status update of tag code with the given key.
+ * Returns 1 if the update is held (or dropped as a duplicate) by the
+ * coalescer, or 0 if the caller should output it right away. c may be NULL.
+ */
+int
+coalesce_put(struct coalesce *c, int code, const char *key, const char *data,
+    size_t len)
+{
+	struct entry *e;
+
+	if (!c || !(e = entry_get(c, code, key)))
+		return 0;
+	c->stats.updates++;
+	if (e->has_pending) {
+		c->stats.superseded++;
+		buffer_clear(e->pending);
+	} else if (buffer_equal(e->last, data, len)) {
+		c->stats.duplicates++;
+		return 1;
+	} else {
+		e->has_pending = 1;
+		e->seq = c->seq++;
+		if (c->npending++ == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &c->deadline);
+			c->deadline.tv_sec += c->window / 1000;
+			c->deadline.tv_nsec += (c->window % 1000) * 1000000L;
+			if (c->deadline.tv_nsec >= 1000000000L) {
+				c->deadline.tv_sec++;
+				c->deadline.tv_nsec -= 1000000000L;
+			}
+		}
+	}
+	buffer_append(e->pending, data, len);
+	return 1;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct entry *ea = *(const struct entry **)a;
+	const struct entry *eb = *(const struct entry **)b;
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+/*
+ * Passes all held updates to emit, in the order they were first held.
+ */
+void
+coalesce_flush(struct coalesce *c, coalesce_emit_cb emit, void *arg)
+{
+	struct entry *pending[COALESCE_MAX_KEYS];
+	int n = 0;
+
+	if (!c || !c->npending)
+		return;
+	for (int i = 0; i < c->nentries; i++)
+		if (c->entries[i].has_pending)
+			pending[n++] = &c->entries[i];
+	qsort(pending, n, sizeof(pending[0]), entry_cmp);
+	for (int i = 0; i < n; i++) {
+		struct entry *e = pending[i];
+		buffer *tmp;
+		e->has_pending = 0;
+		if (buffer_equal(e->last, e->pending->data, e->pending->len)) {
+			c->stats.duplicates++;
+			buffer_clear(e->pending);
+			continue;
+		}
+		emit(arg, e->code, e->key, e->pending->data, e->pending->len);
+		c->stats.emitted++;
+		tmp = e->last;
+		e->last = e->pending;
+		e->pending = tmp;
+		buffer_clear(e->pending);
+	}
+	c->npending = 0;
+}
+
+/*
+ * Forgets code and key, dropping any update held for it, eg. when a party
+ * member has left. The next update for it is output even if it is the same as
+ * the last one.
+ */
+void
+coalesce_forget(struct coalesce *c, int code, const char *key)
+{
+	struct entry *e;
+
+	if (!c || !(e = entry_find(c, code, key)))
+		return;
+	if (e->has_pending)
+		c->npending--;
+	buffer_free(e->pending);
+	buffer_free(e->last);
+	*e = c->entries[--c->nentries];
+}
+
+/*
+ * Returns the number of milliseconds until held updates should be flushed (0
+ * if they are overdue), or -1 if nothing is held. Suitable as a poll timeout.
+ */
+int
+coalesce_timeout(struct coalesce *c)
+{
+	struct timespec now;
+	long ms;
+
+	if (!c || !c->npending)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (c->deadline.tv_sec - now.tv_sec) * 1000 +
+	    (c->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	return ms < 0 ? 0 : ms;
+}
+
+const struct coalesce_stats *
+coalesce_stats(struct coalesce *c)
+{
+	return c ? &c->stats : NULL;
+}
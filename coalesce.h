@@ -0,0 +1,35 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+#include <stddef.h>
+
+/*
+ * Distinct (tag, key) pairs tracked; the least recently updated one without a
+ * held update is forgotten to make room for another
+ */
+#define COALESCE_MAX_KEYS	128
+
+struct coalesce_stats {
+	unsigned long	updates;	/* status lines offered */
+	unsigned long	emitted;	/* status lines output */
+	unsigned long	superseded;	/* replaced by a newer value */
+	unsigned long	duplicates;	/* same as the last output value */
+	unsigned long	evicted;	/* keys forgotten to make room */
+};
+
+struct coalesce;
+
+/* Called by coalesce_flush with the tag code, key and output bytes */
+typedef void (*coalesce_emit_cb)(void *, int, const char *, const char *,
+    size_t);
+
+struct coalesce *	coalesce_new(int);
+void			coalesce_free(struct coalesce *);
+int			coalesce_put(struct coalesce *, int, const char *,
+			    const char *, size_t);
+void			coalesce_flush(struct coalesce *, coalesce_emit_cb,
+			    void *);
+void			coalesce_forget(struct coalesce *, int, const char *);
+int			coalesce_timeout(struct coalesce *);
+const struct coalesce_stats *coalesce_stats(struct coalesce *);
+
+#endif /* COALESCE_H */
@@ -0,0 +1,15 @@
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+int
+main(void)
+{
+	/* just a compilation test; the kernel is checked at run time */
+	struct io_uring_buf_reg reg = { .bgid = 0 };
+	struct io_uring_getevents_arg arg = { .ts = 0 };
+	(void)reg;
+	(void)arg;
+	return syscall(__NR_io_uring_setup, 0, (void *)0) +
+	    IORING_RECV_MULTISHOT + IORING_REGISTER_PBUF_RING +
+	    IORING_ASYNC_CANCEL_ANY;
+}
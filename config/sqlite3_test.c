@@ -0,0 +1,11 @@
+#include <sqlite3.h>
+#if SQLITE_VERSION_NUMBER < 3024000
+#error upsert needs sqlite 3.24
+#endif
+int
+main(void)
+{
+	/* just a compilation/link test */
+	sqlite3 *db;
+	return sqlite3_open(":memory:", &db);
+}
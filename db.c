@@ -1,33 +1,473 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "db.h"
+#include "hashset.h"
+#include "metrics.h"
+#include "xmalloc.h"
 
+/*
+ * Backend writes are done by a writer thread, so that a slow database never
+ * stalls proxying. db_add_room and db_add_exit only copy the rooms into a
+ * bounded queue; if the writer falls behind by DB_QUEUE_MAX writes, further
+ * writes are dropped (and counted) until it catches up. db_free waits for the
+ * queue to drain before closing the backend.
+ *
+ * Backends with a flush function may hold writes to batch them; the writer
+ * calls it once DB_FLUSH_MS has passed since the first write after the
+ * previous flush, or once DB_BATCH_MAX writes are held. Writes are counted as
+ * written only when their batch is committed.
+ *
+ * Rooms and exits that are already stored are skipped before they reach the
+ * queue: the writer keeps a map from hashes of room ids to the room hashes
+ * (see room_new) and a set of hashes of (source, destination) pairs, filled
+ * from the backend's load function at startup and by every queued write. A
+ * room whose hash differs from the stored one has changed and is written
+ * again; the backend keeps the previous version. The writes of a batch that
+ * fails are handed back to the main thread, which removes them from the map
+ * and set, so that they are written again when next seen. Exits from or to a
+ * room that was lost like this are handed back without being written until
+ * the room is, as the backends skip exits whose rooms are not stored.
+ */
+
+struct job {
+	struct room	*room;		/* room to add, or exit destination */
+	struct room	*src;		/* exit source; NULL for rooms */
+};
+
+/* A write held in a batch, or lost with one */
+struct key {
+	uint64_t	h;		/* room_hash or exit_hash */
+	uint64_t	hash;		/* room hash; 0 for exits */
+	int		exit;
+};
+
+struct db_writer {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	struct job	jobs[DB_QUEUE_MAX];
+	size_t		head;
+	size_t		len;
+	int		done;
+	struct db_stats	stats;
+	struct key	batch[DB_BATCH_MAX];	/* held by the backend */
+	size_t		nbatch;
+	struct hashset	*lostrooms;	/* rooms lost and not written since */
+	struct key	*lost;		/* for the main thread to forget */
+	size_t		nlost, lostcap;
+	struct hashset	*seen;		/* only used by the main thread */
+};
+
+static uint64_t
+room_hash(const char *id)
+{
+	return hash_str(HASH_INIT, id);
+}
+
+static uint64_t
+exit_hash(const char *src, const char *dest)
+{
+	return hash_str(hash_str(HASH_INIT, src), dest);
+}
+
+static int
+timespec_passed(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec > t->tv_sec ||
+	    (now.tv_sec == t->tv_sec && now.tv_nsec >= t->tv_nsec);
+}
+
+/*
+ * Records the duration of a backend call started at start, and its failure
+ * if status is -1.
+ */
+static void
+call_done(const struct timespec *start, int status)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	metrics_observe(METRIC_DB_CALL_USEC,
+	    (now.tv_sec - start->tv_sec) * 1000000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000);
+	if (status == -1)
+		metrics_add(METRIC_DB_ERRORS, 1);
+}
+
+/*
+ * Hands n lost writes to the main thread to forget.
+ */
+static void
+writer_lost(struct db_writer *w, const struct key *keys, size_t n)
+{
+	if (w->nlost + n > w->lostcap) {
+		w->lostcap = w->lostcap * 2 > w->nlost + n ?
+		    w->lostcap * 2 : w->nlost + n;
+		w->lost = xreallocarray(w->lost, w->lostcap,
+		    sizeof(struct key));
+	}
+	memcpy(w->lost + w->nlost, keys, n * sizeof(struct key));
+	w->nlost += n;
+	w->stats.failed += n;
+}
+
+/*
+ * Ends the current batch, which was committed if ok is set and lost if not.
+ */
+static void
+batch_done(struct db_writer *w, int ok)
+{
+	if (ok)
+		w->stats.written += w->nbatch;
+	else {
+		for (size_t i = 0; i < w->nbatch; i++)
+			if (!w->batch[i].exit)
+				hashset_add(w->lostrooms, w->batch[i].h);
+		writer_lost(w, w->batch, w->nbatch);
+	}
+	w->nbatch = 0;
+}
+
+/*
+ * Asks the backend to commit writes it has batched, if any.
+ */
+static void
+writer_flush(struct db *db)
+{
+	struct db_writer *w = db->writer;
+	struct timespec start;
+	int status;
+
+	if (!w->nbatch)
+		return;
+	pthread_mutex_unlock(&w->lock);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	status = db->flush(db->dbp);
+	call_done(&start, status);
+	pthread_mutex_lock(&w->lock);
+	batch_done(w, status != -1);
+}
+
+static void *
+writer_main(void *arg)
+{
+	struct db *db = arg;
+	struct db_writer *w = db->writer;
+	struct timespec deadline, start;
+	struct job job;
+	struct key key;
+	int status, lost;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->len && !w->done) {
+			if (!w->nbatch) {
+				pthread_cond_wait(&w->cond, &w->lock);
+				continue;
+			}
+			if (pthread_cond_timedwait(&w->cond, &w->lock,
+			    &deadline) == ETIMEDOUT)
+				writer_flush(db);
+		}
+		if (w->nbatch && timespec_passed(&deadline))
+			writer_flush(db);
+		if (!w->len)
+			break;
+		job = w->jobs[w->head];
+		w->head = (w->head + 1) % DB_QUEUE_MAX;
+		w->len--;
+		pthread_mutex_unlock(&w->lock);
+
+		if (job.src) {
+			key = (struct key){
+			    exit_hash(job.src->id, job.room->id), 0, 1 };
+			lost = hashset_has(w->lostrooms,
+			    room_hash(job.src->id)) ||
+			    hashset_has(w->lostrooms, room_hash(job.room->id));
+		} else {
+			key = (struct key){ room_hash(job.room->id),
+			    job.room->hash, 0 };
+			lost = 0;
+		}
+		if (!lost) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (job.src)
+				status = db->add_exit(db->dbp, job.src,
+				    job.room);
+			else
+				status = db->add_room(db->dbp, job.room);
+			call_done(&start, status);
+		}
+		room_free(job.src);
+		room_free(job.room);
+
+		pthread_mutex_lock(&w->lock);
+		if (lost) {
+			writer_lost(w, &key, 1);
+			continue;
+		}
+		w->batch[w->nbatch++] = key;
+		/* exits after it in the batch are committed or lost with it */
+		if (status != -1 && !key.exit)
+			hashset_del(w->lostrooms, key.h);
+		if (status == -1 || !db->flush)
+			batch_done(w, status != -1);
+		else if (w->nbatch == DB_BATCH_MAX)
+			writer_flush(db);
+		else if (w->nbatch == 1) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += DB_FLUSH_MS / 1000;
+			deadline.tv_nsec += DB_FLUSH_MS % 1000 * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+		}
+	}
+	writer_flush(db);
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+struct loader {
+	struct hashset	*seen;
+	db_load_cb	cb;
+	void		*arg;
+};
+
+static void
+load_cb(void *arg, const char *id, const char *area, const char *dest,
+    const char *direction, uint64_t hash)
+{
+	struct loader *l = arg;
+
+	if (dest)
+		hashset_add(l->seen, exit_hash(id, dest));
+	else
+		hashset_put(l->seen, room_hash(id), hash);
+	if (l->cb)
+		l->cb(l->arg, id, area, dest, direction, hash);
+}
+
+/*
+ * Opens the backend; param is passed to its init function (eg. a file name or
+ * connection string) and may be NULL for its default. The stored rooms and
+ * exits are also passed to cb, if it is not NULL.
+ */
 void
-db_init(struct db *db)
+db_init(struct db *db, const char *param, db_load_cb cb, void *arg)
 {
+	struct loader loader = { .cb = cb, .arg = arg };
+	sigset_t set, old;
+	int error;
+
 	if (db->dbp_init)
-		db->dbp = db->dbp_init();
+		db->dbp = db->dbp_init(param);
+	if (!db->add_room && !db->add_exit)
+		return;
+	if (!(db->writer = calloc(1, sizeof(struct db_writer))))
+		err(1, "db_init: malloc");
+	db->writer->seen = loader.seen = hashset_new();
+	db->writer->lostrooms = hashset_new();
+	if (db->load && db->load(db->dbp, load_cb, &loader) == -1)
+		warnx("db: failed to load stored rooms");
+	pthread_mutex_init(&db->writer->lock, NULL);
+	pthread_cond_init(&db->writer->cond, NULL);
+	/*
+	 * SIGUSR1 is for the main thread, whose poll it interrupts; it
+	 * shouldn't interrupt the writer's database calls instead.
+	 */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	error = pthread_create(&db->writer->thread, NULL, writer_main, db);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error != 0) {
+		errno = error;
+		err(1, "db_init: pthread_create");
+	}
 }
 
 void
 db_free(struct db *db)
 {
+	struct db_writer *w = db->writer;
+
+	if (w) {
+		pthread_mutex_lock(&w->lock);
+		w->done = 1;
+		pthread_cond_signal(&w->cond);
+		pthread_mutex_unlock(&w->lock);
+		pthread_join(w->thread, NULL);
+		if (w->stats.dropped)
+			warnx("db: dropped %lu writes", w->stats.dropped);
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->cond);
+		hashset_free(w->seen);
+		hashset_free(w->lostrooms);
+		free(w->lost);
+		free(w);
+		db->writer = NULL;
+	}
 	if (db->dbp_free)
 		db->dbp_free(db->dbp);
 	db->dbp = NULL;
 }
 
+/*
+ * Queues a write for the writer thread. Takes ownership of room and src.
+ */
+static int
+enqueue(struct db *db, struct room *room, struct room *src)
+{
+	struct db_writer *w = db->writer;
+	int status = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->len == DB_QUEUE_MAX) {
+		w->stats.dropped++;
+		status = -1;
+	} else {
+		w->jobs[(w->head + w->len) % DB_QUEUE_MAX] =
+		    (struct job){ room, src };
+		w->len++;
+		w->stats.queued++;
+		if (w->len > w->stats.highwater)
+			w->stats.highwater = w->len;
+		pthread_cond_signal(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (status == -1) {
+		room_free(room);
+		room_free(src);
+	}
+	return status;
+}
+
+/*
+ * Forgets the writes lost with failed batches, so that they are queued again
+ * when next seen.
+ */
+static void
+forget_lost(struct db_writer *w)
+{
+	uint64_t stored;
+
+	pthread_mutex_lock(&w->lock);
+	for (size_t i = 0; i < w->nlost; i++) {
+		struct key *k = &w->lost[i];
+		/* unless the room has been queued again since, as changed */
+		if (k->exit || (hashset_get(w->seen, k->h, &stored) &&
+		    stored == k->hash))
+			hashset_del(w->seen, k->h);
+	}
+	w->nlost = 0;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Returns 1 if the write with hash h was already stored or queued, counting
+ * hits and misses.
+ */
+static int
+seen(struct db_writer *w, uint64_t h)
+{
+	if (hashset_has(w->seen, h)) {
+		w->stats.hits++;
+		return 1;
+	}
+	w->stats.misses++;
+	return 0;
+}
+
 int
 db_add_room(struct db *db, struct room *room)
 {
-	if (db->add_room)
-		return db->add_room(db->dbp, room);
+	struct db_writer *w = db->writer;
+	struct room *copy;
+	uint64_t h = room_hash(room->id), stored;
+	int known;
+
+	if (!db->add_room)
+		return 0;
+	forget_lost(w);
+	known = hashset_get(w->seen, h, &stored);
+	if (known && stored == room->hash) {
+		w->stats.hits++;
+		return 0;
+	}
+	if (known)
+		w->stats.changed++;
+	else
+		w->stats.misses++;
+	if (!(copy = room_dup(room)))
+		err(1, "db_add_room: malloc");
+	if (enqueue(db, copy, NULL) == -1)
+		return -1;
+	hashset_put(w->seen, h, room->hash);
 	return 0;
 }
 
 int
 db_add_exit(struct db *db, struct room *a, struct room *b)
 {
-	if (db->add_exit)
-		return db->add_exit(db->dbp, a, b);
+	struct room *src, *dest;
+	uint64_t h;
+
+	if (!db->add_exit)
+		return 0;
+	forget_lost(db->writer);
+	if (seen(db->writer, h = exit_hash(a->id, b->id)))
+		return 0;
+	if (!(src = room_dup(a)) || !(dest = room_dup(b)))
+		err(1, "db_add_exit: malloc");
+	if (enqueue(db, dest, src) == -1)
+		return -1;
+	hashset_add(db->writer->seen, h);
+	return 0;
+}
+
+/*
+ * Copies the writer counters to stats. Returns -1 if there is no writer.
+ */
+int
+db_stats(struct db *db, struct db_stats *stats)
+{
+	struct db_writer *w = db->writer;
+
+	if (!w)
+		return -1;
+	pthread_mutex_lock(&w->lock);
+	*stats = w->stats;
+	pthread_mutex_unlock(&w->lock);
+	stats->seen = hashset_len(w->seen);
 	return 0;
 }
+
+/*
+ * Returns the key under which the backends store text s: its hash_str, as a
+ * signed integer since SQL has no unsigned types.
+ */
+int64_t
+db_key(const char *s)
+{
+	return (int64_t)hash_str(HASH_INIT, s);
+}
+
+/*
+ * Returns the key under which a description s is stored if its db_key is
+ * already taken by another text: s hashed again after its db_key.
+ */
+int64_t
+db_key_alt(const char *s)
+{
+	return (int64_t)hash_str(hash_str(HASH_INIT, s), s);
+}
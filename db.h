@@ -1,18 +1,69 @@
 #ifndef DB_H
 #define DB_H
+#include <stddef.h>
+#include <stdint.h>
 #include "room.h"
 
+/* Writes waiting for the writer thread; further writes are dropped */
+#define DB_QUEUE_MAX	1024
+/* Maximum time writes may be held by the backend before a flush */
+#define DB_FLUSH_MS	500
+/* Most writes held by the backend before a flush */
+#define DB_BATCH_MAX	256
+
+struct db_stats {
+	unsigned long	queued;		/* writes accepted */
+	unsigned long	written;	/* writes done by the backend */
+	unsigned long	failed;		/* writes failed or rolled back */
+	unsigned long	dropped;	/* writes dropped, queue full */
+	size_t		highwater;	/* maximum queue length */
+	unsigned long	hits;		/* writes skipped, already stored */
+	unsigned long	misses;		/* writes of new rooms and exits */
+	unsigned long	changed;	/* writes of changed rooms */
+	size_t		seen;		/* rooms and exits known to be stored */
+};
+
+/*
+ * Called by the load function for each stored room with its id, area, NULL,
+ * NULL and room hash (0 if not stored), and for each exit with its source,
+ * NULL, destination, direction and 0.
+ */
+typedef void (*db_load_cb)(void *, const char *, const char *, const char *,
+    const char *, uint64_t);
+
+/*
+ * Called by the rooms function for each stored room. Only id, area,
+ * shortdesc, longdesc, exits and indoors are set.
+ */
+typedef void (*db_room_cb)(void *, const struct room *);
+
+struct db_writer;
+
+/*
+ * A backend with a flush function may hold writes in a batch, which flush
+ * commits; the writer calls it after at most DB_BATCH_MAX writes. A failed
+ * add_room or add_exit ends the batch, so the writes held with it are lost
+ * too. Without a flush function, each write is done when add_room or add_exit
+ * returns. All return -1 on failure.
+ */
 struct db {
 	void *dbp;
-	void *(*dbp_init)(void);
+	void *(*dbp_init)(const char *);
 	void (*dbp_free)(void *);
 	int (*add_room)(void *, struct room *);
 	int (*add_exit)(void *, struct room *, struct room *);
+	int (*flush)(void *);	/* commit batched writes; optional */
+	int (*load)(void *, db_load_cb, void *); /* list stored; optional */
+	int (*rooms)(void *, db_room_cb, void *); /* list rooms; optional */
+	struct db_writer *writer;
 };
 
-void db_init(struct db *);
+void db_init(struct db *, const char *, db_load_cb, void *);
 void db_free(struct db *);
 int db_add_room(struct db *, struct room *);
 int db_add_exit(struct db *, struct room *, struct room *);
+int db_stats(struct db *, struct db_stats *);
+int64_t db_key(const char *);
+int64_t db_key_alt(const char *);
 
 #endif /* DB_H */
@@ -0,0 +1,363 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "config.h"
+#include "events.h"
+#include "net.h"
+
+/*
+ * Event feed: status tags are published as records on a local unix socket so
+ * that other programs don't have to scrape the marker lines sent to the MUD
+ * client. Each record is a 4-byte big-endian length followed by that many
+ * bytes of JSON, eg.
+ *     {"code":64,"type":"prot","data":"lay_on_hands 120"}
+ *
+ * Subscribers never block the proxy: sockets are nonblocking, and records
+ * that don't fit into a subscriber's queue are dropped (and counted).
+ *
+ * Subscribers may also send newline-terminated requests, eg. "state"; these
+ * are passed to the request handler and the reply is sent back as a record
+ * on the same connection.
+ */
+
+struct subscriber {
+	int		fd;
+	buffer		*queue;
+	size_t		off;		/* bytes of queue already sent */
+	buffer		*in;		/* partial request line */
+	unsigned long	dropped;
+};
+
+struct events {
+	char			*path;
+	int			listenfd;
+	struct subscriber	subs[EVENTS_MAX_SUBSCRIBERS];
+	buffer			*record;
+	events_request_cb	handler;
+	void			*handler_arg;
+};
+
+/*
+ * Creates a listening unix socket at path. Any existing socket at path is
+ * removed first. Returns NULL if path is NULL.
+ */
+struct events *
+events_new(const char *path)
+{
+	struct events *ev;
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct stat sb;
+
+	if (!path)
+		return NULL;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		errx(1, "events: socket path too long: %s", path);
+	ev = calloc(1, sizeof(struct events));
+	if (!ev || !(ev->path = strdup(path)))
+		err(1, "events_new: malloc");
+	for (int i = 0; i < EVENTS_MAX_SUBSCRIBERS; i++)
+		ev->subs[i].fd = -1;
+	ev->record = buffer_new(256);
+
+	if ((ev->listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "events: socket");
+	/* a socket left behind by an earlier run, but nothing else */
+	if (lstat(path, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode))
+			errx(1, "events: %s exists and is not a socket", path);
+		if (unlink(path) == -1)
+			err(1, "events: unlink %s", path);
+	} else if (errno != ENOENT)
+		err(1, "events: %s", path);
+	if (bind(ev->listenfd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "events: bind %s", path);
+	if (listen(ev->listenfd, 5) == -1)
+		err(1, "events: listen");
+	if (socket_setnonblocking(ev->listenfd) == -1)
+		err(1, "events: fcntl");
+	return ev;
+}
+
+static void
+subscriber_close(struct subscriber *sub)
+{
+	if (sub->dropped)
+		warnx("events: subscriber %d dropped %lu records", sub->fd,
+		    sub->dropped);
+	close(sub->fd);
+	buffer_free(sub->queue);
+	buffer_free(sub->in);
+	sub->fd = -1;
+	sub->queue = NULL;
+	sub->in = NULL;
+	sub->off = 0;
+	sub->dropped = 0;
+}
+
+void
+events_free(struct events *ev)
+{
+	if (!ev)
+		return;
+	for (int i = 0; i < EVENTS_MAX_SUBSCRIBERS; i++)
+		if (ev->subs[i].fd != -1)
+			subscriber_close(&ev->subs[i]);
+	close(ev->listenfd);
+	unlink(ev->path);
+	free(ev->path);
+	buffer_free(ev->record);
+	free(ev);
+}
+
+void
+events_set_handler(struct events *ev, events_request_cb handler, void *arg)
+{
+	if (!ev)
+		return;
+	ev->handler = handler;
+	ev->handler_arg = arg;
+}
+
+/*
+ * Sends as much of the subscriber's queue as the socket accepts without
+ * blocking. Closes the subscriber on error.
+ */
+static void
+subscriber_flush(struct subscriber *sub)
+{
+	while (sub->off < sub->queue->len) {
+		ssize_t n = send(sub->fd, sub->queue->data + sub->off,
+		    sub->queue->len - sub->off, MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n == -1) {
+			warn("events: send");
+			subscriber_close(sub);
+			return;
+		}
+		sub->off += n;
+	}
+	buffer_clear(sub->queue);
+	sub->off = 0;
+}
+
+static void
+subscriber_enqueue(struct subscriber *sub, const buffer *rec)
+{
+	if (sub->queue->len - sub->off + rec->len > EVENTS_QUEUE_MAX) {
+		sub->dropped++;
+		return;
+	}
+	if (sub->off) {
+		memmove(sub->queue->data, sub->queue->data + sub->off,
+		    sub->queue->len - sub->off);
+		sub->queue->len -= sub->off;
+		sub->off = 0;
+	}
+	buffer_append_buf(sub->queue, rec);
+	subscriber_flush(sub);
+}
+
+/*
+ * A record is built in ev->record by record_begin, appending the contents,
+ * and record_end, which fills in the length prefix.
+ */
+static void
+record_begin(struct events *ev)
+{
+	buffer_clear(ev->record);
+	buffer_append(ev->record, "\0\0\0\0", 4);
+}
+
+static void
+record_end(struct events *ev)
+{
+	uint32_t reclen = ev->record->len - 4;
+	ev->record->data[0] = (reclen >> 24) & 0xff;
+	ev->record->data[1] = (reclen >> 16) & 0xff;
+	ev->record->data[2] = (reclen >> 8) & 0xff;
+	ev->record->data[3] = reclen & 0xff;
+}
+
+/*
+ * Publishes a record for tag code with the given type name and data (UTF-8,
+ * may be NULL) to all subscribers. Does nothing if ev is NULL.
+ */
+void
+events_publish(struct events *ev, int code, const char *type,
+    const char *data, size_t len)
+{
+	char codestr[16];
+	int subscribers = 0;
+
+	if (!ev)
+		return;
+	for (int i = 0; i < EVENTS_MAX_SUBSCRIBERS; i++)
+		if (ev->subs[i].fd != -1)
+			subscribers++;
+	if (!subscribers)
+		return;
+
+	record_begin(ev);
+	snprintf(codestr, sizeof(codestr), "%d", code);
+	buffer_append_str(ev->record, "{\"code\":");
+	buffer_append_str(ev->record, codestr);
+	buffer_append_str(ev->record, ",\"type\":");
+	buffer_append_json_str(ev->record, type, strlen(type));
+	if (data) {
+		buffer_append_str(ev->record, ",\"data\":");
+		buffer_append_json_str(ev->record, data, len);
+	}
+	buffer_append_str(ev->record, "}");
+	record_end(ev);
+
+	for (int i = 0; i < EVENTS_MAX_SUBSCRIBERS; i++)
+		if (ev->subs[i].fd != -1)
+			subscriber_enqueue(&ev->subs[i], ev->record);
+}
+
+/*
+ * Fills pfd with the listening socket and subscriber sockets, and returns the
+ * number of entries used (at most EVENTS_NPOLLFDS). Returns 0 if ev is NULL.
+ */
+int
+events_pollfds(struct events *ev, struct pollfd *pfd)
+{
+	int n = 0;
+
+	if (!ev)
+		return 0;
+	pfd[n].fd = ev->listenfd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+	for (int i = 0; i < EVENTS_MAX_SUBSCRIBERS; i++) {
+		struct subscriber *sub = &ev->subs[i];
+		/*
+		 * Unused slots get a negative fd so that poll ignores them but
+		 * the pfd index still matches the subscriber index.
+		 */
+		pfd[n].fd = sub->fd;
+		pfd[n].events = POLLIN;
+		if (sub->fd != -1 && sub->off < sub->queue->len)
+			pfd[n].events |= POLLOUT;
+		pfd[n++].revents = 0;
+	}
+	return n;
+}
+
+static void
+events_accept(struct events *ev)
+{
+	struct subscriber *sub = NULL;
+	int fd;
+
+	if ((fd = accept(ev->listenfd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			warn("events: accept");
+		return;
+	}
+	for (int i = 0; i < EVENTS_MAX_SUBSCRIBERS; i++)
+		if (ev->subs[i].fd == -1) {
+			sub = &ev->subs[i];
+			break;
+		}
+	if (!sub) {
+		warnx("events: too many subscribers");
+		close(fd);
+		return;
+	}
+	if (socket_setnonblocking(fd) == -1) {
+		warn("events: fcntl");
+		close(fd);
+		return;
+	}
+	sub->fd = fd;
+	sub->queue = buffer_new(4096);
+	sub->in = buffer_new(EVENTS_REQUEST_MAX);
+}
+
+/*
+ * Reads requests from the subscriber and queues replies. Returns -1 if the
+ * subscriber should be closed.
+ */
+static int
+subscriber_read(struct events *ev, struct subscriber *sub)
+{
+	char buf[512];
+	ssize_t n;
+	char *line, *nl;
+
+	n = recv(sub->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINTR ? 0 : -1;
+	if (n == 0)
+		return -1;
+	buffer_append(sub->in, buf, n);
+	line = sub->in->data;
+	while ((nl = memchr(line, '\n', sub->in->data + sub->in->len -
+	    line)) != NULL) {
+		*nl = '\0';
+		if (nl > line && nl[-1] == '\r')
+			nl[-1] = '\0';
+		record_begin(ev);
+		if (ev->handler)
+			ev->handler(ev->handler_arg, line, ev->record);
+		if (ev->record->len > 4) {
+			record_end(ev);
+			subscriber_enqueue(sub, ev->record);
+			if (sub->fd == -1)
+				return 0;
+		}
+		line = nl + 1;
+	}
+	n = sub->in->data + sub->in->len - line;
+	if (n >= EVENTS_REQUEST_MAX) {
+		warnx("events: request too long");
+		return -1;
+	}
+	memmove(sub->in->data, line, n);
+	sub->in->len = n;
+	return 0;
+}
+
+/*
+ * Handles poll results for pollfds previously filled by events_pollfds.
+ */
+void
+events_handle(struct events *ev, const struct pollfd *pfd, int npfd)
+{
+	if (!ev || npfd == 0)
+		return;
+	if (pfd[0].revents & POLLIN)
+		events_accept(ev);
+	for (int i = 0; i < EVENTS_MAX_SUBSCRIBERS && i + 1 < npfd; i++) {
+		struct subscriber *sub = &ev->subs[i];
+		short revents = pfd[i + 1].revents;
+		if (sub->fd == -1 || sub->fd != pfd[i + 1].fd)
+			continue;
+		if (revents & (POLLERR|POLLNVAL)) {
+			subscriber_close(sub);
+			continue;
+		}
+		if (revents & (POLLIN|POLLHUP) &&
+		    subscriber_read(ev, sub) == -1) {
+			subscriber_close(sub);
+			continue;
+		}
+		if (sub->fd != -1 && revents & POLLOUT)
+			subscriber_flush(sub);
+	}
+}
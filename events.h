@@ -0,0 +1,33 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+#include <poll.h>
+#include <stddef.h>
+#include "buffer.h"
+
+/* Maximum number of simultaneously connected event feed subscribers */
+#define EVENTS_MAX_SUBSCRIBERS	16
+/* Pending bytes per subscriber after which new records are dropped */
+#define EVENTS_QUEUE_MAX	(64*1024)
+/* Longest request line a subscriber may send */
+#define EVENTS_REQUEST_MAX	1024
+/* Number of pollfds events_pollfds may fill */
+#define EVENTS_NPOLLFDS		(1 + EVENTS_MAX_SUBSCRIBERS)
+
+struct events;
+
+/*
+ * Called with a request line (without the newline) sent by a subscriber.
+ * The reply, if any, is appended to the buffer.
+ */
+typedef void (*events_request_cb)(void *, const char *, buffer *);
+
+struct events *	events_new(const char *);
+void		events_free(struct events *);
+void		events_set_handler(struct events *, events_request_cb,
+		    void *);
+void		events_publish(struct events *, int, const char *,
+		    const char *, size_t);
+int		events_pollfds(struct events *, struct pollfd *);
+void		events_handle(struct events *, const struct pollfd *, int);
+
+#endif /* EVENTS_H */
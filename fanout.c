@@ -0,0 +1,199 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "fanout.h"
+#include "net.h"
+#include "outq.h"
+
+/*
+ * Spectators: further clients on the proxy's listening port while a session
+ * is running. Each gets an output queue attached to the controlling client's
+ * one, so it sees the same output, which is parsed once and shared; its
+ * input is read and ignored, as only the controlling client plays. A
+ * spectator that falls OUTQ_MAX bytes behind is disconnected, so that it
+ * never holds back the session.
+ */
+
+struct spectator {
+	int		fd;
+	struct outq	*outq;
+};
+
+struct fanout {
+	int			listenfd;
+	int			max;
+	struct outq		*outq;		/* of the controlling client */
+	struct spectator	spectators[FANOUT_MAX_CLIENTS];
+};
+
+/*
+ * Accepts up to max spectators on the listening socket fd, sharing the output
+ * queued on outq. Returns NULL if max is 0.
+ */
+struct fanout *
+fanout_new(int fd, int max, struct outq *outq)
+{
+	struct fanout *fo;
+
+	if (max == 0)
+		return NULL;
+	if (!(fo = calloc(1, sizeof(struct fanout))))
+		err(1, "fanout_new: malloc");
+	for (int i = 0; i < FANOUT_MAX_CLIENTS; i++)
+		fo->spectators[i].fd = -1;
+	fo->listenfd = fd;
+	fo->max = max < FANOUT_MAX_CLIENTS ? max : FANOUT_MAX_CLIENTS;
+	fo->outq = outq;
+	if (socket_setnonblocking(fd) == -1)
+		err(1, "fanout: fcntl");
+	return fo;
+}
+
+static void
+spectator_close(struct fanout *fo, struct spectator *s)
+{
+	shutdown(s->fd, SHUT_RDWR);
+	close(s->fd);
+	outq_detach(fo->outq, s->outq);
+	outq_free(s->outq);
+	*s = (struct spectator){ .fd = -1 };
+}
+
+void
+fanout_free(struct fanout *fo)
+{
+	if (!fo)
+		return;
+	for (int i = 0; i < FANOUT_MAX_CLIENTS; i++)
+		if (fo->spectators[i].fd != -1)
+			spectator_close(fo, &fo->spectators[i]);
+	free(fo);
+}
+
+/*
+ * Returns the number of connected spectators.
+ */
+int
+fanout_count(const struct fanout *fo)
+{
+	int n = 0;
+
+	if (!fo)
+		return 0;
+	for (int i = 0; i < FANOUT_MAX_CLIENTS; i++)
+		if (fo->spectators[i].fd != -1)
+			n++;
+	return n;
+}
+
+/*
+ * Fills pfd with the listening socket and spectator sockets, and returns the
+ * number of entries used (at most FANOUT_NPOLLFDS). Returns 0 if fo is NULL.
+ */
+int
+fanout_pollfds(struct fanout *fo, struct pollfd *pfd)
+{
+	int n = 0;
+
+	if (!fo)
+		return 0;
+	pfd[n].fd = fo->listenfd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+	for (int i = 0; i < fo->max; i++) {
+		struct spectator *s = &fo->spectators[i];
+		/* as in events_pollfds, unused slots have a negative fd */
+		pfd[n].fd = s->fd;
+		pfd[n].events = POLLIN;
+		if (s->fd != -1 && outq_pending(s->outq))
+			pfd[n].events |= POLLOUT;
+		pfd[n++].revents = 0;
+	}
+	return n;
+}
+
+static void
+fanout_accept(struct fanout *fo)
+{
+	struct spectator *s = NULL;
+	int fd, one = 1;
+
+	if ((fd = accept(fo->listenfd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			warn("fanout: accept");
+		return;
+	}
+	for (int i = 0; i < fo->max; i++)
+		if (fo->spectators[i].fd == -1) {
+			s = &fo->spectators[i];
+			break;
+		}
+	if (!s) {
+		warnx("fanout: too many spectators");
+		close(fd);
+		return;
+	}
+	if (socket_setnonblocking(fd) == -1) {
+		warn("fanout: fcntl");
+		close(fd);
+		return;
+	}
+	/* as for the controlling client, see connection_start */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+		warn("fanout: setsockopt TCP_NODELAY");
+	s->fd = fd;
+	s->outq = outq_new(OUTQ_MAX);
+	outq_attach(fo->outq, s->outq);
+	warnx("spectator connected");
+}
+
+/*
+ * Reads and discards what a spectator sent. Returns -1 if it should be
+ * closed.
+ */
+static int
+spectator_read(struct spectator *s)
+{
+	char buf[512];
+	ssize_t n;
+
+	n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINTR ? 0 : -1;
+	return n == 0 ? -1 : 0;
+}
+
+/*
+ * Handles poll results for pollfds previously filled by fanout_pollfds.
+ */
+void
+fanout_handle(struct fanout *fo, const struct pollfd *pfd, int npfd)
+{
+	if (!fo || npfd == 0)
+		return;
+	if (pfd[0].revents & POLLIN)
+		fanout_accept(fo);
+	for (int i = 0; i < fo->max && i + 1 < npfd; i++) {
+		struct spectator *s = &fo->spectators[i];
+		short revents = pfd[i + 1].revents;
+		if (s->fd == -1 || s->fd != pfd[i + 1].fd)
+			continue;
+		if (revents & (POLLERR|POLLNVAL) ||
+		    (revents & (POLLIN|POLLHUP) && spectator_read(s) == -1) ||
+		    (revents & POLLOUT && outq_flush(s->outq, s->fd) == -1)) {
+			warnx("spectator disconnected");
+			spectator_close(fo, s);
+			continue;
+		}
+		if (outq_full(s->outq)) {
+			warnx("spectator too slow, disconnecting");
+			spectator_close(fo, s);
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+#include <poll.h>
+#include "outq.h"
+
+/* Maximum number of simultaneously connected spectators */
+#define FANOUT_MAX_CLIENTS	8
+/* Number of pollfds fanout_pollfds may fill */
+#define FANOUT_NPOLLFDS		(1 + FANOUT_MAX_CLIENTS)
+
+struct fanout;
+
+struct fanout *	fanout_new(int, int, struct outq *);
+void		fanout_free(struct fanout *);
+int		fanout_count(const struct fanout *);
+int		fanout_pollfds(struct fanout *, struct pollfd *);
+void		fanout_handle(struct fanout *, const struct pollfd *, int);
+
+#endif /* FANOUT_H */
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "buffer.h"
+#include "config.h"
+#include "gamestate.h"
+#include "json.h"
+#include "status.h"
+
+static void
+prot_update(struct gamestate *gs, const struct prot *p, time_t now)
+{
+	int i;
+
+	for (i = 0; i < gs->nprots; i++)
+		if (strcmp(gs->prots[i].name, p->name) == 0)
+			break;
+	if (p->time == 0) {
+		/* effect ended */
+		if (i == gs->nprots)
+			return;
+		gs->nprots--;
+		gs->prots[i] = gs->prots[gs->nprots];
+		gs->prot_updated[i] = gs->prot_updated[gs->nprots];
+		return;
+	}
+	if (i == gs->nprots) {
+		if (gs->nprots == GAMESTATE_MAX_PROTS)
+			return;
+		gs->nprots++;
+	}
+	gs->prots[i] = *p;
+	gs->prot_updated[i] = now;
+}
+
+static int
+party_find(struct gamestate *gs, const char *name)
+{
+	for (int i = 0; i < gs->nparty; i++)
+		if (strcmp(gs->party[i].name, name) == 0)
+			return i;
+	return -1;
+}
+
+static void
+party_update(struct gamestate *gs, const struct party_member *m)
+{
+	int i = party_find(gs, m->name);
+
+	if (i == -1) {
+		if (gs->nparty == GAMESTATE_MAX_PARTY)
+			return;
+		i = gs->nparty++;
+	}
+	gs->party[i] = *m;
+}
+
+static void
+party_leave(struct gamestate *gs, const char *name)
+{
+	char n[STATUS_NAME_MAX];
+	int i;
+
+	if (sscanf(name, "%31s", n) != 1 || (i = party_find(gs, n)) == -1)
+		return;
+	gs->party[i] = gs->party[--gs->nparty];
+}
+
+/*
+ * Applies a status tag to the state. code and type are as passed to
+ * status_line in proxy.c, and data is the NUL-terminated tag contents (or
+ * NULL). Unparseable tags are ignored.
+ */
+void
+gamestate_update(struct gamestate *gs, int code, const char *type,
+    const char *data)
+{
+	time_t now = time(NULL);
+
+	switch (code) {
+	case 40:
+		gs->casting = 0;
+		break;
+	case 41:
+	case 42:
+		if (data && cast_parse(&gs->cast, data) == 0)
+			gs->casting = code;
+		break;
+	case 50:
+		if (data && vitals_parse(&gs->vitals, data) == 0)
+			gs->have_vitals = 1;
+		break;
+	case 62: {
+		struct party_member m;
+		if (data && party_member_parse(&m, data) == 0)
+			party_update(gs, &m);
+		break;
+	}
+	case 63:
+		if (data)
+			party_leave(gs, data);
+		break;
+	case 64: {
+		struct prot p;
+		if (data && prot_parse(&p, data) == 0)
+			prot_update(gs, &p, now);
+		break;
+	}
+	case 70:
+		if (data && target_parse(&gs->target, data) == 0)
+			gs->have_target = strcmp(gs->target.name, "0") != 0;
+		break;
+	case 99:
+		gs->have_room = 0;
+		if (data && strcmp(type, "room") == 0) {
+			/* "id area" */
+			size_t idlen = strcspn(data, " ");
+			if (idlen >= sizeof(gs->room_id))
+				break;
+			memcpy(gs->room_id, data, idlen);
+			gs->room_id[idlen] = '\0';
+			strlcpy(gs->area, data[idlen] ? data + idlen + 1 : "",
+			    sizeof(gs->area));
+			gs->have_room = 1;
+		}
+		break;
+	default:
+		return;
+	}
+	gs->seq++;
+	gs->updated = now;
+}
+
+/*
+ * Appends the whole state as a JSON object to out.
+ */
+void
+gamestate_json(const struct gamestate *gs, buffer *out)
+{
+	buffer_append_str(out, "{");
+	json_int(out, "seq", gs->seq, 1);
+	json_int(out, "updated", gs->updated, 0);
+	json_key(out, "vitals", 0);
+	if (gs->have_vitals) {
+		buffer_append_str(out, "{");
+		vitals_json(out, &gs->vitals, 1);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	json_key(out, "prots", 0);
+	buffer_append_str(out, "[");
+	for (int i = 0; i < gs->nprots; i++) {
+		buffer_append_str(out, i ? ",{" : "{");
+		prot_json(out, &gs->prots[i], 1);
+		json_int(out, "updated", gs->prot_updated[i], 0);
+		buffer_append_str(out, "}");
+	}
+	buffer_append_str(out, "]");
+	json_key(out, "party", 0);
+	buffer_append_str(out, "[");
+	for (int i = 0; i < gs->nparty; i++) {
+		buffer_append_str(out, i ? ",{" : "{");
+		party_member_json(out, &gs->party[i], 1);
+		buffer_append_str(out, "}");
+	}
+	buffer_append_str(out, "]");
+	json_key(out, "target", 0);
+	if (gs->have_target) {
+		buffer_append_str(out, "{");
+		json_str(out, "name", gs->target.name, 1);
+		json_int(out, "health", gs->target.health, 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	json_key(out, "cast", 0);
+	if (gs->casting) {
+		buffer_append_str(out, "{");
+		json_str(out, "type", gs->casting == 41 ? "spell" : "skill",
+		    1);
+		json_str(out, "name", gs->cast.name, 0);
+		json_int(out, "rounds", gs->cast.rounds, 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	json_key(out, "room", 0);
+	if (gs->have_room) {
+		buffer_append_str(out, "{");
+		json_str(out, "id", gs->room_id, 1);
+		json_str(out, "area", gs->area, 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	buffer_append_str(out, "}");
+}
@@ -0,0 +1,38 @@
+#ifndef GAMESTATE_H
+#define GAMESTATE_H
+#include <time.h>
+#include "buffer.h"
+#include "status.h"
+
+#define GAMESTATE_MAX_PARTY	16
+#define GAMESTATE_MAX_PROTS	64
+#define GAMESTATE_ID_MAX	64
+#define GAMESTATE_AREA_MAX	64
+
+/*
+ * Latest known values of the status tags, updated incrementally as tags
+ * arrive.
+ */
+struct gamestate {
+	unsigned long		seq;	/* number of updates applied */
+	time_t			updated;
+	int			have_vitals;
+	struct vitals		vitals;
+	int			nprots;
+	struct prot		prots[GAMESTATE_MAX_PROTS];
+	time_t			prot_updated[GAMESTATE_MAX_PROTS];
+	int			nparty;
+	struct party_member	party[GAMESTATE_MAX_PARTY];
+	int			have_target;
+	struct target		target;
+	int			casting;	/* 0, 41 or 42 */
+	struct cast		cast;
+	int			have_room;
+	char			room_id[GAMESTATE_ID_MAX];
+	char			area[GAMESTATE_AREA_MAX];
+};
+
+void	gamestate_update(struct gamestate *, int, const char *, const char *);
+void	gamestate_json(const struct gamestate *, buffer *);
+
+#endif /* GAMESTATE_H */
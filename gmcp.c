@@ -0,0 +1,77 @@
+#include <string.h>
+#include "buffer.h"
+#include "gmcp.h"
+#include "json.h"
+#include "status.h"
+
+/*
+ * GMCP messages are sent as TELNET subnegotiations:
+ *     IAC SB GMCP <package.message> <space> <JSON> IAC SE
+ * Our JSON is always UTF-8, which never contains the byte 0xff, so IAC never
+ * needs escaping inside the payload.
+ */
+
+static void
+gmcp_begin(buffer *out, const char *msg)
+{
+	buffer_append(out, "\xff\xfa\xc9", 3);
+	buffer_append_str(out, msg);
+	buffer_append_str(out, " {");
+}
+
+static void
+gmcp_end(buffer *out)
+{
+	buffer_append_str(out, "}");
+	buffer_append(out, "\xff\xf0", 2);
+}
+
+/*
+ * Appends a GMCP message for the status tag code with contents data (UTF-8,
+ * NUL-terminated at data[len]) to out. Returns 1 if a message was appended,
+ * or 0 if there is no GMCP message for the tag or it could not be parsed, in
+ * which case the caller should fall back to a marker line.
+ */
+int
+gmcp_status(buffer *out, int code, const char *data, size_t len)
+{
+	switch (code) {
+	case 50: {
+		struct vitals v;
+		if (!data || vitals_parse(&v, data) == -1)
+			return 0;
+		gmcp_begin(out, "Char.Vitals");
+		vitals_json(out, &v, 1);
+		gmcp_end(out);
+		return 1;
+	}
+	case 62: {
+		struct party_member m;
+		if (!data || party_member_parse(&m, data) == -1)
+			return 0;
+		gmcp_begin(out, "Party.Member");
+		party_member_json(out, &m, 1);
+		gmcp_end(out);
+		return 1;
+	}
+	case 63:
+		if (!data)
+			return 0;
+		gmcp_begin(out, "Party.Leave");
+		buffer_append_str(out, "\"name\":");
+		buffer_append_json_str(out, data, len);
+		gmcp_end(out);
+		return 1;
+	case 64: {
+		struct prot p;
+		if (!data || prot_parse(&p, data) == -1)
+			return 0;
+		gmcp_begin(out, "Char.Prot");
+		prot_json(out, &p, 1);
+		gmcp_end(out);
+		return 1;
+	}
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef GMCP_H
+#define GMCP_H
+#include <stddef.h>
+#include "buffer.h"
+
+/* TELNET option for the Generic MUD Communication Protocol */
+#define TELOPT_GMCP	201
+
+#define GMCP_WILL	"\xff\xfb\xc9"
+#define GMCP_WONT	"\xff\xfc\xc9"
+#define GMCP_DONT	"\xff\xfe\xc9"
+
+int	gmcp_status(buffer *, int, const char *, size_t);
+
+#endif /* GMCP_H */
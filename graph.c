@@ -0,0 +1,381 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "graph.h"
+#include "hashset.h"
+#include "xmalloc.h"
+
+/*
+ * In-memory map graph for path finding. Room ids, area names and directions
+ * are interned to 32-bit indexes. Exits are kept in compressed sparse row
+ * form: the exits of room i are edst[off[i]] .. edst[off[i + 1] - 1], with
+ * the direction taken in edir. Exits learned after the last compaction are
+ * kept in per-room linked lists (the delta), which are merged into the rows
+ * once there are GRAPH_DELTA_MAX of them, and at least a quarter as many as
+ * there are compacted exits.
+ *
+ * Like the database, the graph has at most one exit from a room to another.
+ */
+
+#define NONE	UINT32_MAX
+
+struct intern {
+	char		**strs;
+	uint64_t	*hashes;
+	uint32_t	n;
+	uint32_t	cap;
+	uint32_t	*slots;		/* index + 1, 0 if empty */
+	size_t		mask;
+};
+
+struct delta {
+	uint32_t	dst;
+	uint32_t	dir;
+	uint32_t	next;
+};
+
+struct graph {
+	struct intern	rooms;
+	struct intern	areas;
+	struct intern	dirs;
+	uint32_t	roomcap;	/* size of the per-room arrays */
+	uint32_t	*area;		/* per room; NONE if not known */
+
+	/* compacted exits, for rooms < ncsr */
+	uint32_t	ncsr;
+	uint32_t	*off;
+	uint32_t	*edst;
+	uint32_t	*edir;
+
+	/* exits since compaction */
+	uint32_t	*dhead;		/* per room */
+	struct delta	*delta;
+	uint32_t	ndelta;
+	uint32_t	deltacap;
+
+	/* path search scratch space */
+	uint32_t	*mark;		/* per room; visited if == epoch */
+	uint32_t	epoch;
+	uint32_t	*parent;
+	uint32_t	*pdir;
+	uint32_t	*queue;
+	const char	**path;
+};
+
+static void
+intern_free(struct intern *in)
+{
+	for (uint32_t i = 0; i < in->n; i++)
+		free(in->strs[i]);
+	free(in->strs);
+	free(in->hashes);
+	free(in->slots);
+}
+
+static uint32_t
+intern_find_hash(const struct intern *in, const char *s, uint64_t h)
+{
+	size_t i;
+
+	if (!in->slots)
+		return NONE;
+	for (i = h & in->mask; in->slots[i]; i = (i + 1) & in->mask) {
+		uint32_t idx = in->slots[i] - 1;
+		if (in->hashes[idx] == h && strcmp(in->strs[idx], s) == 0)
+			return idx;
+	}
+	return NONE;
+}
+
+static uint32_t
+intern_find(const struct intern *in, const char *s)
+{
+	return intern_find_hash(in, s, hash_str(HASH_INIT, s));
+}
+
+static void
+intern_rehash(struct intern *in, size_t nslots)
+{
+	free(in->slots);
+	if (!(in->slots = calloc(nslots, sizeof(uint32_t))))
+		err(1, "graph: malloc");
+	in->mask = nslots - 1;
+	for (uint32_t idx = 0; idx < in->n; idx++) {
+		size_t i = in->hashes[idx] & in->mask;
+		while (in->slots[i])
+			i = (i + 1) & in->mask;
+		in->slots[i] = idx + 1;
+	}
+}
+
+/*
+ * Returns the index of s, adding it if needed.
+ */
+static uint32_t
+intern_add(struct intern *in, const char *s)
+{
+	uint64_t h = hash_str(HASH_INIT, s);
+	uint32_t idx = intern_find_hash(in, s, h);
+	size_t i;
+
+	if (idx != NONE)
+		return idx;
+	if (in->n == NONE - 1)
+		errx(1, "graph: too many entries");
+	if (in->n == in->cap) {
+		in->cap = in->cap ? in->cap * 2 : 256;
+		in->strs = xreallocarray(in->strs, in->cap, sizeof(char *));
+		in->hashes = xreallocarray(in->hashes, in->cap,
+		    sizeof(uint64_t));
+	}
+	if (!(in->strs[in->n] = strdup(s)))
+		err(1, "graph: malloc");
+	in->hashes[in->n] = h;
+	idx = in->n++;
+	if (!in->slots || in->n * 2 > in->mask + 1) {
+		intern_rehash(in, in->slots ? (in->mask + 1) * 2 : 512);
+		return idx;
+	}
+	for (i = h & in->mask; in->slots[i]; i = (i + 1) & in->mask)
+		;
+	in->slots[i] = idx + 1;
+	return idx;
+}
+
+struct graph *
+graph_new(void)
+{
+	struct graph *g = calloc(1, sizeof(struct graph));
+	if (!g)
+		err(1, "graph_new: malloc");
+	if (!(g->off = calloc(1, sizeof(uint32_t))))
+		err(1, "graph_new: malloc");
+	return g;
+}
+
+void
+graph_free(struct graph *g)
+{
+	if (!g)
+		return;
+	intern_free(&g->rooms);
+	intern_free(&g->areas);
+	intern_free(&g->dirs);
+	free(g->area);
+	free(g->off);
+	free(g->edst);
+	free(g->edir);
+	free(g->dhead);
+	free(g->delta);
+	free(g->mark);
+	free(g->parent);
+	free(g->pdir);
+	free(g->queue);
+	free(g->path);
+	free(g);
+}
+
+/*
+ * Returns the index of room id, adding it if needed.
+ */
+static uint32_t
+room_index(struct graph *g, const char *id)
+{
+	uint32_t r = intern_add(&g->rooms, id);
+	uint32_t cap = g->roomcap;
+
+	if (r < cap)
+		return r;
+	g->roomcap = g->rooms.cap;
+	g->area = xreallocarray(g->area, g->roomcap, sizeof(uint32_t));
+	g->dhead = xreallocarray(g->dhead, g->roomcap, sizeof(uint32_t));
+	g->mark = xreallocarray(g->mark, g->roomcap, sizeof(uint32_t));
+	g->parent = xreallocarray(g->parent, g->roomcap, sizeof(uint32_t));
+	g->pdir = xreallocarray(g->pdir, g->roomcap, sizeof(uint32_t));
+	g->queue = xreallocarray(g->queue, g->roomcap, sizeof(uint32_t));
+	g->path = xreallocarray(g->path, g->roomcap, sizeof(char *));
+	for (uint32_t i = cap; i < g->roomcap; i++) {
+		g->area[i] = NONE;
+		g->dhead[i] = NONE;
+		g->mark[i] = 0;
+	}
+	return r;
+}
+
+void
+graph_add_room(struct graph *g, const char *id, const char *area)
+{
+	uint32_t r = room_index(g, id);
+	if (area)
+		g->area[r] = intern_add(&g->areas, area);
+}
+
+static int
+has_exit(const struct graph *g, uint32_t src, uint32_t dst)
+{
+	if (src < g->ncsr)
+		for (uint32_t e = g->off[src]; e < g->off[src + 1]; e++)
+			if (g->edst[e] == dst)
+				return 1;
+	for (uint32_t d = g->dhead[src]; d != NONE; d = g->delta[d].next)
+		if (g->delta[d].dst == dst)
+			return 1;
+	return 0;
+}
+
+void
+graph_add_exit(struct graph *g, const char *src, const char *dest,
+    const char *direction)
+{
+	uint32_t s = room_index(g, src);
+	uint32_t d = room_index(g, dest);
+
+	if (has_exit(g, s, d))
+		return;
+	if (g->ndelta == g->deltacap) {
+		g->deltacap = g->deltacap ? g->deltacap * 2 : 256;
+		g->delta = xreallocarray(g->delta, g->deltacap,
+		    sizeof(struct delta));
+	}
+	g->delta[g->ndelta] = (struct delta){
+		.dst = d,
+		.dir = intern_add(&g->dirs, direction),
+		.next = g->dhead[s],
+	};
+	g->dhead[s] = g->ndelta++;
+	/* keep compaction amortized O(1) per exit when loading */
+	if (g->ndelta >= GRAPH_DELTA_MAX &&
+	    g->ndelta >= (g->ncsr ? g->off[g->ncsr] : 0) / 4)
+		graph_compact(g);
+}
+
+/*
+ * db_load_cb for loading the stored map.
+ */
+void
+graph_load(void *arg, const char *id, const char *area, const char *dest,
+    const char *direction, uint64_t hash)
+{
+	struct graph *g = arg;
+
+	if (dest)
+		graph_add_exit(g, id, dest, direction);
+	else
+		graph_add_room(g, id, area);
+}
+
+/*
+ * Merges the delta into the compressed rows.
+ */
+void
+graph_compact(struct graph *g)
+{
+	uint32_t n = g->rooms.n;
+	uint32_t nedges = (g->ncsr ? g->off[g->ncsr] : 0) + g->ndelta;
+	uint32_t *off, *edst, *edir;
+	uint32_t e = 0;
+
+	off = xreallocarray(NULL, n + 1, sizeof(uint32_t));
+	edst = xreallocarray(NULL, nedges ? nedges : 1, sizeof(uint32_t));
+	edir = xreallocarray(NULL, nedges ? nedges : 1, sizeof(uint32_t));
+	for (uint32_t r = 0; r < n; r++) {
+		off[r] = e;
+		if (r < g->ncsr)
+			for (uint32_t i = g->off[r]; i < g->off[r + 1]; i++) {
+				edst[e] = g->edst[i];
+				edir[e++] = g->edir[i];
+			}
+		for (uint32_t d = g->dhead[r]; d != NONE;
+		    d = g->delta[d].next) {
+			edst[e] = g->delta[d].dst;
+			edir[e++] = g->delta[d].dir;
+		}
+		g->dhead[r] = NONE;
+	}
+	off[n] = e;
+	free(g->off);
+	free(g->edst);
+	free(g->edir);
+	g->off = off;
+	g->edst = edst;
+	g->edir = edir;
+	g->ncsr = n;
+	g->ndelta = 0;
+}
+
+/*
+ * Finds a shortest path from room id from to room id to, or to the nearest
+ * room in area to if there is no room with that id. On success, points path
+ * to the directions to take (valid until the next call) and returns their
+ * number. Returns -1 if there is no path.
+ */
+int
+graph_path(struct graph *g, const char *from, const char *to,
+    const char ***path)
+{
+	uint32_t s, t, area = NONE;
+	uint32_t head = 0, tail = 0;
+	uint32_t found = NONE;
+	int n = 0;
+
+	if ((s = intern_find(&g->rooms, from)) == NONE)
+		return -1;
+	if ((t = intern_find(&g->rooms, to)) == NONE &&
+	    (area = intern_find(&g->areas, to)) == NONE)
+		return -1;
+	*path = g->path;
+	if (s == t || (area != NONE && g->area[s] == area))
+		return 0;
+
+	if (++g->epoch == 0) {
+		memset(g->mark, 0, g->roomcap * sizeof(uint32_t));
+		g->epoch = 1;
+	}
+	g->mark[s] = g->epoch;
+	g->queue[tail++] = s;
+	while (head < tail && found == NONE) {
+		uint32_t u = g->queue[head++];
+		uint32_t e = u < g->ncsr ? g->off[u] : 0;
+		uint32_t end = u < g->ncsr ? g->off[u + 1] : 0;
+		uint32_t d = g->dhead[u];
+
+		while (e < end || d != NONE) {
+			uint32_t v, dir;
+			if (e < end) {
+				v = g->edst[e];
+				dir = g->edir[e++];
+			} else {
+				v = g->delta[d].dst;
+				dir = g->delta[d].dir;
+				d = g->delta[d].next;
+			}
+			if (g->mark[v] == g->epoch)
+				continue;
+			g->mark[v] = g->epoch;
+			g->parent[v] = u;
+			g->pdir[v] = dir;
+			if (v == t || (area != NONE && g->area[v] == area)) {
+				found = v;
+				break;
+			}
+			g->queue[tail++] = v;
+		}
+	}
+	if (found == NONE)
+		return -1;
+	for (uint32_t v = found; v != s; v = g->parent[v])
+		n++;
+	for (uint32_t v = found, i = n; v != s; v = g->parent[v])
+		g->path[--i] = g->dirs.strs[g->pdir[v]];
+	return n;
+}
+
+void
+graph_stats(const struct graph *g, struct graph_stats *stats)
+{
+	stats->rooms = g->rooms.n;
+	stats->exits = (g->ncsr ? g->off[g->ncsr] : 0) + g->ndelta;
+	stats->areas = g->areas.n;
+	stats->delta = g->ndelta;
+}
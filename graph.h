@@ -0,0 +1,30 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimum number of exits added before the graph is compacted */
+#define GRAPH_DELTA_MAX	4096
+
+struct graph_stats {
+	size_t	rooms;
+	size_t	exits;
+	size_t	areas;
+	size_t	delta;		/* exits not yet compacted */
+};
+
+struct graph;
+
+struct graph *	graph_new(void);
+void		graph_free(struct graph *);
+void		graph_add_room(struct graph *, const char *, const char *);
+void		graph_add_exit(struct graph *, const char *, const char *,
+		    const char *);
+void		graph_load(void *, const char *, const char *, const char *,
+		    const char *, uint64_t);
+void		graph_compact(struct graph *);
+int		graph_path(struct graph *, const char *, const char *,
+		    const char ***);
+void		graph_stats(const struct graph *, struct graph_stats *);
+
+#endif /* GRAPH_H */
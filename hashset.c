@@ -0,0 +1,189 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashset.h"
+
+/*
+ * Set of 64-bit hashes, with open addressing and linear probing. 0 marks an
+ * empty slot, so a hash of 0 is stored as 1. The table is kept at most half
+ * full. Each hash can carry a 64-bit value, which makes the set a map.
+ */
+
+struct hashset {
+	uint64_t	*slots;
+	uint64_t	*values;
+	size_t		mask;		/* number of slots - 1 */
+	size_t		len;
+};
+
+#define HASHSET_MIN	1024
+
+/*
+ * 64-bit FNV-1a of len bytes at p, continuing from h (HASH_INIT to start).
+ */
+uint64_t
+hash_bytes(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char *s = p;
+
+	while (len--) {
+		h ^= *s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * Hashes s including its terminating NUL, so that hashing several strings in
+ * a row doesn't make eg. ("ab", "c") and ("a", "bc") collide.
+ */
+uint64_t
+hash_str(uint64_t h, const char *s)
+{
+	return hash_bytes(h, s, strlen(s) + 1);
+}
+
+struct hashset *
+hashset_new(void)
+{
+	struct hashset *hs = calloc(1, sizeof(struct hashset));
+	if (!hs || !(hs->slots = calloc(HASHSET_MIN, sizeof(uint64_t))) ||
+	    !(hs->values = calloc(HASHSET_MIN, sizeof(uint64_t))))
+		err(1, "hashset_new: malloc");
+	hs->mask = HASHSET_MIN - 1;
+	return hs;
+}
+
+void
+hashset_free(struct hashset *hs)
+{
+	if (!hs)
+		return;
+	free(hs->slots);
+	free(hs->values);
+	free(hs);
+}
+
+static size_t
+find(const struct hashset *hs, uint64_t h)
+{
+	size_t i = h & hs->mask;
+
+	while (hs->slots[i] && hs->slots[i] != h)
+		i = (i + 1) & hs->mask;
+	return i;
+}
+
+static void
+grow(struct hashset *hs)
+{
+	uint64_t *old = hs->slots, *oldvalues = hs->values;
+	size_t n = hs->mask + 1;
+
+	if (!(hs->slots = calloc(n * 2, sizeof(uint64_t))) ||
+	    !(hs->values = calloc(n * 2, sizeof(uint64_t))))
+		err(1, "hashset: malloc");
+	hs->mask = n * 2 - 1;
+	for (size_t i = 0; i < n; i++)
+		if (old[i]) {
+			size_t j = find(hs, old[i]);
+			hs->slots[j] = old[i];
+			hs->values[j] = oldvalues[i];
+		}
+	free(old);
+	free(oldvalues);
+}
+
+/*
+ * Adds h to the set. Returns 1 if it was added, 0 if it was already there.
+ */
+int
+hashset_add(struct hashset *hs, uint64_t h)
+{
+	size_t i;
+
+	if (!h)
+		h = 1;
+	i = find(hs, h);
+	if (hs->slots[i])
+		return 0;
+	hs->slots[i] = h;
+	if (++hs->len * 2 > hs->mask + 1)
+		grow(hs);
+	return 1;
+}
+
+int
+hashset_has(const struct hashset *hs, uint64_t h)
+{
+	if (!h)
+		h = 1;
+	return hs->slots[find(hs, h)] != 0;
+}
+
+/*
+ * Removes h from the set. Returns 1 if it was removed, 0 if it wasn't there.
+ * Later hashes in the probe sequence are moved back into the gap, so that
+ * find never stops short of them.
+ */
+int
+hashset_del(struct hashset *hs, uint64_t h)
+{
+	size_t i, j, k;
+
+	if (!h)
+		h = 1;
+	i = find(hs, h);
+	if (!hs->slots[i])
+		return 0;
+	for (j = i;;) {
+		hs->slots[i] = 0;
+		do {
+			j = (j + 1) & hs->mask;
+			if (!hs->slots[j]) {
+				hs->len--;
+				return 1;
+			}
+			k = hs->slots[j] & hs->mask;
+			/* stays at j if its home slot k is in (i, j] */
+		} while (i <= j ? i < k && k <= j : i < k || k <= j);
+		hs->slots[i] = hs->slots[j];
+		hs->values[i] = hs->values[j];
+		i = j;
+	}
+}
+
+/*
+ * Adds h to the set if needed, and sets its value to v.
+ */
+void
+hashset_put(struct hashset *hs, uint64_t h, uint64_t v)
+{
+	if (!h)
+		h = 1;
+	hashset_add(hs, h);
+	hs->values[find(hs, h)] = v;
+}
+
+/*
+ * Returns 1 and sets *v to the value of h if h is in the set, else 0.
+ */
+int
+hashset_get(const struct hashset *hs, uint64_t h, uint64_t *v)
+{
+	size_t i;
+
+	if (!h)
+		h = 1;
+	if (!hs->slots[i = find(hs, h)])
+		return 0;
+	*v = hs->values[i];
+	return 1;
+}
+
+size_t
+hashset_len(const struct hashset *hs)
+{
+	return hs->len;
+}
@@ -0,0 +1,22 @@
+#ifndef HASHSET_H
+#define HASHSET_H
+#include <stddef.h>
+#include <stdint.h>
+
+#define HASH_INIT	0xcbf29ce484222325ULL	/* FNV-1a offset basis */
+
+struct hashset;
+
+uint64_t		hash_bytes(uint64_t, const void *, size_t);
+uint64_t		hash_str(uint64_t, const char *);
+struct hashset *	hashset_new(void);
+void			hashset_free(struct hashset *);
+int			hashset_add(struct hashset *, uint64_t);
+int			hashset_has(const struct hashset *, uint64_t);
+int			hashset_del(struct hashset *, uint64_t);
+void			hashset_put(struct hashset *, uint64_t, uint64_t);
+int			hashset_get(const struct hashset *, uint64_t,
+			    uint64_t *);
+size_t			hashset_len(const struct hashset *);
+
+#endif /* HASHSET_H */
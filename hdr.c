@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include "hdr.h"
+
+/*
+ * High dynamic range histogram: a bucket for each power of two, each split
+ * linearly into 2^(HDR_SUB_BITS - 1) sub-buckets, so that the relative error
+ * is the same over the whole range. Bucket 0 covers [0, 2^HDR_SUB_BITS) with
+ * twice as many sub-buckets; the upper half of each of those is the same size
+ * as in the next bucket, so buckets after the first only need the upper half.
+ */
+
+#define HALF	(1 << (HDR_SUB_BITS - 1))
+
+static int
+index_of(uint64_t v)
+{
+	int bucket = 63 - __builtin_clzll(v | ((1 << HDR_SUB_BITS) - 1)) -
+	    (HDR_SUB_BITS - 1);
+
+	return ((bucket + 1) << (HDR_SUB_BITS - 1)) + (v >> bucket) - HALF;
+}
+
+/*
+ * Returns the highest value counted at index i.
+ */
+static uint64_t
+value_at(int i)
+{
+	int bucket;
+
+	if (i < 2 * HALF)
+		return i;
+	bucket = (i >> (HDR_SUB_BITS - 1)) - 1;
+	return ((uint64_t)((i & (HALF - 1)) + HALF + 1) << bucket) - 1;
+}
+
+void
+hdr_record(struct hdr *h, uint64_t v)
+{
+	if (v >= 1ULL << HDR_MAX_BITS)
+		v = (1ULL << HDR_MAX_BITS) - 1;
+	h->counts[index_of(v)]++;
+	h->total++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*
+ * Returns the value that p percent of the recorded values are at most, or 0
+ * if there are none.
+ */
+uint64_t
+hdr_percentile(const struct hdr *h, double p)
+{
+	double rank = p / 100 * h->total;
+	uint64_t target = rank, seen = 0;
+
+	if (!h->total)
+		return 0;
+	if (target < rank || target == 0)
+		target++;
+	for (int i = 0; i < HDR_COUNTS; i++) {
+		seen += h->counts[i];
+		if (seen >= target)
+			return value_at(i) < h->max ? value_at(i) : h->max;
+	}
+	return h->max;
+}
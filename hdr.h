@@ -0,0 +1,25 @@
+#ifndef HDR_H
+#define HDR_H
+#include <stdint.h>
+
+/*
+ * Values below 2^HDR_SUB_BITS are counted exactly, larger ones with
+ * 2^(HDR_SUB_BITS - 1) buckets per power of two, ie. within 1%.
+ */
+#define HDR_SUB_BITS	8
+/* Values from 2^HDR_MAX_BITS up are counted as 2^HDR_MAX_BITS - 1 */
+#define HDR_MAX_BITS	40
+#define HDR_COUNTS \
+	((HDR_MAX_BITS - HDR_SUB_BITS + 2) << (HDR_SUB_BITS - 1))
+
+struct hdr {
+	uint64_t	counts[HDR_COUNTS];
+	uint64_t	total;
+	uint64_t	sum;
+	uint64_t	max;
+};
+
+void		hdr_record(struct hdr *, uint64_t);
+uint64_t	hdr_percentile(const struct hdr *, double);
+
+#endif /* HDR_H */
@@ -1,24 +1,59 @@
 /* XXX db format subject to change */
+
+/*
+ * Room and exit text is stored once per distinct text, keyed by the 64-bit
+ * FNV-1a hash of its UTF-8 bytes and a terminating NUL (as a signed integer).
+ * Many rooms share their descriptions. If the key is taken by another text,
+ * the text is hashed again after it for a second key; rooms refer to the key
+ * that holds their text.
+ */
+CREATE TABLE IF NOT EXISTS description (
+    hash BIGINT PRIMARY KEY,
+    text TEXT NOT NULL
+);
+
 CREATE TABLE IF NOT EXISTS room (
+    /* FNV-1a hash of id, as above, used for joins instead of id */
+    key BIGINT PRIMARY KEY,
     /*
      * These things look a little like apr1 hashes but
      * aren't, they contain characters not legal for base64:
      *    $apr1$dF!!_X#W$zUxMycg35omZ3p973Tllm1
      * Just store as text for now.
      */
-    id TEXT PRIMARY KEY,
-    shortdesc TEXT NOT NULL,
-    longdesc TEXT NOT NULL,
+    id TEXT UNIQUE NOT NULL,
+    shortdesc BIGINT NOT NULL REFERENCES description(hash),
+    longdesc BIGINT NOT NULL REFERENCES description(hash),
     area TEXT,
     indoors BOOLEAN,
-    exits TEXT
+    exits TEXT,
+    /*
+     * FNV-1a hash of the room contents as the proxy sees them, used to
+     * notice changed rooms, NULL for rooms stored before it was kept
+     */
+    hash BIGINT
 );
 
+CREATE INDEX IF NOT EXISTS room_area ON room(area);
+
+/* Earlier contents of rooms, saved when a visit finds them changed */
+CREATE TABLE IF NOT EXISTS room_version (
+    key BIGINT REFERENCES room(key),
+    hash BIGINT,
+    shortdesc BIGINT NOT NULL REFERENCES description(hash),
+    longdesc BIGINT NOT NULL REFERENCES description(hash),
+    area TEXT,
+    indoors BOOLEAN,
+    exits TEXT,
+    replaced TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+);
+
+CREATE INDEX IF NOT EXISTS room_version_key ON room_version(key);
+
+/* Rooms are connected by at most one exit */
 CREATE TABLE IF NOT EXISTS exit (
+    source BIGINT REFERENCES room(key),
+    destination BIGINT REFERENCES room(key),
     direction TEXT,
-    source TEXT,
-    destination TEXT,
-    FOREIGN KEY(source) REFERENCES room(id),
-    FOREIGN KEY(destination) REFERENCES room(id),
-    PRIMARY KEY(direction, source, destination)
+    PRIMARY KEY(source, destination)
 );
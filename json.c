@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <string.h>
+#include "buffer.h"
+#include "json.h"
+
+void
+json_key(buffer *out, const char *key, int first)
+{
+	if (!first)
+		buffer_append_str(out, ",");
+	buffer_append_json_str(out, key, strlen(key));
+	buffer_append_str(out, ":");
+}
+
+void
+json_int(buffer *out, const char *key, long val, int first)
+{
+	char tmp[32];
+	json_key(out, key, first);
+	snprintf(tmp, sizeof(tmp), "%ld", val);
+	buffer_append_str(out, tmp);
+}
+
+void
+json_bool(buffer *out, const char *key, int val, int first)
+{
+	json_key(out, key, first);
+	buffer_append_str(out, val ? "true" : "false");
+}
+
+void
+json_str(buffer *out, const char *key, const char *val, int first)
+{
+	json_key(out, key, first);
+	buffer_append_json_str(out, val, strlen(val));
+}
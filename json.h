@@ -0,0 +1,15 @@
+#ifndef JSON_H
+#define JSON_H
+#include <stddef.h>
+#include "buffer.h"
+
+/*
+ * Helpers for writing JSON object members. first is nonzero for the first
+ * member of an object (which is not preceded by a comma).
+ */
+void	json_key(buffer *, const char *, int);
+void	json_int(buffer *, const char *, long, int);
+void	json_bool(buffer *, const char *, int, int);
+void	json_str(buffer *, const char *, const char *, int);
+
+#endif /* JSON_H */
@@ -0,0 +1,277 @@
+#include <err.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "buffer.h"
+#include "hdr.h"
+#include "latency.h"
+
+/*
+ * Time spent by each chunk inside the proxy, from the read that returned it
+ * to the write that sent the last of it, split into phases. A chunk whose
+ * output is still queued when the write would block is kept in flight until
+ * the output queue has sent everything that was queued up to its end, and the
+ * wait counts as writing. Status updates replaced in the queue meanwhile make
+ * that end approximate; a drained queue ends every chunk in flight.
+ */
+
+struct chunk {
+	enum latency_dir	dir;
+	uint64_t		start;
+	uint64_t		mark;		/* end of the last phase */
+	uint64_t		phase[LATENCY_NPHASES];
+	const char		*input;
+	size_t			len;
+	size_t			due;		/* bytes sent when it is done */
+	buffer			*copy;		/* input, for the slow log */
+};
+
+struct latency {
+	struct hdr	total[LATENCY_NDIRS];
+	struct hdr	phase[LATENCY_NDIRS][LATENCY_NPHASES];
+	struct chunk	cur;
+	int		tracing;	/* cur has been started */
+	struct chunk	inflight[LATENCY_INFLIGHT];	/* a ring */
+	int		head, ninflight;
+	uint64_t	untraced;	/* chunks that did not fit in flight */
+	uint64_t	slow;		/* threshold, in ns */
+	uint64_t	nslow;
+	FILE		*slowlog;
+};
+
+static const char *dirs[LATENCY_NDIRS] = { "server", "client" };
+static const char *phases[LATENCY_NPHASES] = {
+	"parse", "db", "flush", "write"
+};
+
+/*
+ * Returns a new tracer. Chunks that take at least slow_ms milliseconds are
+ * logged to slowpath, if it is not NULL.
+ */
+struct latency *
+latency_new(int slow_ms, const char *slowpath)
+{
+	struct latency *lat = calloc(1, sizeof(struct latency));
+
+	if (!lat)
+		err(1, "latency_new: malloc");
+	if (slowpath) {
+		if (!(lat->slowlog = fopen(slowpath, "a")))
+			err(1, "%s", slowpath);
+		lat->slow = (uint64_t)slow_ms * 1000000;
+	}
+	return lat;
+}
+
+void
+latency_free(struct latency *lat)
+{
+	if (!lat)
+		return;
+	for (int i = 0; i < LATENCY_INFLIGHT; i++)
+		buffer_free(lat->inflight[i].copy);
+	if (lat->slowlog)
+		fclose(lat->slowlog);
+	free(lat);
+}
+
+/*
+ * Returns a monotonic time in nanoseconds.
+ */
+uint64_t
+latency_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Starts tracing the chunk of len bytes at input, which was just read.
+ */
+void
+latency_start(struct latency *lat, enum latency_dir dir, const char *input,
+    size_t len)
+{
+	if (!lat)
+		return;
+	memset(&lat->cur, 0, sizeof(lat->cur));
+	lat->cur.dir = dir;
+	lat->cur.start = lat->cur.mark = latency_now();
+	lat->cur.input = input;
+	lat->cur.len = len;
+	lat->tracing = 1;
+}
+
+/*
+ * Ends phase p of the current chunk. Time added to the DB phase while
+ * parsing is not counted as parsing.
+ */
+void
+latency_phase(struct latency *lat, enum latency_phase p)
+{
+	uint64_t now, elapsed;
+
+	if (!lat || !lat->tracing)
+		return;
+	now = latency_now();
+	elapsed = now - lat->cur.mark;
+	if (p == LATENCY_PARSE)
+		elapsed -= elapsed < lat->cur.phase[LATENCY_DB] ?
+		    elapsed : lat->cur.phase[LATENCY_DB];
+	lat->cur.phase[p] += elapsed;
+	lat->cur.mark = now;
+}
+
+/*
+ * Adds ns nanoseconds to phase p of the current chunk.
+ */
+void
+latency_add(struct latency *lat, enum latency_phase p, uint64_t ns)
+{
+	if (lat && lat->tracing)
+		lat->cur.phase[p] += ns;
+}
+
+static void
+log_slow(struct latency *lat, const struct chunk *ch, uint64_t total)
+{
+	char when[32];
+	time_t t = time(NULL);
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(lat->slowlog, "%s %s total %" PRIu64 " us:", when,
+	    dirs[ch->dir], total / 1000);
+	for (int p = 0; p < LATENCY_NPHASES; p++)
+		fprintf(lat->slowlog, " %s %" PRIu64, phases[p],
+		    ch->phase[p] / 1000);
+	fprintf(lat->slowlog, ", %zu bytes\n", ch->len);
+	fwrite(ch->input, 1, ch->len, lat->slowlog);
+	fputc('\n', lat->slowlog);
+	fflush(lat->slowlog);
+	lat->nslow++;
+}
+
+static void
+record(struct latency *lat, const struct chunk *ch, uint64_t end)
+{
+	uint64_t total = end - ch->start;
+
+	hdr_record(&lat->total[ch->dir], total);
+	for (int p = 0; p < LATENCY_NPHASES; p++)
+		hdr_record(&lat->phase[ch->dir][p], ch->phase[p]);
+	if (lat->slowlog && total >= lat->slow)
+		log_slow(lat, ch, total);
+}
+
+/*
+ * Ends the current chunk, after its write phase. The output queue has sent
+ * sent bytes in all and has pending bytes left; if any are left, the chunk is
+ * kept in flight until latency_sent() reports them sent.
+ */
+void
+latency_end(struct latency *lat, size_t sent, size_t pending)
+{
+	struct chunk *ch;
+	buffer *copy;
+
+	if (!lat || !lat->tracing)
+		return;
+	lat->tracing = 0;
+	if (!pending) {
+		record(lat, &lat->cur, lat->cur.mark);
+		return;
+	}
+	if (lat->ninflight == LATENCY_INFLIGHT) {
+		lat->untraced++;
+		return;
+	}
+
+	ch = &lat->inflight[(lat->head + lat->ninflight++) % LATENCY_INFLIGHT];
+	copy = ch->copy;
+	*ch = lat->cur;
+	ch->copy = copy;
+	ch->due = sent + pending;
+	if (lat->slowlog) {
+		/* The read buffer is reused before the queue drains */
+		if (!ch->copy && !(ch->copy = buffer_new(ch->len)))
+			err(1, "latency_end: malloc");
+		buffer_clear(ch->copy);
+		if (buffer_append(ch->copy, ch->input, ch->len) == -1)
+			err(1, "latency_end: malloc");
+		ch->input = ch->copy->data;
+	}
+}
+
+/*
+ * Ends the chunks in flight whose output has been sent, now that the output
+ * queue has sent sent bytes in all and has pending bytes left.
+ */
+void
+latency_sent(struct latency *lat, size_t sent, size_t pending)
+{
+	uint64_t now;
+
+	if (!lat || !lat->ninflight)
+		return;
+	now = latency_now();
+	while (lat->ninflight) {
+		struct chunk *ch = &lat->inflight[lat->head];
+		if (pending && ch->due > sent)
+			break;
+		ch->phase[LATENCY_WRITE] += now - ch->mark;
+		record(lat, ch, now);
+		lat->head = (lat->head + 1) % LATENCY_INFLIGHT;
+		lat->ninflight--;
+	}
+}
+
+static void
+append_hdr(buffer *out, const char *name, const struct hdr *h)
+{
+	char line[256];
+
+	snprintf(line, sizeof(line), "\"%s\":{\"count\":%" PRIu64
+	    ",\"mean\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64
+	    ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+	    name, h->total, h->total ? h->sum / h->total : 0,
+	    hdr_percentile(h, 50), hdr_percentile(h, 90),
+	    hdr_percentile(h, 99), hdr_percentile(h, 99.9), h->max);
+	buffer_append_str(out, line);
+}
+
+/*
+ * Appends the latency percentiles of both directions, in nanoseconds, to out
+ * as a JSON object.
+ */
+void
+latency_json(struct latency *lat, buffer *out)
+{
+	char line[64];
+
+	if (!lat) {
+		buffer_append_str(out, "{}");
+		return;
+	}
+	buffer_append_str(out, "{");
+	for (int d = 0; d < LATENCY_NDIRS; d++) {
+		buffer_append_str(out, d ? ",\"" : "\"");
+		buffer_append_str(out, dirs[d]);
+		buffer_append_str(out, "\":{");
+		append_hdr(out, "total", &lat->total[d]);
+		for (int p = 0; p < LATENCY_NPHASES; p++) {
+			buffer_append_str(out, ",");
+			append_hdr(out, phases[p], &lat->phase[d][p]);
+		}
+		buffer_append_str(out, "}");
+	}
+	snprintf(line, sizeof(line), ",\"untraced\":%" PRIu64
+	    ",\"slow\":%" PRIu64 "}", lat->untraced, lat->nslow);
+	buffer_append_str(out, line);
+}
@@ -0,0 +1,37 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/* Chunks traced while they wait for the client output queue to drain */
+#define LATENCY_INFLIGHT	64
+
+enum latency_dir {
+	LATENCY_SERVER,		/* from the server to the client */
+	LATENCY_CLIENT,		/* from the client to the server */
+	LATENCY_NDIRS
+};
+
+enum latency_phase {
+	LATENCY_PARSE,		/* parsing, conversion and commands */
+	LATENCY_DB,		/* handing rooms and exits to the DB writer */
+	LATENCY_FLUSH,		/* triggers and output queueing */
+	LATENCY_WRITE,		/* sending */
+	LATENCY_NPHASES
+};
+
+struct latency;
+
+struct latency *latency_new(int, const char *);
+void		latency_free(struct latency *);
+uint64_t	latency_now(void);
+void		latency_start(struct latency *, enum latency_dir, const char *,
+		    size_t);
+void		latency_phase(struct latency *, enum latency_phase);
+void		latency_add(struct latency *, enum latency_phase, uint64_t);
+void		latency_end(struct latency *, size_t, size_t);
+void		latency_sent(struct latency *, size_t, size_t);
+void		latency_json(struct latency *, buffer *);
+
+#endif /* LATENCY_H */
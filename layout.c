@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <string.h>
+#include "buffer.h"
+#include "json.h"
+#include "layout.h"
+
+/*
+ * Grid placement shared by mapexport and the live map: rooms are placed on a
+ * grid by the direction of the exits between them, with north up. Each level
+ * (a part of the map placed together) has its own color.
+ */
+
+static const struct {
+	const char	*dir;
+	int		dx, dy;
+} posmod[] = {
+	{ "north",	0, -1 },
+	{ "south",	0, 1 },
+	{ "west",	-1, 0 },
+	{ "east",	1, 0 },
+	{ "northwest",	-1, -1 },
+	{ "northeast",	1, -1 },
+	{ "southwest",	-1, 1 },
+	{ "southeast",	1, 1 },
+};
+
+static const char *colors[] = {
+	"#b87a7a", "#7ab87a", "#b8b87a", "#7a7ab8", "#b87ab8", "#7ab8b8",
+	"#262626", "#dbbdbd", "#bddbbd", "#dbdbbd", "#bdbddb", "#bddbdb",
+};
+
+/*
+ * Returns the grid offset of direction dir in *dx and *dy, or 0 if it is not
+ * a direction on the grid (eg. "up" or "portal").
+ */
+int
+layout_offset(const char *dir, int *dx, int *dy)
+{
+	for (size_t i = 0; i < sizeof(posmod) / sizeof(posmod[0]); i++)
+		if (strcmp(dir, posmod[i].dir) == 0) {
+			*dx = posmod[i].dx;
+			*dy = posmod[i].dy;
+			return 1;
+		}
+	return 0;
+}
+
+const char *
+layout_color(uint32_t level)
+{
+	return colors[level % (sizeof(colors) / sizeof(colors[0]))];
+}
+
+/*
+ * Appends the JSON members styling an exit in direction dir from a room on
+ * level srclevel at srcx, srcy to one on level dstlevel at dstx, dsty: exits
+ * that don't match the placement are drawn as labeled curves, and those
+ * between levels also in another color.
+ */
+void
+layout_edge_style(buffer *out, const char *dir, uint32_t srclevel,
+    int32_t srcx, int32_t srcy, uint32_t dstlevel, int32_t dstx, int32_t dsty)
+{
+	int dx, dy;
+
+	if (srclevel != dstlevel) {
+		json_str(out, "label", dir, 0);
+		json_str(out, "type", "curvedArrow", 0);
+		json_str(out, "color", "#99e", 0);
+	} else if (!layout_offset(dir, &dx, &dy) ||
+	    dstx - srcx != dx || dsty - srcy != dy) {
+		json_str(out, "label", dir, 0);
+		json_str(out, "type", "curvedArrow", 0);
+	}
+}
@@ -0,0 +1,14 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+#include <stdint.h>
+#include "buffer.h"
+
+/* Empty grid cells between levels placed next to each other */
+#define LAYOUT_GAP	2
+
+int		layout_offset(const char *, int *, int *);
+const char *	layout_color(uint32_t);
+void		layout_edge_style(buffer *, const char *, uint32_t, int32_t,
+		    int32_t, uint32_t, int32_t, int32_t);
+
+#endif /* LAYOUT_H */
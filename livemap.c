@@ -0,0 +1,519 @@
+#include <sys/socket.h>
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "hashset.h"
+#include "json.h"
+#include "layout.h"
+#include "livemap.h"
+#include "net.h"
+#include "room.h"
+
+/*
+ * Live map: rooms are placed on a grid as they are visited, and the changes
+ * are streamed to browsers (render.html) as HTTP Server-Sent Events:
+ *     event: node      a room, with its coordinates, as in mapexport output
+ *     event: edge      an exit between two rooms
+ *     event: position  {"id":...} of the current room
+ *
+ * A room is placed next to the room it was entered from, if the direction is
+ * on the grid and the cell is free; otherwise it starts a new level to the
+ * right of everything placed so far. Rooms are never moved, so every event
+ * stays valid.
+ *
+ * The node and edge events are kept in a log, which a new browser gets first
+ * so that it sees the whole live map. Browsers only hold an offset into the
+ * log, so a slow one costs no memory; it just falls behind. Position events
+ * are not logged: a browser that falls behind only gets the latest one.
+ *
+ * The stream can only be read by pages served from this machine: a request
+ * with another Origin is refused, so that other web sites can't follow the
+ * player around.
+ */
+
+#define NONE	UINT32_MAX
+
+struct lmroom {
+	char		*id;
+	uint32_t	level;
+	int32_t		x, y;
+};
+
+struct client {
+	int		fd;
+	int		streaming;	/* request read, sending events */
+	buffer		*in;		/* request being read */
+	buffer		*out;		/* response headers, position event */
+	size_t		outoff;		/* bytes of out already sent */
+	size_t		logoff;		/* bytes of the log already sent */
+	unsigned long	pos;		/* position generation sent */
+};
+
+struct livemap {
+	int		listenfd;
+	struct client	clients[LIVEMAP_MAX_CLIENTS];
+	struct hashset	*ids;		/* id hash -> room index + 1 */
+	struct hashset	*exits;		/* (source, destination) indexes */
+	struct hashset	*cells;		/* of placed rooms */
+	struct lmroom	*rooms;
+	uint32_t	nrooms;
+	uint32_t	roomcap;
+	uint32_t	nexits;
+	uint32_t	nlevels;
+	int32_t		maxx;		/* rightmost placed room */
+	buffer		*log;		/* node and edge events */
+	uint32_t	pos;		/* current room, NONE if not known */
+	unsigned long	posgen;		/* incremented when pos changes */
+};
+
+static const char response_ok[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Content-Type: text/event-stream\r\n"
+    "Cache-Control: no-cache\r\n";
+static const char response_start[] =
+    "\r\n"
+    "retry: 1000\n\n";
+static const char response_forbidden[] =
+    "HTTP/1.1 403 Forbidden\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+static const char response_bad[] =
+    "HTTP/1.1 405 Method Not Allowed\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+/*
+ * Starts listening on the bound TCP socket fd. Returns NULL if fd is -1.
+ */
+struct livemap *
+livemap_new(int fd)
+{
+	struct livemap *lm;
+
+	if (fd == -1)
+		return NULL;
+	if (!(lm = calloc(1, sizeof(struct livemap))))
+		err(1, "livemap_new: malloc");
+	for (int i = 0; i < LIVEMAP_MAX_CLIENTS; i++)
+		lm->clients[i].fd = -1;
+	lm->ids = hashset_new();
+	lm->exits = hashset_new();
+	lm->cells = hashset_new();
+	if (!(lm->log = buffer_new(4096)))
+		err(1, "livemap_new: malloc");
+	lm->pos = NONE;
+	lm->listenfd = fd;
+	if (listen(fd, 5) == -1)
+		err(1, "livemap: listen");
+	if (socket_setnonblocking(fd) == -1)
+		err(1, "livemap: fcntl");
+	return lm;
+}
+
+static void
+client_close(struct client *c)
+{
+	close(c->fd);
+	buffer_free(c->in);
+	buffer_free(c->out);
+	*c = (struct client){ .fd = -1 };
+}
+
+void
+livemap_free(struct livemap *lm)
+{
+	if (!lm)
+		return;
+	for (int i = 0; i < LIVEMAP_MAX_CLIENTS; i++)
+		if (lm->clients[i].fd != -1)
+			client_close(&lm->clients[i]);
+	close(lm->listenfd);
+	for (uint32_t i = 0; i < lm->nrooms; i++)
+		free(lm->rooms[i].id);
+	free(lm->rooms);
+	hashset_free(lm->ids);
+	hashset_free(lm->exits);
+	hashset_free(lm->cells);
+	buffer_free(lm->log);
+	free(lm);
+}
+
+static int
+client_pending(const struct livemap *lm, const struct client *c)
+{
+	return c->outoff < c->out->len || (c->streaming &&
+	    (c->logoff < lm->log->len ||
+	    (lm->pos != NONE && c->pos != lm->posgen)));
+}
+
+/*
+ * Sends len bytes at p without blocking. Returns the number of bytes sent,
+ * or -1 on error.
+ */
+static ssize_t
+client_send(struct client *c, const char *p, size_t len)
+{
+	ssize_t n;
+
+	do
+		n = send(c->fd, p, len, MSG_DONTWAIT);
+	while (n == -1 && errno == EINTR);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	return n;
+}
+
+/*
+ * Sends what the browser hasn't seen yet, as far as the socket accepts
+ * without blocking: headers, the log, then the current position. Closes the
+ * client on error.
+ */
+static void
+client_flush(struct livemap *lm, struct client *c)
+{
+	ssize_t n;
+
+	for (;;) {
+		if (c->outoff < c->out->len) {
+			n = client_send(c, c->out->data + c->outoff,
+			    c->out->len - c->outoff);
+			if (n == -1)
+				goto fail;
+			if ((c->outoff += n) < c->out->len)
+				return;
+			buffer_clear(c->out);
+			c->outoff = 0;
+		}
+		if (!c->streaming)
+			return;
+		if (c->logoff < lm->log->len) {
+			n = client_send(c, lm->log->data + c->logoff,
+			    lm->log->len - c->logoff);
+			if (n == -1)
+				goto fail;
+			if ((c->logoff += n) < lm->log->len)
+				return;
+		}
+		if (lm->pos == NONE || c->pos == lm->posgen)
+			return;
+		buffer_append_str(c->out, "event: position\ndata: {");
+		json_str(c->out, "id", lm->rooms[lm->pos].id, 1);
+		buffer_append_str(c->out, "}\n\n");
+		c->pos = lm->posgen;
+	}
+fail:
+	if (errno != EPIPE && errno != ECONNRESET)
+		warn("livemap: send");
+	client_close(c);
+}
+
+static void
+flush_all(struct livemap *lm)
+{
+	for (int i = 0; i < LIVEMAP_MAX_CLIENTS; i++)
+		if (lm->clients[i].fd != -1)
+			client_flush(lm, &lm->clients[i]);
+}
+
+static uint32_t
+find(const struct livemap *lm, const char *id)
+{
+	uint64_t idx;
+
+	if (!hashset_get(lm->ids, hash_str(HASH_INIT, id), &idx) ||
+	    strcmp(lm->rooms[idx - 1].id, id) != 0)
+		return NONE;
+	return idx - 1;
+}
+
+static uint64_t
+cell(int32_t x, int32_t y)
+{
+	return hash_bytes(hash_bytes(HASH_INIT, &x, sizeof(x)), &y,
+	    sizeof(y));
+}
+
+/*
+ * Adds room, entered from the room with index from (or NONE), and logs its
+ * node event. Returns its index.
+ */
+static uint32_t
+add_room(struct livemap *lm, const struct room *room, uint32_t from)
+{
+	struct lmroom *r;
+	int dx, dy;
+
+	if (lm->nrooms == lm->roomcap) {
+		lm->roomcap = lm->roomcap ? lm->roomcap * 2 : 256;
+		lm->rooms = reallocarray(lm->rooms, lm->roomcap,
+		    sizeof(struct lmroom));
+		if (!lm->rooms)
+			err(1, "livemap: malloc");
+	}
+	r = &lm->rooms[lm->nrooms];
+	if (!(r->id = strdup(room->id)))
+		err(1, "livemap: malloc");
+	if (from != NONE && layout_offset(room->direction, &dx, &dy) &&
+	    hashset_add(lm->cells, cell(lm->rooms[from].x + dx,
+	    lm->rooms[from].y + dy))) {
+		r->level = lm->rooms[from].level;
+		r->x = lm->rooms[from].x + dx;
+		r->y = lm->rooms[from].y + dy;
+	} else {
+		/* nothing is placed right of maxx, so the cell is free */
+		r->level = lm->nlevels++;
+		r->x = lm->nrooms ? lm->maxx + LAYOUT_GAP + 1 : 0;
+		r->y = from != NONE ? lm->rooms[from].y : 0;
+		hashset_add(lm->cells, cell(r->x, r->y));
+	}
+	if (!lm->nrooms || r->x > lm->maxx)
+		lm->maxx = r->x;
+	hashset_put(lm->ids, hash_str(HASH_INIT, room->id), lm->nrooms + 1);
+
+	buffer_append_str(lm->log, "event: node\ndata: {");
+	json_str(lm->log, "id", room->id, 1);
+	json_str(lm->log, "label", room->shortdesc, 0);
+	json_str(lm->log, "longdesc", room->longdesc, 0);
+	json_bool(lm->log, "indoors", room->indoors, 0);
+	json_str(lm->log, "exits", room->exits, 0);
+	json_int(lm->log, "size", 1, 0);
+	json_int(lm->log, "x", r->x, 0);
+	json_int(lm->log, "y", r->y, 0);
+	json_str(lm->log, "color", layout_color(r->level), 0);
+	buffer_append_str(lm->log, "}\n\n");
+	return lm->nrooms++;
+}
+
+static void
+add_exit(struct livemap *lm, uint32_t src, uint32_t dst, const char *dir)
+{
+	const struct lmroom *s = &lm->rooms[src], *d = &lm->rooms[dst];
+	uint32_t pair[2] = { src, dst };
+
+	if (!hashset_add(lm->exits, hash_bytes(HASH_INIT, pair, sizeof(pair))))
+		return;
+	buffer_append_str(lm->log, "event: edge\ndata: {");
+	json_int(lm->log, "id", lm->nexits++, 1);
+	json_str(lm->log, "source", s->id, 0);
+	json_str(lm->log, "target", d->id, 0);
+	layout_edge_style(lm->log, dir, s->level, s->x, s->y, d->level, d->x,
+	    d->y);
+	buffer_append_str(lm->log, "}\n\n");
+}
+
+/*
+ * Called when room is entered from room from (NULL if not known, or if the
+ * rooms are in different areas). Does nothing if lm is NULL.
+ */
+void
+livemap_visit(struct livemap *lm, const struct room *from,
+    const struct room *room)
+{
+	uint32_t src, dst;
+
+	if (!lm)
+		return;
+	src = from ? find(lm, from->id) : NONE;
+	if ((dst = find(lm, room->id)) == NONE)
+		dst = add_room(lm, room, src);
+	if (src != NONE && src != dst)
+		add_exit(lm, src, dst, room->direction);
+	lm->pos = dst;
+	lm->posgen++;
+	flush_all(lm);
+}
+
+/*
+ * Fills pfd with the listening socket and client sockets, and returns the
+ * number of entries used (at most LIVEMAP_NPOLLFDS). Returns 0 if lm is NULL.
+ */
+int
+livemap_pollfds(struct livemap *lm, struct pollfd *pfd)
+{
+	int n = 0;
+
+	if (!lm)
+		return 0;
+	pfd[n].fd = lm->listenfd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+	for (int i = 0; i < LIVEMAP_MAX_CLIENTS; i++) {
+		struct client *c = &lm->clients[i];
+		/* as in events_pollfds, unused slots have a negative fd */
+		pfd[n].fd = c->fd;
+		pfd[n].events = POLLIN;
+		if (c->fd != -1 && client_pending(lm, c))
+			pfd[n].events |= POLLOUT;
+		pfd[n++].revents = 0;
+	}
+	return n;
+}
+
+static void
+livemap_accept(struct livemap *lm)
+{
+	struct client *c = NULL;
+	int fd;
+
+	if ((fd = accept(lm->listenfd, NULL, NULL)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			warn("livemap: accept");
+		return;
+	}
+	for (int i = 0; i < LIVEMAP_MAX_CLIENTS; i++)
+		if (lm->clients[i].fd == -1) {
+			c = &lm->clients[i];
+			break;
+		}
+	if (!c) {
+		warnx("livemap: too many clients");
+		close(fd);
+		return;
+	}
+	if (socket_setnonblocking(fd) == -1) {
+		warn("livemap: fcntl");
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	if (!(c->in = buffer_new(512)) || !(c->out = buffer_new(512)))
+		err(1, "livemap: malloc");
+}
+
+/*
+ * Finds the Origin header in the request. Returns its length and sets *origin,
+ * or returns 0 if there is none.
+ */
+static size_t
+request_origin(const buffer *in, const char **origin)
+{
+	const char *p = in->data, *end = in->data + in->len, *eol;
+
+	while ((eol = memchr(p, '\n', end - p))) {
+		p = eol + 1;
+		if (end - p < 7 || strncasecmp(p, "Origin:", 7) != 0)
+			continue;
+		p += 7;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		for (eol = p; eol < end && *eol != '\r' && *eol != '\n'; eol++)
+			;
+		*origin = p;
+		return eol - p;
+	}
+	return 0;
+}
+
+/*
+ * Returns 1 if origin is http on a loopback address, with any port.
+ */
+static int
+origin_local(const char *origin, size_t len)
+{
+	static const char *const hosts[] = {
+		"http://localhost", "http://127.0.0.1", "http://[::1]"
+	};
+
+	for (size_t i = 0; i < sizeof(hosts) / sizeof(*hosts); i++) {
+		size_t n = strlen(hosts[i]);
+		if (len < n || memcmp(origin, hosts[i], n) != 0)
+			continue;
+		if (len == n)
+			return 1;
+		if (origin[n] != ':' || len == n + 1)
+			return 0;
+		for (n++; n < len; n++)
+			if (origin[n] < '0' || origin[n] > '9')
+				return 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Reads the HTTP request; any GET starts the event stream. Input after the
+ * request is ignored. Returns -1 if the client should be closed.
+ */
+static int
+client_read(struct livemap *lm, struct client *c)
+{
+	char buf[512];
+	ssize_t n;
+
+	n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (n == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINTR ? 0 : -1;
+	if (n == 0)
+		return -1;
+	if (c->streaming)
+		return 0;
+	buffer_append(c->in, buf, n);
+	if (!memmem(c->in->data, c->in->len, "\r\n\r\n", 4) &&
+	    !memmem(c->in->data, c->in->len, "\n\n", 2)) {
+		if (c->in->len >= LIVEMAP_REQUEST_MAX) {
+			warnx("livemap: request too long");
+			return -1;
+		}
+		return 0;
+	}
+	if (c->in->len < 4 || memcmp(c->in->data, "GET ", 4) != 0) {
+		client_send(c, response_bad, strlen(response_bad));
+		return -1;
+	}
+	/* render.html is a page from elsewhere, so it needs to be allowed */
+	const char *origin;
+	size_t len = request_origin(c->in, &origin);
+	if (len && !origin_local(origin, len)) {
+		warnx("livemap: refused origin %.*s", (int)len, origin);
+		client_send(c, response_forbidden, strlen(response_forbidden));
+		return -1;
+	}
+	buffer_append_str(c->out, response_ok);
+	if (len) {
+		buffer_append_str(c->out, "Access-Control-Allow-Origin: ");
+		buffer_append(c->out, origin, len);
+		buffer_append_str(c->out, "\r\nVary: Origin\r\n");
+	}
+	buffer_append_str(c->out, response_start);
+	buffer_clear(c->in);
+	c->streaming = 1;
+	client_flush(lm, c);
+	return 0;
+}
+
+/*
+ * Handles poll results for pollfds previously filled by livemap_pollfds.
+ */
+void
+livemap_handle(struct livemap *lm, const struct pollfd *pfd, int npfd)
+{
+	if (!lm || npfd == 0)
+		return;
+	if (pfd[0].revents & POLLIN)
+		livemap_accept(lm);
+	for (int i = 0; i < LIVEMAP_MAX_CLIENTS && i + 1 < npfd; i++) {
+		struct client *c = &lm->clients[i];
+		short revents = pfd[i + 1].revents;
+		if (c->fd == -1 || c->fd != pfd[i + 1].fd)
+			continue;
+		if (revents & (POLLERR|POLLNVAL)) {
+			client_close(c);
+			continue;
+		}
+		if (revents & (POLLIN|POLLHUP) && client_read(lm, c) == -1) {
+			client_close(c);
+			continue;
+		}
+		if (c->fd != -1 && revents & POLLOUT)
+			client_flush(lm, c);
+	}
+}
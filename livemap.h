@@ -0,0 +1,23 @@
+#ifndef LIVEMAP_H
+#define LIVEMAP_H
+#include <poll.h>
+#include "room.h"
+
+/* Maximum number of simultaneously connected browsers */
+#define LIVEMAP_MAX_CLIENTS	8
+/* Longest HTTP request a browser may send */
+#define LIVEMAP_REQUEST_MAX	4096
+/* Number of pollfds livemap_pollfds may fill */
+#define LIVEMAP_NPOLLFDS	(1 + LIVEMAP_MAX_CLIENTS)
+
+struct livemap;
+
+struct livemap *	livemap_new(int);
+void			livemap_free(struct livemap *);
+void			livemap_visit(struct livemap *, const struct room *,
+			    const struct room *);
+int			livemap_pollfds(struct livemap *, struct pollfd *);
+void			livemap_handle(struct livemap *, const struct pollfd *,
+			    int);
+
+#endif /* LIVEMAP_H */
@@ -0,0 +1,550 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hashset.h"
+#include "logstore.h"
+#include "xmalloc.h"
+
+/*
+ * Session log: the text output to the client, without colors, in segment
+ * files named after the time of their first line. Each line is stored as its
+ * time, its BatClient message type (empty for plain text) and its text,
+ * separated by tabs.
+ *
+ * The lines of a segment are grouped in blocks of about LOGSTORE_BLOCK bytes.
+ * While a segment is written, an index is built that maps each trigram of
+ * the text, folded to lower case, and each type to the blocks that contain
+ * it; the index is saved next to the segment when it is closed. A search
+ * then only reads the blocks that contain all the trigrams of the text and
+ * the type searched for. Segments without an index, such as the one being
+ * written, are read whole.
+ */
+
+#define MAGIC		"bclog1\n"
+#define TYPE_KEY	0x80000000u	/* keys of types; trigrams are below */
+#define HASHED		(1ULL << 32)	/* keeps keys off hashset's 0 and 1 */
+
+/*
+ * The index file: the header, then int64_t times[nblocks] of the first line
+ * of each block, uint32_t offsets[nblocks + 1] of the blocks and the end of
+ * the segment, struct key keys[nkeys] in ascending order and uint16_t
+ * postings[npostings], the ascending block numbers of each key in turn.
+ */
+struct header {
+	char		magic[8];
+	uint32_t	nblocks;
+	uint32_t	nkeys;
+	uint32_t	npostings;
+	uint32_t	pad;
+};
+
+struct key {
+	uint32_t	key;
+	uint32_t	start;		/* in postings */
+	uint32_t	count;
+};
+
+struct posting {
+	uint32_t	key;
+	uint32_t	n, sz;
+	uint16_t	*blocks;
+};
+
+struct logstore {
+	char		*dir;
+	FILE		*log;		/* NULL until the next line */
+	long long	start;		/* name of the segment */
+	size_t		size;
+	int64_t		*times;
+	uint32_t	*offsets;
+	uint32_t	nblocks, blocksz;
+	struct hashset	*keys;		/* key -> index in postings */
+	struct posting	*postings;
+	uint32_t	npostings, postingsz;
+};
+
+static unsigned char
+fold(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static uint32_t
+trigram(const unsigned char *s)
+{
+	return fold(s[0]) << 16 | fold(s[1]) << 8 | fold(s[2]);
+}
+
+static uint32_t
+type_key(const char *type)
+{
+	return TYPE_KEY | (hash_str(HASH_INIT, type) & (TYPE_KEY - 1));
+}
+
+/*
+ * Returns a log store writing to directory dir, which is created if needed,
+ * or NULL if dir is NULL.
+ */
+struct logstore *
+logstore_new(const char *dir)
+{
+	struct logstore *ls;
+
+	if (!dir)
+		return NULL;
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+		err(1, "%s", dir);
+	if (!(ls = calloc(1, sizeof(struct logstore))) ||
+	    !(ls->dir = strdup(dir)))
+		err(1, "logstore_new: malloc");
+	return ls;
+}
+
+static void
+segment_open(struct logstore *ls, time_t t)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	for (ls->start = t;; ls->start++) {
+		snprintf(path, sizeof(path), "%s/%lld.log", ls->dir, ls->start);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0644)) != -1)
+			break;
+		if (errno != EEXIST)
+			err(1, "%s", path);
+	}
+	if (!(ls->log = fdopen(fd, "w")))
+		err(1, "%s", path);
+	ls->size = 0;
+	ls->nblocks = 0;
+	ls->keys = hashset_new();
+}
+
+static int
+cmp_posting(const void *a, const void *b)
+{
+	const struct posting *pa = a, *pb = b;
+
+	return pa->key < pb->key ? -1 : pa->key > pb->key;
+}
+
+static int
+write_index(struct logstore *ls, FILE *f)
+{
+	struct header h = { MAGIC, ls->nblocks, ls->npostings, 0, 0 };
+	uint32_t end = ls->size;
+
+	qsort(ls->postings, ls->npostings, sizeof(struct posting),
+	    cmp_posting);
+	for (uint32_t i = 0; i < ls->npostings; i++)
+		h.npostings += ls->postings[i].n;
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(ls->times, sizeof(int64_t), ls->nblocks, f);
+	fwrite(ls->offsets, sizeof(uint32_t), ls->nblocks, f);
+	fwrite(&end, sizeof(end), 1, f);
+	for (uint32_t i = 0, start = 0; i < ls->npostings; i++) {
+		struct key k = { ls->postings[i].key, start,
+		    ls->postings[i].n };
+		fwrite(&k, sizeof(k), 1, f);
+		start += k.count;
+	}
+	for (uint32_t i = 0; i < ls->npostings; i++)
+		fwrite(ls->postings[i].blocks, sizeof(uint16_t),
+		    ls->postings[i].n, f);
+	return ferror(f) ? -1 : 0;
+}
+
+/*
+ * Closes the current segment and saves its index. A segment whose index
+ * can't be saved is still searched, only more slowly.
+ */
+static void
+segment_close(struct logstore *ls)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *f;
+
+	if (!ls->log)
+		return;
+	if (fclose(ls->log) == EOF)
+		warn("logstore: %s/%lld.log", ls->dir, ls->start);
+	ls->log = NULL;
+
+	snprintf(path, sizeof(path), "%s/%lld.idx", ls->dir, ls->start);
+	snprintf(tmp, sizeof(tmp), "%s/%lld.idx.tmp", ls->dir, ls->start);
+	if (!(f = fopen(tmp, "w")))
+		warn("logstore: %s", tmp);
+	else if ((write_index(ls, f) | fclose(f)) != 0 ||
+	    rename(tmp, path) == -1) {
+		warn("logstore: %s", path);
+		unlink(tmp);
+	}
+
+	for (uint32_t i = 0; i < ls->npostings; i++)
+		free(ls->postings[i].blocks);
+	ls->npostings = 0;
+	hashset_free(ls->keys);
+	ls->keys = NULL;
+}
+
+void
+logstore_free(struct logstore *ls)
+{
+	if (!ls)
+		return;
+	segment_close(ls);
+	free(ls->times);
+	free(ls->offsets);
+	free(ls->postings);
+	free(ls->dir);
+	free(ls);
+}
+
+static void
+new_block(struct logstore *ls, time_t t)
+{
+	if (ls->nblocks == ls->blocksz) {
+		ls->blocksz = ls->blocksz ? ls->blocksz * 2 : 256;
+		ls->times = xreallocarray(ls->times, ls->blocksz,
+		    sizeof(int64_t));
+		ls->offsets = xreallocarray(ls->offsets, ls->blocksz,
+		    sizeof(uint32_t));
+	}
+	ls->times[ls->nblocks] = t;
+	ls->offsets[ls->nblocks++] = ls->size;
+}
+
+/*
+ * Adds the current block to the blocks of key.
+ */
+static void
+add_key(struct logstore *ls, uint32_t key)
+{
+	uint16_t block = ls->nblocks - 1;
+	struct posting *p;
+	uint64_t i;
+
+	if (hashset_get(ls->keys, key | HASHED, &i))
+		p = &ls->postings[i];
+	else {
+		if (ls->npostings == ls->postingsz) {
+			ls->postingsz = ls->postingsz ? ls->postingsz * 2 :
+			    4096;
+			ls->postings = xreallocarray(ls->postings,
+			    ls->postingsz, sizeof(struct posting));
+		}
+		hashset_put(ls->keys, key | HASHED, ls->npostings);
+		p = &ls->postings[ls->npostings++];
+		*p = (struct posting){ .key = key };
+	}
+	if (p->n && p->blocks[p->n - 1] == block)
+		return;
+	if (p->n == p->sz) {
+		p->sz = p->sz ? p->sz * 2 : 4;
+		p->blocks = xreallocarray(p->blocks, p->sz, sizeof(uint16_t));
+	}
+	p->blocks[p->n++] = block;
+}
+
+/*
+ * Stores a line of text of len bytes, without a line end, output at time t.
+ * type is the BatClient message type of the line, or "" for plain text.
+ */
+void
+logstore_line(struct logstore *ls, time_t t, const char *type,
+    const char *text, size_t len)
+{
+	const unsigned char *s = (const unsigned char *)text;
+	int n;
+
+	if (!ls)
+		return;
+	if (!ls->log)
+		segment_open(ls, t);
+	if (!ls->nblocks ||
+	    ls->size - ls->offsets[ls->nblocks - 1] >= LOGSTORE_BLOCK)
+		new_block(ls, t);
+	if ((n = fprintf(ls->log, "%lld\t%s\t", (long long)t, type)) > 0)
+		ls->size += n;
+	ls->size += fwrite(text, 1, len, ls->log);
+	if (putc('\n', ls->log) != EOF)
+		ls->size++;
+
+	if (*type)
+		add_key(ls, type_key(type));
+	for (size_t i = 2; i < len; i++)
+		add_key(ls, trigram(s + i - 2));
+	if (ls->size >= LOGSTORE_SEGMENT)
+		segment_close(ls);
+}
+
+/*
+ * Writes the lines stored so far to the current segment, where searches see
+ * them.
+ */
+void
+logstore_flush(struct logstore *ls)
+{
+	if (ls && ls->log)
+		fflush(ls->log);
+}
+
+struct query {
+	const char	*type;		/* NULL for any */
+	time_t		since, until;
+	char		*text;		/* folded */
+	size_t		len;
+	uint32_t	*keys;		/* distinct, of text and type */
+	size_t		nkeys;
+	char		*buf;
+	size_t		bufsz;
+};
+
+static int
+contains(const char *s, size_t len, const struct query *q)
+{
+	const unsigned char *text = (const unsigned char *)q->text;
+
+	for (size_t i = 0; i + q->len <= len; i++) {
+		size_t j = 0;
+		while (j < q->len && fold(s[i + j]) == text[j])
+			j++;
+		if (j == q->len)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Prints the lines of len bytes at p that match q.
+ */
+static void
+search_lines(const struct query *q, const char *p, size_t len)
+{
+	const char *end = p + len, *nl, *type, *tab;
+	char when[32];
+	struct tm tm;
+	char *e;
+
+	for (; p < end; p = nl + 1) {
+		time_t t = strtoll(p, &e, 10);
+		if (!(nl = memchr(p, '\n', end - p)))
+			nl = end;
+		if (e >= nl || *e != '\t')
+			continue;
+		type = e + 1;
+		if (!(tab = memchr(type, '\t', nl - type)))
+			continue;
+		if (t < q->since || t > q->until)
+			continue;
+		if (q->type && (strlen(q->type) != (size_t)(tab - type) ||
+		    memcmp(q->type, type, tab - type) != 0))
+			continue;
+		if (!contains(tab + 1, nl - tab - 1, q))
+			continue;
+		localtime_r(&t, &tm);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S ", &tm);
+		fputs(when, stdout);
+		fwrite(tab + 1, 1, nl - tab - 1, stdout);
+		putchar('\n');
+	}
+}
+
+/*
+ * Reads len bytes at offset off of fd into q->buf and searches them.
+ */
+static void
+search_range(struct query *q, int fd, off_t off, size_t len)
+{
+	ssize_t n;
+
+	if (len > q->bufsz) {
+		q->bufsz = len;
+		q->buf = xreallocarray(q->buf, len, 1);
+	}
+	if ((n = pread(fd, q->buf, len, off)) == -1)
+		err(1, "pread");
+	search_lines(q, q->buf, n);
+}
+
+static int
+cmp_key(const void *a, const void *b)
+{
+	uint32_t ka = *(const uint32_t *)a, kb = ((const struct key *)b)->key;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+/*
+ * Searches the blocks of a segment that its index has all the keys of q in.
+ * Returns -1 if the index can't be used.
+ */
+static int
+search_indexed(struct query *q, int fd, int ifd)
+{
+	const struct header *h;
+	const int64_t *times;
+	const uint32_t *offsets;
+	const struct key *keys;
+	const uint16_t *postings;
+	uint32_t *hits;
+	struct stat sb;
+	void *map;
+
+	if (fstat(ifd, &sb) == -1 || (size_t)sb.st_size < sizeof(*h))
+		return -1;
+	if ((map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, ifd, 0)) ==
+	    MAP_FAILED)
+		return -1;
+	h = map;
+	if (memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0 ||
+	    (size_t)sb.st_size != sizeof(*h) +
+	    h->nblocks * sizeof(int64_t) +
+	    (h->nblocks + 1) * sizeof(uint32_t) +
+	    h->nkeys * sizeof(struct key) + h->npostings * sizeof(uint16_t)) {
+		munmap(map, sb.st_size);
+		return -1;
+	}
+	times = (const int64_t *)(h + 1);
+	offsets = (const uint32_t *)(times + h->nblocks);
+	keys = (const struct key *)(offsets + h->nblocks + 1);
+	postings = (const uint16_t *)(keys + h->nkeys);
+
+	if (!(hits = calloc(h->nblocks, sizeof(uint32_t))))
+		err(1, "logstore: malloc");
+	for (size_t i = 0; i < q->nkeys; i++) {
+		const struct key *k = bsearch(&q->keys[i], keys, h->nkeys,
+		    sizeof(struct key), cmp_key);
+		if (!k)
+			break;
+		for (uint32_t j = 0; j < k->count &&
+		    k->start + j < h->npostings; j++)
+			if (postings[k->start + j] < h->nblocks)
+				hits[postings[k->start + j]]++;
+	}
+	for (uint32_t b = 0; b < h->nblocks; b++) {
+		if (hits[b] != q->nkeys)
+			continue;
+		if (times[b] > q->until)
+			break;
+		if (b + 1 < h->nblocks && times[b + 1] < q->since)
+			continue;
+		if (offsets[b + 1] > offsets[b])
+			search_range(q, fd, offsets[b],
+			    offsets[b + 1] - offsets[b]);
+	}
+	free(hits);
+	munmap(map, sb.st_size);
+	return 0;
+}
+
+static void
+search_segment(struct query *q, const char *dir, long long start)
+{
+	char path[PATH_MAX];
+	struct stat sb;
+	int fd, ifd;
+
+	snprintf(path, sizeof(path), "%s/%lld.log", dir, start);
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		warn("%s", path);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%lld.idx", dir, start);
+	ifd = open(path, O_RDONLY);
+	if ((ifd == -1 || search_indexed(q, fd, ifd) == -1) &&
+	    fstat(fd, &sb) == 0)
+		search_range(q, fd, 0, sb.st_size);
+	if (ifd != -1)
+		close(ifd);
+	close(fd);
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t ka = *(const uint32_t *)a, kb = *(const uint32_t *)b;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+static int
+cmp_segment(const void *a, const void *b)
+{
+	long long sa = *(const long long *)a, sb = *(const long long *)b;
+
+	return sa < sb ? -1 : sa > sb;
+}
+
+/*
+ * Prints the lines stored in dir between the times since and until that are
+ * of type (any if NULL) and contain text (any if NULL), ignoring case.
+ */
+int
+logstore_search(const char *dir, const char *type, time_t since,
+    time_t until, const char *text)
+{
+	struct query q = { .type = type, .since = since, .until = until };
+	long long *segments = NULL;
+	size_t nsegments = 0, sz = 0;
+	struct dirent *de;
+	DIR *d;
+
+	if (!(d = opendir(dir)))
+		err(1, "%s", dir);
+	while ((de = readdir(d))) {
+		char *end;
+		long long start = strtoll(de->d_name, &end, 10);
+		if (end == de->d_name || strcmp(end, ".log") != 0)
+			continue;
+		if (nsegments == sz) {
+			sz = sz ? sz * 2 : 64;
+			segments = xreallocarray(segments, sz,
+			    sizeof(long long));
+		}
+		segments[nsegments++] = start;
+	}
+	closedir(d);
+	qsort(segments, nsegments, sizeof(long long), cmp_segment);
+
+	q.len = text ? strlen(text) : 0;
+	if (!(q.text = malloc(q.len + 1)) ||
+	    !(q.keys = calloc(q.len + 1, sizeof(uint32_t))))
+		err(1, "logstore: malloc");
+	for (size_t i = 0; i < q.len; i++)
+		q.text[i] = fold(text[i]);
+	for (size_t i = 2; i < q.len; i++)
+		q.keys[q.nkeys++] = trigram((unsigned char *)q.text + i - 2);
+	if (type)
+		q.keys[q.nkeys++] = type_key(type);
+	qsort(q.keys, q.nkeys, sizeof(uint32_t), cmp_u32);
+	for (size_t i = 1, n = q.nkeys; i < n; i++)
+		if (q.keys[i] == q.keys[i - 1])
+			q.nkeys--;
+		else
+			q.keys[i - (n - q.nkeys)] = q.keys[i];
+
+	for (size_t i = 0; i < nsegments; i++) {
+		if (segments[i] > until)
+			break;
+		/* later segments start after the lines of this one */
+		if (i + 1 < nsegments && segments[i + 1] < since)
+			continue;
+		search_segment(&q, dir, segments[i]);
+	}
+	free(segments);
+	free(q.text);
+	free(q.keys);
+	free(q.buf);
+	return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+#include <stddef.h>
+#include <time.h>
+
+/* A segment is closed and indexed once it has this many bytes */
+#define LOGSTORE_SEGMENT	(8 * 1024 * 1024)
+/* Lines are indexed by the block of about this many bytes they are in */
+#define LOGSTORE_BLOCK		8192
+
+struct logstore;
+
+struct logstore *logstore_new(const char *);
+void		logstore_free(struct logstore *);
+void		logstore_line(struct logstore *, time_t, const char *,
+		    const char *, size_t);
+void		logstore_flush(struct logstore *);
+int		logstore_search(const char *, const char *, time_t, time_t,
+		    const char *);
+
+#endif /* LOGSTORE_H */
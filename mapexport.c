@@ -0,0 +1,429 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "db.h"
+#include "hashset.h"
+#include "json.h"
+#include "layout.h"
+#include "mapexport.h"
+#include "room.h"
+#include "xmalloc.h"
+
+/*
+ * Map export for render.html: reads the stored rooms and exits and writes
+ * them as sigma.js JSON, with each room placed on a grid.
+ *
+ * Rooms connected by the cardinal directions are placed next to each other,
+ * following exits both ways, so that each connected part of the map becomes
+ * a level with its own coordinates and color. A room whose cell is already
+ * taken in the level (the map is not a plane, or an exit lies) starts or
+ * joins another level instead. The levels are then packed on rows, largest
+ * first, so that they don't overlap.
+ *
+ * Exits are styled by layout_edge_style. Rooms with obvious exits that are
+ * not mapped are drawn as red diamonds.
+ */
+
+#define NONE		UINT32_MAX
+#define OUT_FLUSH	65536
+
+struct node {
+	char		*id;
+	char		*label;		/* short description */
+	char		*longdesc;
+	char		*exits;
+	int		indoors;
+	uint32_t	level;		/* NONE until placed */
+	int32_t		x, y;		/* within the level */
+	uint32_t	out;		/* first exit from this room */
+	uint32_t	in;		/* first exit to this room */
+};
+
+struct edge {
+	uint32_t	src, dst;
+	char		*dir;
+	uint32_t	nextout, nextin;
+};
+
+struct level {
+	int32_t		minx, maxx, miny, maxy;
+	int32_t		offx, offy;	/* of the level on the map */
+	uint32_t	rooms;
+};
+
+struct map {
+	const char	*area;		/* NULL for all */
+	struct hashset	*ids;		/* id hash -> node index + 1 */
+	struct hashset	*cells;		/* of placed rooms */
+	struct node	*nodes;
+	uint32_t	nnodes, nodecap;
+	struct edge	*edges;
+	uint32_t	nedges, edgecap;
+	struct level	*levels;
+	uint32_t	nlevels, levelcap;
+};
+
+static void *
+grow(void *p, uint32_t *cap, size_t size)
+{
+	if (*cap > UINT32_MAX / 2 - 1)
+		errx(1, "map too large");
+	*cap = *cap ? *cap * 2 : 1024;
+	return xreallocarray(p, *cap, size);
+}
+
+static char *
+xstrdup(const char *s)
+{
+	char *dup = strdup(s);
+	if (!dup)
+		err(1, "malloc");
+	return dup;
+}
+
+static uint32_t
+find(const struct map *m, const char *id)
+{
+	uint64_t idx;
+
+	if (!hashset_get(m->ids, hash_str(HASH_INIT, id), &idx) ||
+	    strcmp(m->nodes[idx - 1].id, id) != 0)
+		return NONE;
+	return idx - 1;
+}
+
+static void
+add_room(void *arg, const struct room *room)
+{
+	struct map *m = arg;
+	struct node *n;
+
+	if (m->area && strcmp(room->area, m->area) != 0)
+		return;
+	if (find(m, room->id) != NONE)
+		return;
+	if (m->nnodes == m->nodecap)
+		m->nodes = grow(m->nodes, &m->nodecap, sizeof(struct node));
+	n = &m->nodes[m->nnodes];
+	*n = (struct node){
+		.id = xstrdup(room->id),
+		.label = xstrdup(room->shortdesc),
+		.longdesc = xstrdup(room->longdesc),
+		.exits = xstrdup(room->exits),
+		.indoors = room->indoors,
+		.level = NONE,
+		.out = NONE,
+		.in = NONE,
+	};
+	hashset_put(m->ids, hash_str(HASH_INIT, room->id), ++m->nnodes);
+}
+
+/*
+ * db_load_cb adding the exits between rooms of the map.
+ */
+static void
+add_exit(void *arg, const char *src, const char *area, const char *dest,
+    const char *direction, uint64_t hash)
+{
+	struct map *m = arg;
+	uint32_t s, d;
+	struct edge *e;
+
+	if (!dest || (s = find(m, src)) == NONE || (d = find(m, dest)) == NONE)
+		return;
+	if (m->nedges == m->edgecap)
+		m->edges = grow(m->edges, &m->edgecap, sizeof(struct edge));
+	e = &m->edges[m->nedges];
+	*e = (struct edge){
+		.src = s,
+		.dst = d,
+		.dir = xstrdup(direction),
+		.nextout = m->nodes[s].out,
+		.nextin = m->nodes[d].in,
+	};
+	m->nodes[s].out = m->nodes[d].in = m->nedges++;
+}
+
+static uint64_t
+cell(uint32_t level, int32_t x, int32_t y)
+{
+	uint64_t h = hash_bytes(HASH_INIT, &level, sizeof(level));
+	h = hash_bytes(h, &x, sizeof(x));
+	return hash_bytes(h, &y, sizeof(y));
+}
+
+/*
+ * Places room n at x, y on the newest level, if the cell is free.
+ */
+static int
+place(struct map *m, uint32_t n, int32_t x, int32_t y)
+{
+	uint32_t l = m->nlevels - 1;
+	struct level *lv = &m->levels[l];
+
+	if (!hashset_add(m->cells, cell(l, x, y)))
+		return 0;
+	m->nodes[n].level = l;
+	m->nodes[n].x = x;
+	m->nodes[n].y = y;
+	if (x < lv->minx)
+		lv->minx = x;
+	if (x > lv->maxx)
+		lv->maxx = x;
+	if (y < lv->miny)
+		lv->miny = y;
+	if (y > lv->maxy)
+		lv->maxy = y;
+	lv->rooms++;
+	return 1;
+}
+
+/*
+ * Places the rooms reachable from n on the cardinal directions on a new
+ * level, breadth first.
+ */
+static void
+place_level(struct map *m, uint32_t n, uint32_t *queue)
+{
+	uint32_t head = 0, tail = 0;
+
+	if (m->nlevels == m->levelcap)
+		m->levels = grow(m->levels, &m->levelcap, sizeof(struct level));
+	m->levels[m->nlevels++] = (struct level){ 0 };
+	place(m, n, 0, 0);
+	queue[tail++] = n;
+	while (head < tail) {
+		uint32_t u = queue[head++];
+		struct node *un = &m->nodes[u];
+		int dx, dy;
+
+		for (uint32_t e = un->out; e != NONE; e = m->edges[e].nextout) {
+			uint32_t v = m->edges[e].dst;
+			if (m->nodes[v].level == NONE &&
+			    layout_offset(m->edges[e].dir, &dx, &dy) &&
+			    place(m, v, un->x + dx, un->y + dy))
+				queue[tail++] = v;
+		}
+		for (uint32_t e = un->in; e != NONE; e = m->edges[e].nextin) {
+			uint32_t v = m->edges[e].src;
+			if (m->nodes[v].level == NONE &&
+			    layout_offset(m->edges[e].dir, &dx, &dy) &&
+			    place(m, v, un->x - dx, un->y - dy))
+				queue[tail++] = v;
+		}
+	}
+}
+
+static int
+cmp_levels(const void *a, const void *b)
+{
+	const struct level *la = *(struct level *const *)a;
+	const struct level *lb = *(struct level *const *)b;
+
+	if (la->rooms != lb->rooms)
+		return la->rooms < lb->rooms ? 1 : -1;
+	return la < lb ? -1 : la > lb;
+}
+
+/*
+ * Packs the levels on rows about as wide as the map is high.
+ */
+static void
+pack_levels(struct map *m)
+{
+	struct level **order;
+	double cells = 0;
+	int32_t width = 0, x = 0, y = 0, rowheight = 0;
+
+	if (!m->nlevels)
+		return;
+	if (!(order = calloc(m->nlevels, sizeof(struct level *))))
+		err(1, "malloc");
+	for (uint32_t l = 0; l < m->nlevels; l++) {
+		struct level *lv = &m->levels[l];
+		int32_t w = lv->maxx - lv->minx + 1 + LAYOUT_GAP;
+		int32_t h = lv->maxy - lv->miny + 1 + LAYOUT_GAP;
+		cells += (double)w * h;
+		if (w > width)
+			width = w;
+		order[l] = lv;
+	}
+	while ((double)width * width < cells)
+		width++;
+	qsort(order, m->nlevels, sizeof(struct level *), cmp_levels);
+	for (uint32_t i = 0; i < m->nlevels; i++) {
+		struct level *lv = order[i];
+		int32_t w = lv->maxx - lv->minx + 1 + LAYOUT_GAP;
+		int32_t h = lv->maxy - lv->miny + 1 + LAYOUT_GAP;
+		if (x && x + w > width) {
+			x = 0;
+			y += rowheight;
+			rowheight = 0;
+		}
+		lv->offx = x - lv->minx;
+		lv->offy = y - lv->miny;
+		x += w;
+		if (h > rowheight)
+			rowheight = h;
+	}
+	free(order);
+}
+
+static void
+layout(struct map *m)
+{
+	uint32_t *queue;
+
+	if (!(queue = calloc(m->nnodes ? m->nnodes : 1, sizeof(uint32_t))))
+		err(1, "malloc");
+	for (uint32_t n = 0; n < m->nnodes; n++)
+		if (m->nodes[n].level == NONE)
+			place_level(m, n, queue);
+	free(queue);
+	pack_levels(m);
+}
+
+static void
+flush(buffer *out, size_t min)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	if (out->len < min)
+		return;
+	while (off < out->len) {
+		if ((n = write(STDOUT_FILENO, out->data + off,
+		    out->len - off)) < 0)
+			err(1, "write");
+		off += n;
+	}
+	buffer_clear(out);
+}
+
+/*
+ * Writes the directions of the obvious exits of n that are not mapped.
+ */
+static int
+write_unknown(buffer *out, const struct map *m, const struct node *n)
+{
+	const char *p = n->exits;
+	int count = 0;
+
+	while (*p) {
+		size_t len = strcspn(p, ",");
+		uint32_t e;
+
+		for (e = n->out; e != NONE; e = m->edges[e].nextout)
+			if (strncmp(m->edges[e].dir, p, len) == 0 &&
+			    m->edges[e].dir[len] == '\0')
+				break;
+		if (len && e == NONE) {
+			if (!count++) {
+				json_str(out, "borderColor", "#ff0000", 0);
+				json_str(out, "type", "diamond", 0);
+				json_key(out, "unknown", 0);
+				buffer_append_str(out, "[");
+			} else
+				buffer_append_str(out, ",");
+			buffer_append_json_str(out, p, len);
+		}
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+	if (count)
+		buffer_append_str(out, "]");
+	return count;
+}
+
+static void
+write_map(buffer *out, const struct map *m)
+{
+	buffer_append_str(out, "{\"nodes\":[");
+	for (uint32_t i = 0; i < m->nnodes; i++) {
+		const struct node *n = &m->nodes[i];
+		const struct level *lv = &m->levels[n->level];
+
+		buffer_append_str(out, i ? ",{" : "{");
+		json_str(out, "id", n->id, 1);
+		json_str(out, "label", n->label, 0);
+		json_str(out, "longdesc", n->longdesc, 0);
+		json_bool(out, "indoors", n->indoors, 0);
+		json_str(out, "exits", n->exits, 0);
+		json_int(out, "size", 1, 0);
+		json_int(out, "x", n->x + lv->offx, 0);
+		json_int(out, "y", n->y + lv->offy, 0);
+		json_str(out, "color", layout_color(n->level), 0);
+		write_unknown(out, m, n);
+		buffer_append_str(out, "}");
+		flush(out, OUT_FLUSH);
+	}
+	buffer_append_str(out, "],\"edges\":[");
+	for (uint32_t i = 0; i < m->nedges; i++) {
+		const struct edge *e = &m->edges[i];
+		const struct node *s = &m->nodes[e->src];
+		const struct node *d = &m->nodes[e->dst];
+
+		buffer_append_str(out, i ? ",{" : "{");
+		json_int(out, "id", i, 1);
+		json_str(out, "source", s->id, 0);
+		json_str(out, "target", d->id, 0);
+		layout_edge_style(out, e->dir, s->level, s->x, s->y, d->level,
+		    d->x, d->y);
+		buffer_append_str(out, "}");
+		flush(out, OUT_FLUSH);
+	}
+	buffer_append_str(out, "]}\n");
+	flush(out, 0);
+}
+
+static void
+map_free(struct map *m)
+{
+	for (uint32_t i = 0; i < m->nnodes; i++) {
+		free(m->nodes[i].id);
+		free(m->nodes[i].label);
+		free(m->nodes[i].longdesc);
+		free(m->nodes[i].exits);
+	}
+	for (uint32_t i = 0; i < m->nedges; i++)
+		free(m->edges[i].dir);
+	free(m->nodes);
+	free(m->edges);
+	free(m->levels);
+	hashset_free(m->ids);
+	hashset_free(m->cells);
+}
+
+/*
+ * Writes the rooms of area, or the whole map if area is NULL, from the
+ * backend db opened with param to standard output.
+ */
+int
+mapexport(struct db *db, const char *param, const char *area)
+{
+	struct map m = { .area = area };
+	buffer *out;
+
+	if (!db->rooms || !db->load)
+		errx(1, "the database backend can't list rooms");
+	m.ids = hashset_new();
+	m.cells = hashset_new();
+	if (!(out = buffer_new(OUT_FLUSH * 2)))
+		err(1, "malloc");
+	db->dbp = db->dbp_init(param);
+	if (db->rooms(db->dbp, add_room, &m) == -1 ||
+	    db->load(db->dbp, add_exit, &m) == -1)
+		errx(1, "failed to read the map");
+	db->dbp_free(db->dbp);
+	db->dbp = NULL;
+	layout(&m);
+	write_map(out, &m);
+	warnx("%u rooms, %u exits, %u levels", m.nnodes, m.nedges, m.nlevels);
+	buffer_free(out);
+	map_free(&m);
+	return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef MAPEXPORT_H
+#define MAPEXPORT_H
+#include "db.h"
+
+int	mapexport(struct db *, const char *, const char *);
+
+#endif /* MAPEXPORT_H */
@@ -0,0 +1,248 @@
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "buffer.h"
+#include "metrics.h"
+
+/*
+ * Counters and histograms in the Prometheus text format. Each thread counts
+ * in its own block, which it registers the first time it records something,
+ * so recording is a plain add without locks or atomic read-modify-writes.
+ * The blocks are summed when the metrics are written; relaxed atomic loads
+ * and stores keep the words from tearing.
+ */
+
+struct histogram {
+	unsigned long	bucket[METRICS_BUCKETS];
+	unsigned long	count;
+	uint64_t	sum;
+};
+
+struct block {
+	unsigned long		counter[METRIC_NCOUNTERS];
+	unsigned long		tag[METRICS_TAGS + 1];
+	struct histogram	hist[METRIC_NHISTOGRAMS];
+	struct block		*next;
+};
+
+static const struct {
+	const char	*name;
+	const char	*type;
+	const char	*help;
+} counters[METRIC_NCOUNTERS] = {
+	[METRIC_SERVER_READ] = { "bcproxy_server_read_bytes_total",
+	    "counter", "Bytes read from the server." },
+	[METRIC_SERVER_WRITTEN] = { "bcproxy_server_written_bytes_total",
+	    "counter", "Bytes sent to the server." },
+	[METRIC_CLIENT_READ] = { "bcproxy_client_read_bytes_total",
+	    "counter", "Bytes read from the client." },
+	[METRIC_CLIENT_WRITTEN] = { "bcproxy_client_written_bytes_total",
+	    "counter", "Bytes sent to the client." },
+	[METRIC_UNKNOWN_TAGS] = { "bcproxy_unknown_tags_total",
+	    "counter", "BatClient tags with an unknown code." },
+	[METRIC_PROMPTS_DEFERRED] = { "bcproxy_prompts_deferred_total",
+	    "counter", "spec_prompt messages held for a GOAHEAD." },
+	[METRIC_DB_ERRORS] = { "bcproxy_db_errors_total",
+	    "counter", "Database backend calls that failed." },
+	[METRIC_OBUF_HIGHWATER] = { "bcproxy_obuf_highwater_bytes",
+	    "gauge", "Most output buffered for the client at once." },
+	[METRIC_BUFFER_ALLOCS] = { "bcproxy_buffer_allocs_total",
+	    "counter", "Buffer allocations and reallocations." },
+	[METRIC_ROOM_ALLOCS] = { "bcproxy_room_allocs_total",
+	    "counter", "Room allocations." },
+	[METRIC_PASSTHROUGH_CHUNKS] = { "bcproxy_passthrough_chunks_total",
+	    "counter", "Server reads sent to the client without parsing." },
+	[METRIC_PASSTHROUGH_BYTES] = { "bcproxy_passthrough_bytes_total",
+	    "counter", "Bytes sent to the client without parsing." },
+	[METRIC_PARSED_CHUNKS] = { "bcproxy_parsed_chunks_total",
+	    "counter", "Server reads that were parsed." },
+	[METRIC_TAG_OVERFLOWS] = { "bcproxy_tag_overflows_total",
+	    "counter", "Tags output as plain text for exceeding a limit." },
+};
+
+static const struct {
+	const char	*name;
+	const char	*help;
+	double		scale;		/* recorded unit in the exported one */
+} histograms[METRIC_NHISTOGRAMS] = {
+	[METRIC_TLS_READ_BYTES] = { "bcproxy_tls_read_bytes",
+	    "Sizes of reads from the server.", 1 },
+	[METRIC_DB_CALL_USEC] = { "bcproxy_db_call_seconds",
+	    "Duration of database backend calls.", 1e-6 },
+};
+
+static __thread struct block *local;
+static struct block *blocks;
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct block *
+block_get(void)
+{
+	if (local)
+		return local;
+	if (!(local = calloc(1, sizeof(struct block))))
+		err(1, "metrics: malloc");
+	pthread_mutex_lock(&blocks_lock);
+	local->next = blocks;
+	blocks = local;
+	pthread_mutex_unlock(&blocks_lock);
+	return local;
+}
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define ADD(p, n)	__atomic_store_n((p), *(p) + (n), __ATOMIC_RELAXED)
+
+void
+metrics_add(enum metrics_counter c, unsigned long n)
+{
+	struct block *b = block_get();
+
+	ADD(&b->counter[c], n);
+}
+
+/*
+ * Raises the counter c to v if it is lower.
+ */
+void
+metrics_max(enum metrics_counter c, unsigned long v)
+{
+	struct block *b = block_get();
+
+	if (v > b->counter[c])
+		__atomic_store_n(&b->counter[c], v, __ATOMIC_RELAXED);
+}
+
+void
+metrics_tag(int code)
+{
+	struct block *b = block_get();
+
+	if (code < 0 || code >= METRICS_TAGS)
+		code = METRICS_TAGS;
+	ADD(&b->tag[code], 1);
+}
+
+/*
+ * Adds v to the histogram h, in the bucket of the least power of two that is
+ * at least v.
+ */
+void
+metrics_observe(enum metrics_histogram h, uint64_t v)
+{
+	struct histogram *hist = &block_get()->hist[h];
+	int i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1);
+
+	if (i > METRICS_BUCKETS - 1)
+		i = METRICS_BUCKETS - 1;
+	ADD(&hist->bucket[i], 1);
+	ADD(&hist->count, 1);
+	ADD(&hist->sum, v);
+}
+
+static void
+append_header(buffer *out, const char *name, const char *type,
+    const char *help)
+{
+	buffer_append_str(out, "# HELP ");
+	buffer_append_str(out, name);
+	buffer_append_str(out, " ");
+	buffer_append_str(out, help);
+	buffer_append_str(out, "\n# TYPE ");
+	buffer_append_str(out, name);
+	buffer_append_str(out, " ");
+	buffer_append_str(out, type);
+	buffer_append_str(out, "\n");
+}
+
+/*
+ * Appends the metrics of all threads to out in the Prometheus text format.
+ */
+void
+metrics_write(buffer *out)
+{
+	char line[128];
+	struct block *first;
+
+	block_get();
+	pthread_mutex_lock(&blocks_lock);
+	first = blocks;
+	pthread_mutex_unlock(&blocks_lock);
+
+	for (int c = 0; c < METRIC_NCOUNTERS; c++) {
+		unsigned long v = 0;
+		for (struct block *b = first; b; b = b->next) {
+			unsigned long n = LOAD(&b->counter[c]);
+			if (c == METRIC_OBUF_HIGHWATER)
+				v = n > v ? n : v;
+			else
+				v += n;
+		}
+		append_header(out, counters[c].name, counters[c].type,
+		    counters[c].help);
+		snprintf(line, sizeof(line), "%s %lu\n", counters[c].name, v);
+		buffer_append_str(out, line);
+	}
+
+	append_header(out, "bcproxy_tags_total", "counter",
+	    "BatClient tags by code.");
+	for (int code = 0; code <= METRICS_TAGS; code++) {
+		unsigned long v = 0;
+		for (struct block *b = first; b; b = b->next)
+			v += LOAD(&b->tag[code]);
+		if (!v)
+			continue;
+		if (code == METRICS_TAGS)
+			snprintf(line, sizeof(line),
+			    "bcproxy_tags_total{code=\"other\"} %lu\n", v);
+		else
+			snprintf(line, sizeof(line),
+			    "bcproxy_tags_total{code=\"%d\"} %lu\n", code, v);
+		buffer_append_str(out, line);
+	}
+
+	for (int h = 0; h < METRIC_NHISTOGRAMS; h++) {
+		const char *name = histograms[h].name;
+		unsigned long cum = 0, count = 0;
+		uint64_t sum = 0;
+
+		append_header(out, name, "histogram", histograms[h].help);
+		for (int i = 0; i < METRICS_BUCKETS; i++) {
+			for (struct block *b = first; b; b = b->next)
+				cum += LOAD(&b->hist[h].bucket[i]);
+			if (i == METRICS_BUCKETS - 1)
+				snprintf(line, sizeof(line),
+				    "%s_bucket{le=\"+Inf\"} %lu\n", name, cum);
+			else
+				snprintf(line, sizeof(line),
+				    "%s_bucket{le=\"%.10g\"} %lu\n", name,
+				    (double)(1ULL << i) * histograms[h].scale,
+				    cum);
+			buffer_append_str(out, line);
+		}
+		for (struct block *b = first; b; b = b->next) {
+			count += LOAD(&b->hist[h].count);
+			sum += LOAD(&b->hist[h].sum);
+		}
+		snprintf(line, sizeof(line), "%s_sum %.10g\n%s_count %lu\n",
+		    name, (double)sum * histograms[h].scale, name, count);
+		buffer_append_str(out, line);
+	}
+}
+
+/*
+ * Appends {"metrics":...} to out, with what metrics_write appends as a JSON
+ * string, for the event feed.
+ */
+void
+metrics_json(buffer *out)
+{
+	buffer *text = buffer_new(8192);
+
+	metrics_write(text);
+	buffer_append_str(out, "{\"metrics\":");
+	buffer_append_json_str(out, text->data, text->len);
+	buffer_append_str(out, "}");
+	buffer_free(text);
+}
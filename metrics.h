@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include <stdint.h>
+#include "buffer.h"
+
+/* Tag codes counted separately; higher codes share one counter */
+#define METRICS_TAGS		100
+/* Histogram buckets: up to 2^(METRICS_BUCKETS - 2), then +Inf */
+#define METRICS_BUCKETS		24
+
+enum metrics_counter {
+	METRIC_SERVER_READ,		/* bytes */
+	METRIC_SERVER_WRITTEN,
+	METRIC_CLIENT_READ,
+	METRIC_CLIENT_WRITTEN,
+	METRIC_UNKNOWN_TAGS,
+	METRIC_PROMPTS_DEFERRED,
+	METRIC_DB_ERRORS,
+	METRIC_OBUF_HIGHWATER,		/* maximum, not a sum */
+	METRIC_BUFFER_ALLOCS,
+	METRIC_ROOM_ALLOCS,
+	METRIC_PASSTHROUGH_CHUNKS,	/* sent without parsing */
+	METRIC_PASSTHROUGH_BYTES,
+	METRIC_PARSED_CHUNKS,
+	METRIC_TAG_OVERFLOWS,		/* tags over a -b limit */
+	METRIC_NCOUNTERS
+};
+
+enum metrics_histogram {
+	METRIC_TLS_READ_BYTES,
+	METRIC_DB_CALL_USEC,
+	METRIC_NHISTOGRAMS
+};
+
+void	metrics_add(enum metrics_counter, unsigned long);
+void	metrics_max(enum metrics_counter, unsigned long);
+void	metrics_tag(int);
+void	metrics_observe(enum metrics_histogram, uint64_t);
+void	metrics_write(buffer *);
+void	metrics_json(buffer *);
+
+#endif /* METRICS_H */
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+
+# Converts a map database to the schema in initdb.sql: from the one keyed by
+# room id text, where rooms are keyed by a 64-bit hash of their id and room
+# descriptions are stored once in the description table, and from the one
+# without room hashes and room_version. The conversion runs in one
+# transaction; a database that is already converted is left alone.
+#
+# usage: migrate_db.py [--sqlite file]
+
+import os
+import sys
+
+
+def hash_str(h, s):
+    """hash_str() in hashset.c: FNV-1a of the UTF-8 bytes and a NUL"""
+    for b in s.encode('utf-8') + b'\0':
+        h = ((h ^ b) * 0x100000001b3) & 0xffffffffffffffff
+    return h
+
+
+def signed(h):
+    return h - (1 << 64) if h >= 1 << 63 else h
+
+
+def db_key(s):
+    """db_key() in db.c, as a signed 64-bit int"""
+    return signed(hash_str(0xcbf29ce484222325, s))
+
+
+def desc_key(s):
+    """The key of description s: db_key(), or db_key_alt() if that is taken"""
+    h = hash_str(0xcbf29ce484222325, s)
+    for k in (signed(h), signed(hash_str(h, s))):
+        if descs.setdefault(k, s) == s:
+            return k
+    raise ValueError('no free key for description: ' + s)
+
+
+def commit():
+    if param == '?':
+        cur.execute('commit')
+    else:
+        conn.commit()
+
+
+def initdb():
+    with open(os.path.join(os.path.dirname(__file__), 'initdb.sql')) as f:
+        schema = f.read()
+    if param != '?':
+        # without parameters, psycopg2 sends the file as one query
+        cur.execute(schema)
+        return
+    # the sqlite module runs one statement at a time; a ';' only ends one
+    # outside of comments and quotes
+    stmt = ''
+    for part in schema.split(';'):
+        stmt += part + ';'
+        if sqlite3.complete_statement(stmt):
+            cur.execute(stmt)
+            stmt = ''
+
+
+if len(sys.argv) > 2 and sys.argv[1] == '--sqlite':
+    import sqlite3
+    conn = sqlite3.connect(sys.argv[2], isolation_level=None)
+    param = '?'
+    columns = "select name from pragma_table_info('room')"
+else:
+    import psycopg2
+    conn = psycopg2.connect('dbname=batmud')
+    param = '%s'
+    columns = ("select column_name from information_schema.columns "
+               "where table_name='room'")
+cur = conn.cursor()
+if param == '?':
+    cur.execute('begin')
+
+cur.execute(columns)
+names = [row[0] for row in cur]
+if 'hash' in names:
+    print('already migrated', file=sys.stderr)
+    sys.exit(0)
+if 'key' in names:
+    # stored rooms get their hash when next visited
+    cur.execute('alter table room add column hash BIGINT')
+    initdb()
+    commit()
+    print('added room hashes and versions', file=sys.stderr)
+    sys.exit(0)
+
+cur.execute('select id, shortdesc, longdesc, area, indoors, exits from room')
+rooms = cur.fetchall()
+cur.execute('select source, destination, direction from exit')
+old_exits = cur.fetchall()
+cur.execute('drop table exit')
+cur.execute('drop table room')
+initdb()
+
+descs = {}
+rows = [(db_key(id), id, desc_key(short), desc_key(long), area, indoors,
+         exits)
+        for id, short, long, area, indoors, exits in rooms]
+cur.executemany('insert into description(hash, text) values (' +
+                ', '.join([param] * 2) + ')',
+                list(descs.items()))
+cur.executemany('insert into room(key, id, shortdesc, longdesc, area, '
+                'indoors, exits) values (' + ', '.join([param] * 7) + ')',
+                rows)
+
+ids = set(row[0] for row in rooms)
+exits = {}
+for src, dst, direction in old_exits:
+    if src in ids and dst in ids:
+        exits[(db_key(src), db_key(dst))] = direction
+cur.executemany('insert into exit(source, destination, direction) values (' +
+                ', '.join([param] * 3) + ')',
+                [(src, dst, direction)
+                 for (src, dst), direction in exits.items()])
+
+commit()
+print('migrated {} rooms, {} descriptions, {} exits'.format(
+    len(rooms), len(descs), len(exits)), file=sys.stderr)
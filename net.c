@@ -23,6 +23,18 @@ socket_setblocking(int fd)
 	return flags;
 }
 
+/*
+ * Sets O_NONBLOCK on fd. Returns -1 with errno set on failure.
+ */
+int
+socket_setnonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
 /*
  * Blocking call to send all data out on a TLS socket. Prints errors on stderr
  * and returns -1 on error, the number of bytes sent on success.
@@ -74,16 +86,15 @@ sendall(int fd, const char *buf, size_t len)
 	return (buf - start);
 }
 
+static const char *hostname = "batmud.bat.org";
+
 /*
- * Connects to BatMUD via TCP and enables batclient mode (by sending BC_ENABLE)
- * and returns a tls context and socket fd, or NULL on error.
+ * Connects to BatMUD via TCP and stores the socket in *fd. Returns -1 on
+ * error.
  */
-struct tls *
-connect_batmud(int *fd)
+static int
+batmud_socket(int *fd)
 {
-	struct tls *ctx = NULL;
-	const char *bc_magic = "\033bc 1\n\033<vbcp/" PROXY_VERSION ">\n";
-	const char *hostname = "batmud.bat.org";
 	char *servname = "2022";
 	int ret;
 	struct addrinfo *result, *rp;
@@ -92,7 +103,6 @@ connect_batmud(int *fd)
 		.ai_socktype = SOCK_STREAM,
 	};
 
-	ctx = tls_client();
 	ret = getaddrinfo(hostname, servname, &hints, &result);
 	for (rp = result; rp != NULL; rp = rp->ai_next) {
 		*fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
@@ -106,14 +116,57 @@ connect_batmud(int *fd)
 
 	if (!rp) {
 		close(*fd);
-		return NULL;
+		return -1;
 	}
+	return 0;
+}
+
+/*
+ * Completes the TLS handshake and enables batclient mode (by sending
+ * BC_ENABLE).
+ */
+static void
+batmud_start(struct tls *ctx, int fd)
+{
+	const char *bc_magic = "\033bc 1\n\033<vbcp/" PROXY_VERSION ">\n";
 
-	if (tls_connect_socket(ctx, *fd, hostname) < 0)
-		errx(1, "tls_connect_socket: %s", tls_error(ctx));
 	if (tls_handshake(ctx) < 0)
 		errx(1, "tls_handshake: %s", tls_error(ctx));
+	(void) tls_sendall(ctx, fd, bc_magic, strlen(bc_magic));
+}
 
-	(void) tls_sendall(ctx, *fd, bc_magic, strlen(bc_magic));
+/*
+ * Connects to BatMUD via TCP and enables batclient mode (by sending BC_ENABLE)
+ * and returns a tls context and socket fd, or NULL on error.
+ */
+struct tls *
+connect_batmud(int *fd)
+{
+	struct tls *ctx = tls_client();
+
+	if (batmud_socket(fd) == -1)
+		return NULL;
+	if (tls_connect_socket(ctx, *fd, hostname) < 0)
+		errx(1, "tls_connect_socket: %s", tls_error(ctx));
+	batmud_start(ctx, *fd);
+	return ctx;
+}
+
+/*
+ * Like connect_batmud, but the TLS connection reads and writes its records
+ * with readcb and writecb, which get arg and must use the socket fd for the
+ * handshake.
+ */
+struct tls *
+connect_batmud_cbs(int *fd, tls_read_cb readcb, tls_write_cb writecb,
+    void *arg)
+{
+	struct tls *ctx = tls_client();
+
+	if (batmud_socket(fd) == -1)
+		return NULL;
+	if (tls_connect_cbs(ctx, readcb, writecb, arg, hostname) < 0)
+		errx(1, "tls_connect_cbs: %s", tls_error(ctx));
+	batmud_start(ctx, *fd);
 	return ctx;
 }
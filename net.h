@@ -5,5 +5,7 @@
 ssize_t tls_sendall(struct tls *, int, const char *, size_t);
 ssize_t sendall(int, const char *, size_t);
 struct tls *connect_batmud(int *);
+struct tls *connect_batmud_cbs(int *, tls_read_cb, tls_write_cb, void *);
+int socket_setnonblocking(int);
 
 #endif /* NET_H */
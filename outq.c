@@ -0,0 +1,348 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "config.h"
+#include "metrics.h"
+#include "outq.h"
+
+/*
+ * Output queue towards the client. Regular text is never dropped; instead,
+ * the caller stops reading from the server while the queue is full
+ * (outq_full), which bounds memory use. Status updates that only matter for
+ * their latest value are queued with a key, and a newer update with the same
+ * key replaces an older one that has not been sent yet, so a client that
+ * catches up after stalling gets the current state instead of the history.
+ *
+ * Spectator queues may be attached to the client's queue (outq_attach). The
+ * output is then stored once, in chunks that all the queues reference and
+ * never change; each queue only keeps its own offset into them, so a
+ * spectator costs no copies, only its sends.
+ */
+
+#define OUTQ_IOV	64
+
+struct chunk {
+	unsigned	refs;			/* items referencing it */
+	buffer		*data;
+};
+
+struct item {
+	struct item	*next;
+	int		code;			/* 0 for regular text */
+	char		key[STATUS_NAME_MAX];
+	struct chunk	*chunk;
+	size_t		off;			/* bytes already sent */
+	int		copied;			/* by outq_peek, being sent */
+};
+
+struct outq {
+	struct item		*head;
+	struct item		*tail;
+	size_t			max;
+	struct outq_stats	stats;
+	struct outq		*next;		/* attached spectators */
+	int			spectator;	/* attached to a client queue */
+};
+
+struct outq *
+outq_new(size_t max)
+{
+	struct outq *q = calloc(1, sizeof(struct outq));
+	if (!q)
+		err(1, "outq_new: malloc");
+	q->max = max;
+	return q;
+}
+
+static struct chunk *
+chunk_new(const char *data, size_t len, size_t size)
+{
+	struct chunk *c = malloc(sizeof(struct chunk));
+	if (!c)
+		err(1, "outq: malloc");
+	c->refs = 0;
+	c->data = buffer_new(len > size ? len : size);
+	buffer_append(c->data, data, len);
+	return c;
+}
+
+static void
+chunk_unref(struct chunk *c)
+{
+	if (--c->refs > 0)
+		return;
+	buffer_free(c->data);
+	free(c);
+}
+
+static void
+item_free(struct item *it)
+{
+	chunk_unref(it->chunk);
+	free(it);
+}
+
+void
+outq_free(struct outq *q)
+{
+	struct item *it, *next;
+
+	if (!q)
+		return;
+	for (it = q->head; it; it = next) {
+		next = it->next;
+		item_free(it);
+	}
+	free(q);
+}
+
+static void
+account(struct outq *q, ssize_t delta)
+{
+	q->stats.bytes += delta;
+	if (q->stats.bytes > q->stats.highwater)
+		q->stats.highwater = q->stats.bytes;
+}
+
+/*
+ * Queues chunk c, of which off bytes are already sent.
+ */
+static void
+item_append(struct outq *q, int code, const char *key, struct chunk *c,
+    size_t off)
+{
+	struct item *it = calloc(1, sizeof(struct item));
+	if (!it)
+		err(1, "outq: malloc");
+	it->code = code;
+	if (key)
+		strlcpy(it->key, key, sizeof(it->key));
+	it->chunk = c;
+	c->refs++;
+	it->off = off;
+	if (q->tail)
+		q->tail->next = it;
+	else
+		q->head = it;
+	q->tail = it;
+	account(q, c->data->len - off);
+}
+
+/*
+ * Attaches the spectator queue s to q: everything queued on q from now on is
+ * queued on s as well.
+ */
+void
+outq_attach(struct outq *q, struct outq *s)
+{
+	s->next = q->next;
+	q->next = s;
+	s->spectator = 1;
+}
+
+void
+outq_detach(struct outq *q, struct outq *s)
+{
+	for (; q; q = q->next)
+		if (q->next == s) {
+			q->next = s->next;
+			s->next = NULL;
+			s->spectator = 0;
+			return;
+		}
+}
+
+/*
+ * Queues regular text. Without spectators, it is added to the text queued
+ * last if there is some.
+ */
+void
+outq_text(struct outq *q, const char *data, size_t len)
+{
+	struct item *it = q->tail;
+	struct chunk *c;
+
+	if (!len)
+		return;
+	if (!q->next && it && it->code == 0 && it->chunk->refs == 1) {
+		buffer_append(it->chunk->data, data, len);
+		account(q, len);
+		return;
+	}
+	c = chunk_new(data, len, q->next ? len : 4096);
+	for (; q; q = q->next)
+		item_append(q, 0, NULL, c, 0);
+}
+
+/*
+ * Queues a status update for tag code. If an unsent update with the same code
+ * and key is still queued, it is replaced in place.
+ */
+void
+outq_status(struct outq *q, int code, const char *key, const char *data,
+    size_t len)
+{
+	struct chunk *c = chunk_new(data, len, len);
+	struct item *it;
+
+	for (; q; q = q->next) {
+		for (it = q->head; it; it = it->next)
+			if (it->code == code && it->off == 0 && !it->copied &&
+			    strcmp(it->key, key) == 0)
+				break;
+		if (!it) {
+			item_append(q, code, key, c, 0);
+			continue;
+		}
+		account(q, (ssize_t)len - (ssize_t)it->chunk->data->len);
+		chunk_unref(it->chunk);
+		it->chunk = c;
+		c->refs++;
+		q->stats.replaced++;
+	}
+}
+
+/*
+ * Sends as much of the queue to fd as can be sent without blocking. Returns
+ * -1 on error, 0 otherwise.
+ */
+int
+outq_flush(struct outq *q, int fd)
+{
+	while (q->head) {
+		struct iovec iov[OUTQ_IOV];
+		struct msghdr msg = { .msg_iov = iov };
+		struct item *it;
+		ssize_t n;
+
+		for (it = q->head; it && msg.msg_iovlen < OUTQ_IOV;
+		    it = it->next) {
+			buffer *b = it->chunk->data;
+			iov[msg.msg_iovlen].iov_base = b->data + it->off;
+			iov[msg.msg_iovlen++].iov_len = b->len - it->off;
+		}
+		n = sendmsg(fd, &msg, MSG_DONTWAIT);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (n == -1) {
+			warn("send");
+			return -1;
+		}
+		outq_sent(q, n);
+	}
+	return 0;
+}
+
+/*
+ * Copies up to len bytes from the start of the queue to buf, for the caller to
+ * send, and returns how many. The updates copied are not replaced by newer
+ * ones until outq_sent says how much of them was sent.
+ */
+size_t
+outq_peek(struct outq *q, char *buf, size_t len)
+{
+	size_t n = 0;
+
+	for (struct item *it = q->head; it && n < len; it = it->next) {
+		size_t left = it->chunk->data->len - it->off;
+		if (left > len - n)
+			left = len - n;
+		memcpy(buf + n, it->chunk->data->data + it->off, left);
+		n += left;
+		it->copied = 1;
+	}
+	return n;
+}
+
+/*
+ * Removes n sent bytes from the start of the queue.
+ */
+void
+outq_sent(struct outq *q, size_t n)
+{
+	struct item *it;
+
+	account(q, -(ssize_t)n);
+	q->stats.sent += n;
+	/* bytes sent to spectators are not client output */
+	if (!q->spectator)
+		metrics_add(METRIC_CLIENT_WRITTEN, n);
+	while (n > 0) {
+		it = q->head;
+		size_t left = it->chunk->data->len - it->off;
+		if (n < left) {
+			it->off += n;
+			break;
+		}
+		n -= left;
+		q->head = it->next;
+		if (!q->head)
+			q->tail = NULL;
+		item_free(it);
+	}
+	/* the copied items are at the start */
+	for (it = q->head; it && it->copied; it = it->next)
+		it->copied = 0;
+}
+
+/*
+ * Sends len bytes at data to fd right away if nothing is queued before them,
+ * and queues the rest if it can't be sent without blocking. The spectators
+ * get all of them queued. Returns -1 on error, 0 otherwise.
+ */
+int
+outq_send(struct outq *q, int fd, const char *data, size_t len)
+{
+	struct chunk *c;
+	ssize_t n = 0;
+
+	if (!q->head) {
+		do
+			n = send(fd, data, len, MSG_DONTWAIT);
+		while (n == -1 && errno == EINTR);
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			warn("send");
+			return -1;
+		}
+		if (n == -1)
+			n = 0;
+		q->stats.sent += n;
+		metrics_add(METRIC_CLIENT_WRITTEN, n);
+	}
+	if (!q->next) {
+		outq_text(q, data + n, len - n);
+		return 0;
+	}
+	c = chunk_new(data, len, len);
+	if ((size_t)n < len)
+		item_append(q, 0, NULL, c, n);
+	for (q = q->next; q; q = q->next)
+		item_append(q, 0, NULL, c, 0);
+	return 0;
+}
+
+size_t
+outq_pending(const struct outq *q)
+{
+	return q->stats.bytes;
+}
+
+int
+outq_full(const struct outq *q)
+{
+	return q->stats.bytes >= q->max;
+}
+
+const struct outq_stats *
+outq_stats(const struct outq *q)
+{
+	return q ? &q->stats : NULL;
+}
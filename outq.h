@@ -0,0 +1,33 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+#include <stddef.h>
+#include "status.h"
+
+/* Default unsent bytes above which the proxy stops reading from the server */
+#define OUTQ_MAX	(1024*1024)
+
+struct outq_stats {
+	size_t		bytes;		/* unsent bytes */
+	size_t		highwater;	/* maximum of bytes */
+	size_t		sent;		/* bytes sent in all */
+	unsigned long	replaced;	/* status updates replaced in place */
+};
+
+struct outq;
+
+struct outq *	outq_new(size_t);
+void		outq_free(struct outq *);
+void		outq_attach(struct outq *, struct outq *);
+void		outq_detach(struct outq *, struct outq *);
+void		outq_text(struct outq *, const char *, size_t);
+void		outq_status(struct outq *, int, const char *, const char *,
+		    size_t);
+int		outq_flush(struct outq *, int);
+int		outq_send(struct outq *, int, const char *, size_t);
+size_t		outq_peek(struct outq *, char *, size_t);
+void		outq_sent(struct outq *, size_t);
+size_t		outq_pending(const struct outq *);
+int		outq_full(const struct outq *);
+const struct outq_stats *outq_stats(const struct outq *);
+
+#endif /* OUTQ_H */
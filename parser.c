@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <stdio.h>
@@ -9,6 +10,11 @@
 
 #define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
 
+#define ONES	0x0101010101010101ULL
+#define HIGHS	0x8080808080808080ULL
+/* Nonzero if any byte of the word x is zero */
+#define HAS_ZERO(x)	(((x) - ONES) & ~(x) & HIGHS)
+
 enum state {
 	s_text = 0,	/* Regular text, or text inside BC tags (including args
 			 * for opening tags) */
@@ -64,9 +70,22 @@ tag_push(struct bc_parser *parser, int code)
 		err(1, "parser: tag %d: malloc", code);
 	if (parser->on_open)
 		parser->on_open(parser);
+	/*
+	 * Tags nested this deep were most likely never closed, so start over
+	 * from the new one.
+	 */
+	if (parser->max_depth && parser->depth >= parser->max_depth) {
+		while (parser->tag) {
+			struct tag *prev = parser->tag->prev;
+			free(parser->tag);
+			parser->tag = prev;
+		}
+		parser->depth = 0;
+	}
 	new->prev = parser->tag;
 	new->code = code;
 	parser->tag = new;
+	parser->depth++;
 }
 
 static void
@@ -79,6 +98,7 @@ tag_pop(struct bc_parser *parser)
 	if (parser->on_close)
 		parser->on_close(parser);
 	parser->tag = tag->prev;
+	parser->depth--;
 	free(tag);
 }
 
@@ -233,3 +253,38 @@ reread:
 	if (text_start)
 		callback_data(parser, text_start, p - text_start);
 }
+
+/*
+ * Returns nonzero if parsing the len bytes at buf would only pass them on to
+ * on_text as they are: no tag is open, the parser is not inside an escape
+ * sequence or TELNET command, and there is no ESC, IAC or, unless high is
+ * nonzero, byte above 0x7e in them. The parser is then left as if it had
+ * parsed them. The bytes are checked a word at a time.
+ */
+int
+bc_plain(struct bc_parser *parser, const char *buf, size_t len, int high)
+{
+	const uint64_t esc = ONES * 0x1b, iac = ONES * 0xff;
+	uint64_t w;
+	size_t i;
+
+	if (parser->tag || !len ||
+	    (parser->state != s_text && parser->state != s_prompt_tag))
+		return 0;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, buf + i, 8);
+		if (HAS_ZERO(w ^ esc))
+			return 0;
+		/* w + ONES carries into the top bit of bytes from 0x7f up */
+		if (high ? HAS_ZERO(w ^ iac) : (w | (w + ONES)) & HIGHS)
+			return 0;
+	}
+	for (; i < len; i++) {
+		unsigned char c = buf[i];
+		if (c == 0x1b || c == 0xff || (!high && c > 0x7e))
+			return 0;
+	}
+	/* text after a tag 10 means it wasn't followed by a prompt */
+	parser->state = s_text;
+	return 1;
+}
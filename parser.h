@@ -36,11 +36,17 @@ struct bc_parser {
 	/* application data pointer; not used by parser */
 	void		*data;
 	struct		tag *tag;
+	/* Most tags open at once, or 0 for no limit. A tag opened beyond it
+	 * drops the ones still open, as if they had been closed without
+	 * on_close. */
+	int		max_depth;
 	/* Private */
+	int		depth;
 	int		partial_code;
 	int		state;
 };
 
 void	bc_parse(struct bc_parser *, const char *, size_t);
+int	bc_plain(struct bc_parser *, const char *, size_t, int);
 
 #endif /* PARSER_H */
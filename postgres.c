@@ -1,64 +1,366 @@
 #include <libpq-fe.h>
 #include <err.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "db.h"
 #include "postgres.h"
 
+/*
+ * Writes are sent as prepared statements and grouped into transactions, which
+ * are committed when the writer thread calls postgres_flush (see DB_BATCH_MAX).
+ * With libpq 14 or later, a batch is sent in pipeline mode, so it costs one
+ * round trip instead of one per statement; the connection leaves pipeline mode
+ * between batches. There, the batch is the implicit transaction that the sync
+ * ends, committed or, after an error, rolled back; an explicit BEGIN would
+ * leave the connection in an aborted transaction, as the COMMIT is skipped
+ * with the rest of the batch.
+ *
+ * An error aborts the whole batch, so the statements are written not to fail
+ * on data that is already there or on exits whose rooms were never written.
+ * Without pipelining, a failed statement rolls the batch back right away, and
+ * postgres_flush fails if the COMMIT turns out to be a rollback.
+ *
+ * Rooms, exits and descriptions are keyed by db_key (see initdb.sql), which
+ * is computed here rather than looked up, so writes need no round trips. A
+ * description whose key holds another text is stored under its db_key_alt
+ * instead, and rooms find theirs among the two by text.
+ * Writing a room that is already stored with a different hash updates it and
+ * copies the previous contents to room_version.
+ */
+
+#define KEY_LEN		24	/* "-9223372036854775808" */
+
+struct pg {
+	PGconn	*conn;
+	int	pending;	/* statements in the open transaction */
+};
+
+static const char add_desc_sql[] =
+    "INSERT INTO description(hash, text) "
+    "SELECT CASE WHEN EXISTS (SELECT 1 FROM description "
+    "WHERE hash=$1 AND text<>$3) THEN $2::bigint ELSE $1::bigint END, $3 "
+    "ON CONFLICT DO NOTHING";
+static const char add_room_sql[] =
+    "WITH old AS (INSERT INTO room_version"
+    "(key, hash, shortdesc, longdesc, area, indoors, exits) "
+    "SELECT key, hash, shortdesc, longdesc, area, indoors, exits FROM room "
+    "WHERE key=$1 AND hash IS DISTINCT FROM $8) "
+    "INSERT INTO room(key, id, shortdesc, longdesc, area, exits, indoors, "
+    "hash) VALUES ($1, $2, "
+    "(SELECT hash FROM description WHERE hash IN ($3, $9) AND text=$11), "
+    "(SELECT hash FROM description WHERE hash IN ($4, $10) AND text=$12), "
+    "$5, $6, $7, $8) "
+    "ON CONFLICT (key) DO UPDATE SET shortdesc=EXCLUDED.shortdesc, "
+    "longdesc=EXCLUDED.longdesc, area=EXCLUDED.area, exits=EXCLUDED.exits, "
+    "indoors=EXCLUDED.indoors, hash=EXCLUDED.hash "
+    "WHERE room.hash IS DISTINCT FROM EXCLUDED.hash";
+static const char add_exit_sql[] =
+    "INSERT INTO exit(source, destination, direction) "
+    "SELECT $1, $2, $3 WHERE EXISTS (SELECT 1 FROM room WHERE key=$1) "
+    "AND EXISTS (SELECT 1 FROM room WHERE key=$2) "
+    "ON CONFLICT DO NOTHING";
+
+static void
+prepare(PGconn *conn, const char *name, const char *sql, int nparams)
+{
+	PGresult *res = PQprepare(conn, name, sql, nparams, NULL);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		errx(1, "postgres_init: prepare %s: %s", name,
+		    PQerrorMessage(conn));
+	PQclear(res);
+}
+
+/*
+ * Connects using the given connection string, by default "dbname=batmud".
+ */
 void *
-postgres_init(void)
+postgres_init(const char *conninfo)
 {
-	PGconn *db = NULL;
+	struct pg *pg;
 
-	db = PQconnectdb("dbname=batmud");
-	if (PQstatus(db) != CONNECTION_OK)
-		errx(1, "postgres_init: %s", PQerrorMessage(db));
-	return (void *)db;
+	if (!(pg = calloc(1, sizeof(struct pg))))
+		err(1, "postgres_init: malloc");
+	if (!conninfo || !*conninfo)
+		conninfo = "dbname=batmud";
+	pg->conn = PQconnectdb(conninfo);
+	if (PQstatus(pg->conn) != CONNECTION_OK)
+		errx(1, "postgres_init: %s", PQerrorMessage(pg->conn));
+	prepare(pg->conn, "add_desc", add_desc_sql, 3);
+	prepare(pg->conn, "add_room", add_room_sql, 12);
+	prepare(pg->conn, "add_exit", add_exit_sql, 3);
+	return pg;
 }
 
 void
 postgres_free(void *dbp)
 {
-	PGconn *db = dbp;
-	PQfinish(db);
+	struct pg *pg = dbp;
+	postgres_flush(pg);
+	PQfinish(pg->conn);
+	free(pg);
 }
 
+#ifdef LIBPQ_HAS_PIPELINING
+/*
+ * Sends a sync, which ends the batch's implicit transaction, and reads the
+ * results of the whole batch.
+ */
 int
-postgres_add_room(void *dbp, struct room *room)
+postgres_flush(void *dbp)
 {
-	PGconn *db = dbp;
+	struct pg *pg = dbp;
+	PGresult *res;
 	int status = 0;
-	const char *paramValues[] = {
-		room->id, room->shortdesc, room->longdesc, room->area,
-		room->exits,
-		room->indoors ? "1" : "0",
-	};
-	PGresult *res = PQexecParams(db, "INSERT INTO room(id, shortdesc, "
-	    "longdesc, area, exits, indoors) SELECT $1, $2, $3, $4, $5, $6"
-	    "WHERE NOT EXISTS (SELECT 1 FROM room WHERE id=$1)",
-	    6, NULL, paramValues, NULL, NULL, 0);
+
+	if (!pg->pending)
+		return 0;
+	pg->pending = 0;
+	if (!PQpipelineSync(pg->conn)) {
+		warnx("postgres_flush: %s", PQerrorMessage(pg->conn));
+		return -1;
+	}
+	for (;;) {
+		if (!(res = PQgetResult(pg->conn))) {
+			/* end of results for one statement */
+			if (PQstatus(pg->conn) != CONNECTION_OK)
+				return -1;
+			continue;
+		}
+		switch (PQresultStatus(res)) {
+		case PGRES_PIPELINE_SYNC:
+			PQclear(res);
+			if (!PQexitPipelineMode(pg->conn)) {
+				warnx("postgres_flush: %s",
+				    PQerrorMessage(pg->conn));
+				return -1;
+			}
+			return status;
+		case PGRES_FATAL_ERROR:
+			warnx("postgres_flush: %s", PQresultErrorMessage(res));
+			status = -1;
+			break;
+		case PGRES_PIPELINE_ABORTED:
+			status = -1;
+			break;
+		default:
+			break;
+		}
+		PQclear(res);
+	}
+}
+
+/*
+ * Queues a statement in the batch. If that fails, the batch is ended.
+ */
+static int
+send_prepared(struct pg *pg, const char *name, int nparams,
+    const char *const *params)
+{
+	if (!pg->pending++ && !PQenterPipelineMode(pg->conn))
+		goto err;
+	if (!PQsendQueryPrepared(pg->conn, name, nparams, params, NULL, NULL,
+	    0))
+		goto err;
+	return 0;
+err:
+	warnx("postgres: %s: %s", name, PQerrorMessage(pg->conn));
+	postgres_flush(pg);
+	return -1;
+}
+#else /* !LIBPQ_HAS_PIPELINING */
+static int
+exec(PGconn *conn, const char *sql)
+{
+	int status = 0;
+	PGresult *res = PQexec(conn, sql);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-		warnx("postgres_add_room: %s", PQerrorMessage(db));
+		warnx("postgres: %s: %s", sql, PQerrorMessage(conn));
 		status = -1;
 	}
 	PQclear(res);
 	return status;
 }
 
+/*
+ * Commits the open transaction. A transaction that has failed is rolled back
+ * instead, by a COMMIT that still succeeds, so its status is checked too.
+ */
 int
-postgres_add_exit(void *dbp, struct room *src, struct room *dest)
+postgres_flush(void *dbp)
 {
-	PGconn *db = dbp;
+	struct pg *pg = dbp;
+	PGresult *res;
 	int status = 0;
-	const char *paramValues[] = {
-		dest->direction, src->id, dest->id
-	};
-	PGresult *res = PQexecParams(db, "INSERT INTO exit(direction, source,"
-	    "destination) SELECT $1, $2, $3 WHERE NOT EXISTS (SELECT 1 FROM "
-	    "exit WHERE source=$2 AND destination=$3)", 3, NULL, paramValues,
-	    NULL, NULL, 0);
+
+	if (!pg->pending)
+		return 0;
+	pg->pending = 0;
+	res = PQexec(pg->conn, "COMMIT");
+	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+		warnx("postgres: COMMIT: %s", PQerrorMessage(pg->conn));
+		status = -1;
+	} else if (strcmp(PQcmdStatus(res), "COMMIT") != 0) {
+		warnx("postgres: transaction rolled back");
+		status = -1;
+	}
+	PQclear(res);
+	return status;
+}
+
+/*
+ * Runs a statement in the open transaction. If it fails, the transaction is
+ * rolled back.
+ */
+static int
+send_prepared(struct pg *pg, const char *name, int nparams,
+    const char *const *params)
+{
+	PGresult *res;
+	int status = 0;
+
+	if (!pg->pending && exec(pg->conn, "BEGIN") == -1)
+		return -1;
+	pg->pending++;
+	res = PQexecPrepared(pg->conn, name, nparams, params, NULL, NULL, 0);
 	if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-		warnx("postgres_add_exit: %s", PQerrorMessage(db));
+		warnx("postgres: %s: %s", name, PQerrorMessage(pg->conn));
 		status = -1;
 	}
 	PQclear(res);
+	if (status == -1) {
+		pg->pending = 0;
+		exec(pg->conn, "ROLLBACK");
+	}
 	return status;
 }
+#endif /* LIBPQ_HAS_PIPELINING */
+
+/*
+ * Runs sql, which selects either room id, area and hash or exit source,
+ * destination and direction, and passes the rows to cb.
+ */
+static int
+load(PGconn *conn, const char *sql, int exits, db_load_cb cb, void *arg)
+{
+	int status = 0;
+	PGresult *res = PQexec(conn, sql);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		warnx("postgres_load: %s", PQerrorMessage(conn));
+		status = -1;
+	} else if (!exits)
+		for (int i = 0; i < PQntuples(res); i++)
+			cb(arg, PQgetvalue(res, i, 0), PQgetvalue(res, i, 1),
+			    NULL, NULL,
+			    (uint64_t)strtoll(PQgetvalue(res, i, 2), NULL, 10));
+	else
+		for (int i = 0; i < PQntuples(res); i++)
+			cb(arg, PQgetvalue(res, i, 0), NULL,
+			    PQgetvalue(res, i, 1), PQgetvalue(res, i, 2), 0);
+	PQclear(res);
+	return status;
+}
+
+static const char rooms_sql[] = "SELECT id, area, hash FROM room";
+static const char exits_sql[] =
+    "SELECT s.id, d.id, direction FROM exit "
+    "JOIN room s ON s.key=source JOIN room d ON d.key=destination";
+
+/*
+ * Lists the stored rooms and exits.
+ */
+int
+postgres_load(void *dbp, db_load_cb cb, void *arg)
+{
+	struct pg *pg = dbp;
+
+	if (load(pg->conn, rooms_sql, 0, cb, arg) == -1 ||
+	    load(pg->conn, exits_sql, 1, cb, arg) == -1)
+		return -1;
+	return 0;
+}
+
+static const char rooms_full_sql[] =
+    "SELECT r.id, r.area, r.indoors, r.exits, s.text, l.text FROM room r "
+    "JOIN description s ON s.hash=r.shortdesc "
+    "JOIN description l ON l.hash=r.longdesc";
+
+/*
+ * Lists the stored rooms with their descriptions.
+ */
+int
+postgres_rooms(void *dbp, db_room_cb cb, void *arg)
+{
+	struct pg *pg = dbp;
+	int status = 0;
+	PGresult *res = PQexec(pg->conn, rooms_full_sql);
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+		warnx("postgres_rooms: %s", PQerrorMessage(pg->conn));
+		status = -1;
+	} else
+		for (int i = 0; i < PQntuples(res); i++) {
+			struct room room = {
+				.id = PQgetvalue(res, i, 0),
+				.area = PQgetvalue(res, i, 1),
+				.indoors = *PQgetvalue(res, i, 2) == 't',
+				.exits = PQgetvalue(res, i, 3),
+				.shortdesc = PQgetvalue(res, i, 4),
+				.longdesc = PQgetvalue(res, i, 5),
+			};
+			cb(arg, &room);
+		}
+	PQclear(res);
+	return status;
+}
+
+/*
+ * Formats key k into buf, which must have room for KEY_LEN bytes.
+ */
+static char *
+key(char *buf, int64_t k)
+{
+	snprintf(buf, KEY_LEN, "%" PRId64, k);
+	return buf;
+}
+
+static int
+add_desc(struct pg *pg, const char *hash, const char *alt, const char *text)
+{
+	const char *paramValues[] = { hash, alt, text };
+	return send_prepared(pg, "add_desc", 3, paramValues);
+}
+
+int
+postgres_add_room(void *dbp, struct room *room)
+{
+	char roomkey[KEY_LEN], shortkey[KEY_LEN], longkey[KEY_LEN];
+	char shortalt[KEY_LEN], longalt[KEY_LEN], hash[KEY_LEN];
+	const char *paramValues[] = {
+		key(roomkey, db_key(room->id)), room->id,
+		key(shortkey, db_key(room->shortdesc)),
+		key(longkey, db_key(room->longdesc)),
+		room->area, room->exits,
+		room->indoors ? "1" : "0",
+		key(hash, (int64_t)room->hash),
+		key(shortalt, db_key_alt(room->shortdesc)),
+		key(longalt, db_key_alt(room->longdesc)),
+		room->shortdesc, room->longdesc,
+	};
+	if (add_desc(dbp, shortkey, shortalt, room->shortdesc) == -1 ||
+	    add_desc(dbp, longkey, longalt, room->longdesc) == -1)
+		return -1;
+	return send_prepared(dbp, "add_room", 12, paramValues);
+}
+
+int
+postgres_add_exit(void *dbp, struct room *src, struct room *dest)
+{
+	char srckey[KEY_LEN], destkey[KEY_LEN];
+	const char *paramValues[] = {
+		key(srckey, db_key(src->id)), key(destkey, db_key(dest->id)),
+		dest->direction
+	};
+	return send_prepared(dbp, "add_exit", 3, paramValues);
+}
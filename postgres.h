@@ -1,11 +1,15 @@
 #ifndef POSTGRES_H
 #define POSTGRES_H
 #include <libpq-fe.h>
+#include "db.h"
 #include "room.h"
 
-void *postgres_init(void);
+void *postgres_init(const char *);
 void postgres_free(void *);
 int postgres_add_room(void *, struct room *);
 int postgres_add_exit(void *, struct room *, struct room *);
+int postgres_flush(void *);
+int postgres_load(void *, db_load_cb, void *);
+int postgres_rooms(void *, db_room_cb, void *);
 
 #endif /* POSTGRES_H */
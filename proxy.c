@@ -1,15 +1,33 @@
 #include <assert.h>
 #include <err.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "buffer.h"
+#include "charset.h"
+#include "client_parser.h"
+#include "coalesce.h"
 #include "color.h"
+#include "config.h"
 #include "db.h"
+#include "events.h"
+#include "gamestate.h"
+#include "gmcp.h"
+#include "graph.h"
+#include "json.h"
+#include "latency.h"
+#include "livemap.h"
+#include "logstore.h"
+#include "metrics.h"
+#include "outq.h"
 #include "parser.h"
 #include "proxy.h"
 #include "room.h"
+#include "status.h"
+#include "trigger.h"
 
 /* U+2234 THEREFORE */
 #define MARKER "\xe2\x88\xb4"
@@ -22,9 +40,28 @@ proxy_state *proxy_state_new(size_t bufsize, struct db *db)
 		err(1, "proxy_state_new: malloc");
 	st->obuf = buffer_new(bufsize);
 	st->tmpbuf = buffer_new(bufsize);
-	if (!st->obuf || !st->tmpbuf)
+	st->linebuf = buffer_new(256);
+	st->sbuf = buffer_new(bufsize);
+	st->cmdbuf = buffer_new(256);
+	st->cmdin = buffer_new(256);
+	st->cmdtelnet = buffer_new(256);
+	st->trigout = buffer_new(bufsize);
+	st->trigline = buffer_new(256);
+	st->trigcmds = buffer_new(256);
+	st->trigsubst = buffer_new(256);
+	st->trigtmp = buffer_new(256);
+	st->trigemit = buffer_new(256);
+	st->logline = buffer_new(256);
+	st->logtext = buffer_new(256);
+	if (!st->obuf || !st->tmpbuf || !st->linebuf || !st->sbuf ||
+	    !st->cmdbuf || !st->cmdin || !st->cmdtelnet || !st->trigout ||
+	    !st->trigline || !st->trigcmds || !st->trigsubst || !st->trigtmp ||
+	    !st->trigemit || !st->logline || !st->logtext)
 		goto err;
 	st->db = db;
+	st->tag_max = PROXY_TAG_MAX;
+	st->arg_max = PROXY_ARG_MAX;
+	st->charset = charset_find("UTF-8", strlen("UTF-8"));
 	return st;
 err:
 	proxy_state_free(st);
@@ -37,12 +74,413 @@ proxy_state_free(struct proxy_state *state)
 	if (state) {
 		buffer_free(state->obuf);
 		buffer_free(state->tmpbuf);
+		buffer_free(state->linebuf);
+		buffer_free(state->sbuf);
+		buffer_free(state->cmdbuf);
+		buffer_free(state->cmdin);
+		buffer_free(state->cmdtelnet);
+		buffer_free(state->trigout);
+		buffer_free(state->trigline);
+		buffer_free(state->trigcmds);
+		buffer_free(state->trigsubst);
+		buffer_free(state->trigtmp);
+		buffer_free(state->trigemit);
+		buffer_free(state->logline);
+		buffer_free(state->logtext);
 		free(state->argstr);
 		room_free(state->room);
 		free(state);
 	}
 }
 
+/*
+ * Status tags that are sent often and only matter for their latest value can
+ * be coalesced or replaced in the output queue by newer updates. Writes the
+ * key identifying what the update is about (eg. the prot name) to key and
+ * returns 1 if the tag is such a status.
+ */
+static int
+status_key(int code, const char *data, char *key)
+{
+	switch (code) {
+	case 50: /* full hp/sp/ep status */
+	case 51: /* partial hp/sp/ep status */
+	case 56: /* minion hp status */
+	case 70: /* target health */
+		key[0] = '\0';
+		return 1;
+	case 61: /* party place; keyed by player */
+	case 62: /* party status; keyed by player */
+	case 64: /* prot status; keyed by effect */
+		if (!data || sscanf(data, "%31s", key) != 1)
+			return 0;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Returns the length of the ANSI escape sequence or TELNET command at p, of
+ * at most n bytes, or 1 if there is neither.
+ */
+static size_t
+escape_len(const unsigned char *p, size_t n)
+{
+	size_t i = 2;
+
+	if (p[0] == 0x1b && n > 1 && p[1] == '[') {
+		while (i < n && (p[i] < 0x40 || p[i] > 0x7e))
+			i++;
+		i++;
+	} else if (p[0] == 0xff && n > 1 && p[1] == 0xfa) {
+		/* subnegotiation, up to IAC SE */
+		while (i + 1 < n && !(p[i] == 0xff && p[i + 1] == 0xf0))
+			i++;
+		i += 2;
+	} else if (p[0] == 0xff && n > 1 && p[1] >= 0xfb && p[1] <= 0xfe)
+		i = 3;
+	else if (p[0] != 0x1b && p[0] != 0xff)
+		i = 1;
+	return i < n ? i : n;
+}
+
+/*
+ * Appends the line at raw to text without colors and TELNET commands, and the
+ * TELNET commands to cmds unless it is NULL. The text is converted from the
+ * charset cs to UTF-8 unless cs is NULL.
+ */
+static void
+split_line(const char *raw, size_t len, buffer *text, buffer *cmds,
+    const struct charset *cs)
+{
+	const unsigned char *p = (const unsigned char *)raw, *end = p + len;
+
+	while (p < end) {
+		const unsigned char *q = p;
+		size_t n;
+		while (q < end && *q != 0x1b && *q != 0xff && *q != '\r')
+			q++;
+		if (cs)
+			charset_to_utf8(cs, text, (const char *)p, q - p);
+		else
+			buffer_append(text, (const char *)p, q - p);
+		if (q == end)
+			break;
+		n = escape_len(q, end - q);
+		if (*q == 0xff && cmds)
+			buffer_append(cmds, (const char *)q, n);
+		p = q + n;
+	}
+}
+
+/*
+ * Adds the lines of output since the last call to the session log, in UTF-8.
+ * Lines that start in this output get type as their message type, or none if
+ * it is NULL. Marker lines are left out.
+ */
+static void
+log_output(struct proxy_state *st, const char *type)
+{
+	const char *p = st->obuf->data + st->logoff;
+	const char *end = st->obuf->data + st->obuf->len, *nl;
+	buffer *text;
+	time_t now;
+
+	if (!st->log)
+		return;
+	now = time(NULL);
+	while (p < end) {
+		if (!st->logline->len)
+			strlcpy(st->logtype, type ? type : "",
+			    sizeof(st->logtype));
+		if (!(nl = memchr(p, '\n', end - p))) {
+			buffer_append(st->logline, p, end - p);
+			break;
+		}
+		buffer_append(st->logline, p, nl - p);
+		p = nl + 1;
+		buffer_clear(st->logtext);
+		split_line(st->logline->data, st->logline->len, st->logtext,
+		    NULL, NULL);
+		buffer_clear(st->logline);
+		/* marker lines start with the UTF-8 marker in every charset */
+		if (!st->logtext->len || (st->logtext->len >= strlen(MARKER) &&
+		    memcmp(st->logtext->data, MARKER, strlen(MARKER)) == 0))
+			continue;
+		text = st->logtext;
+		if (st->charset->kind != CHARSET_UTF8) {
+			charset_to_utf8(st->charset, st->logline, text->data,
+			    text->len);
+			text = st->logline;
+		}
+		logstore_line(st->log, now, st->logtype, text->data,
+		    text->len);
+		buffer_clear(st->logline);
+	}
+	st->logoff = st->obuf->len;
+}
+
+struct line_match {
+	struct proxy_state *st;
+	int		gag;
+	int		highlight;
+	uint32_t	rgb;
+	int		subst;		/* st->trigsubst holds the new text */
+};
+
+/*
+ * trigger_cb: applies a matching trigger to the line being matched. Only the
+ * first matching highlight and subst triggers change the line.
+ */
+static void
+apply_trigger(void *arg, const struct trigger *tr, const regmatch_t *m)
+{
+	struct line_match *lm = arg;
+	struct proxy_state *st = lm->st;
+
+	switch (tr->action) {
+	case TRIGGER_GAG:
+		lm->gag = 1;
+		break;
+	case TRIGGER_HIGHLIGHT:
+		if (!lm->highlight) {
+			lm->highlight = 1;
+			lm->rgb = tr->rgb;
+		}
+		break;
+	case TRIGGER_SUBST:
+		if (lm->subst)
+			break;
+		buffer_clear(st->trigsubst);
+		trigger_subst(tr, st->trigline->data, m, st->trigsubst);
+		lm->subst = 1;
+		break;
+	case TRIGGER_EMIT:
+		buffer_append_str(st->trigemit, MARKER "trigger ");
+		buffer_append_str(st->trigemit, tr->name);
+		buffer_append_str(st->trigemit, " ");
+		charset_append_utf8(st->charset, st->trigemit,
+		    st->trigline->data, st->trigline->len);
+		buffer_append_str(st->trigemit, "\n");
+		break;
+	case TRIGGER_EVENT:
+		buffer_clear(st->trigtmp);
+		buffer_append_str(st->trigtmp, tr->name);
+		buffer_append_str(st->trigtmp, " ");
+		buffer_append_buf(st->trigtmp, st->trigline);
+		events_publish(st->events, 0, "trigger", st->trigtmp->data,
+		    st->trigtmp->len);
+		break;
+	}
+}
+
+/*
+ * Matches the triggers against a complete line of output, including its line
+ * end, and appends the result to st->trigout.
+ */
+static void
+trigger_line(struct proxy_state *st, const char *raw, size_t len)
+{
+	struct line_match lm = { .st = st };
+	buffer *out = st->trigout, *text;
+	size_t body = len;
+
+	if (body && raw[body - 1] == '\n') {
+		if (--body && raw[body - 1] == '\r')
+			body--;
+	} else if (body >= 2 && (uint8_t)raw[body - 2] == 0xff)
+		body -= 2;	/* GOAHEAD */
+	buffer_clear(st->trigcmds);
+	buffer_clear(st->trigemit);
+	split_line(raw, body, st->trigline, st->trigcmds, st->charset);
+	buffer_append(st->trigline, "", 1);
+	st->trigline->len--;
+	triggers_match(st->triggers, st->trigline->data, st->trigline->len,
+	    apply_trigger, &lm);
+
+	if (st->trigsent || !(lm.gag || lm.highlight || lm.subst))
+		buffer_append(out, raw, len);
+	else if (lm.gag)
+		buffer_append_buf(out, st->trigcmds);
+	else {
+		text = lm.subst ? st->trigsubst : st->trigline;
+		buffer_append_buf(out, st->trigcmds);
+		if (lm.highlight)
+			buffer_append_str(out, colorstr(true,
+			    (lm.rgb >> 16) & 0xff, (lm.rgb >> 8) & 0xff,
+			    lm.rgb & 0xff));
+		charset_append_utf8(st->charset, out, text->data, text->len);
+		if (lm.highlight)
+			buffer_append_str(out, "\x1b[0m");
+		buffer_append(out, raw + body, len - body);
+	}
+	buffer_append_buf(out, st->trigemit);
+	buffer_clear(st->trigline);
+	st->trigsent = 0;
+}
+
+/*
+ * Runs the triggers on the lines in st->obuf, which end in a newline or a
+ * TELNET GOAHEAD. A line that isn't complete yet is output as is, but its
+ * text is kept so that triggers match the whole line once the rest arrives;
+ * gag, highlight and subst then don't apply to it.
+ */
+static void
+run_triggers(struct proxy_state *st)
+{
+	const unsigned char *p = (const unsigned char *)st->obuf->data;
+	size_t len = st->obuf->len, start = 0, i = 0;
+	buffer *tmp;
+
+	if (!st->triggers || !len)
+		return;
+	buffer_clear(st->trigout);
+	while (i < len) {
+		if (p[i] == 0xff) {
+			int ga = i + 1 < len && p[i + 1] == 0xf9;
+			i += escape_len(p + i, len - i);
+			if (!ga)
+				continue;
+		} else if (p[i++] != '\n')
+			continue;
+		trigger_line(st, st->obuf->data + start, i - start);
+		start = i;
+	}
+	if (start < len) {
+		split_line(st->obuf->data + start, len - start, st->trigline,
+		    st->trigcmds, st->charset);
+		buffer_append(st->trigout, st->obuf->data + start,
+		    len - start);
+		st->trigsent = 1;
+	}
+	tmp = st->obuf;
+	st->obuf = st->trigout;
+	st->trigout = tmp;
+}
+
+/*
+ * Outputs a status update that may be superseded by a newer one with the same
+ * code and key. Output so far is queued first to keep the order.
+ * Also used as a coalesce_emit_cb.
+ */
+static void
+output_status(void *arg, int code, const char *key, const char *data,
+    size_t len)
+{
+	struct proxy_state *st = arg;
+
+	if (!st->outq) {
+		buffer_append(st->obuf, data, len);
+		return;
+	}
+	log_output(st, NULL);
+	run_triggers(st);
+	metrics_max(METRIC_OBUF_HIGHWATER, st->obuf->len);
+	outq_text(st->outq, st->obuf->data, st->obuf->len);
+	buffer_clear(st->obuf);
+	st->logoff = 0;
+	outq_status(st->outq, code, key, data, len);
+}
+
+/*
+ * Outputs a status tag to the client, as GMCP if the client agreed to it and
+ * there is a GMCP message for the tag, or as a marker line otherwise. The same
+ * information is published on the event feed and recorded in st->game. data
+ * may be NULL for statuses that carry none.
+ *
+ * If coalescing is enabled, frequent updates are passed to the coalescer
+ * instead of being output right away.
+ */
+static void
+status_line(struct proxy_state *st, int code, const char *type,
+    const char *data, size_t len)
+{
+	char key[STATUS_NAME_MAX];
+	buffer *out = st->linebuf;
+	int keyed = status_key(code, data, key);
+
+	gamestate_update(&st->game, code, type, data);
+	events_publish(st->events, code, type, data, len);
+	if (code == 63 && data && sscanf(data, "%31s", key) == 1) {
+		/* held updates for a member who left would add them back */
+		coalesce_forget(st->coalesce, 61, key);
+		coalesce_forget(st->coalesce, 62, key);
+	}
+	if (!keyed)
+		out = st->obuf;
+	else
+		buffer_clear(out);
+	if (!st->gmcp || !gmcp_status(out, code, data, len)) {
+		buffer_append_str(out, MARKER);
+		buffer_append_str(out, type);
+		if (data) {
+			buffer_append_str(out, " ");
+			charset_append_utf8(st->charset, out, data, len);
+		}
+		buffer_append_str(out, "\n");
+	}
+	if (keyed &&
+	    !coalesce_put(st->coalesce, code, key, out->data, out->len))
+		output_status(st, code, key, out->data, out->len);
+}
+
+/*
+ * Runs the triggers on pending output and moves it to the output queue, if
+ * there is one.
+ */
+void
+proxy_flush(struct proxy_state *st)
+{
+	log_output(st, NULL);
+	logstore_flush(st->log);
+	run_triggers(st);
+	metrics_max(METRIC_OBUF_HIGHWATER, st->obuf->len);
+	if (!st->outq)
+		return;
+	outq_text(st->outq, st->obuf->data, st->obuf->len);
+	buffer_clear(st->obuf);
+	st->logoff = 0;
+}
+
+/*
+ * Returns nonzero if len bytes from the server at buf can be sent to the
+ * client as they are: nothing is waiting in st->obuf, the bytes are plain
+ * text that neither the parser nor the charset would change, and there are
+ * no triggers or session log that need to see the lines.
+ */
+int
+proxy_passthrough(struct proxy_state *st, struct bc_parser *parser,
+    const char *buf, size_t len)
+{
+	if (!st->outq || st->triggers || st->log || st->obuf->len)
+		return 0;
+	return bc_plain(parser, buf, len, st->charset->kind == CHARSET_LATIN1);
+}
+
+/*
+ * Outputs the coalesced status updates still waiting, for a connection that
+ * is ending.
+ */
+void
+proxy_finish(struct proxy_state *st)
+{
+	coalesce_flush(st->coalesce, output_status, st);
+	proxy_flush(st);
+}
+
+/*
+ * Outputs coalesced status updates whose deadline has passed.
+ */
+void
+proxy_expire(struct proxy_state *st)
+{
+	if (coalesce_timeout(st->coalesce) != 0)
+		return;
+	coalesce_flush(st->coalesce, output_status, st);
+	proxy_flush(st);
+}
+
 void
 on_open(struct bc_parser *parser)
 {
@@ -56,21 +494,31 @@ on_open(struct bc_parser *parser)
 	 */
 	if (parser->tag && (st->tmpbuf->len || st->argstr))
 		on_close(parser);
+	if (parser->max_depth && parser->depth >= parser->max_depth) {
+		metrics_add(METRIC_TAG_OVERFLOWS, 1);
+		st->overflow = 0;
+	}
 }
 
 void
 on_prompt(struct bc_parser *parser)
 {
 	struct proxy_state *st = parser->data;
+	coalesce_flush(st->coalesce, output_status, st);
 	/*
-	 * If tmpbuf is non-empty, output the deferred prompt.
+	 * If tmpbuf is non-empty, output the deferred prompt. A newer prompt
+	 * supersedes it if it hasn't been sent yet.
 	 */
 	if (st->tmpbuf->len) {
-		buffer_append_iso8859_1(st->obuf, st->tmpbuf->data,
-		    st->tmpbuf->len);
+		buffer_clear(st->linebuf);
+		charset_append_utf8(st->charset, st->linebuf,
+		    st->tmpbuf->data, st->tmpbuf->len);
+		buffer_append(st->linebuf, "\xff\xf9", 2);
+		output_status(st, 10, "spec_prompt", st->linebuf->data,
+		    st->linebuf->len);
 		buffer_clear(st->tmpbuf);
-	}
-	parser->on_telnet_command(parser, "\xff\xf9", 2);
+	} else
+		parser->on_telnet_command(parser, "\xff\xf9", 2);
 }
 
 void
@@ -78,6 +526,11 @@ on_close(struct bc_parser *parser)
 {
 	assert(parser->tag);
 	struct proxy_state *st = parser->data;
+	if (st->overflow == parser->depth) {
+		/* its text has been output already */
+		st->overflow = 0;
+		return;
+	}
 	/* Make sure tmpbuf is null terminated. It might have other nulls
 	 * besides, but that's ok. */
 	buffer_append(st->tmpbuf, "", 1);
@@ -86,12 +539,15 @@ on_close(struct bc_parser *parser)
 	st->tmpbuf->len -= 1;
 	char *tmpstr = st->tmpbuf->data;
 	int defer = 0;
+	uint64_t start;
 
+	metrics_tag(parser->tag->code);
 	switch (parser->tag->code) {
 	case 5: /* connection success */
 	case 6: /* connection failure */
 		break;
 	case 10: /* Message with type */
+		log_output(st, NULL);
 		if (st->argstr) {
 			if (strcmp(st->argstr, "spec_prompt") == 0) {
 				/*
@@ -104,16 +560,20 @@ on_close(struct bc_parser *parser)
 				 * on_prompt (ie. avoid clearing tmpbuf).
 				 */
 				defer = 1;
+				metrics_add(METRIC_PROMPTS_DEFERRED, 1);
 				break;
 			} else if (strcmp(st->argstr, "spec_map") == 0) {
 				if (strcmp(tmpstr, "NoMapSupport") == 0)
 					break;
 			} else if (strcmp(st->argstr, "spec_news") != 0) {
-				buffer_append_str(st->obuf, st->argstr);
+				charset_append_utf8(st->charset, st->obuf,
+				    st->argstr, strlen(st->argstr));
 				buffer_append_str(st->obuf, ": ");
 			}
 		}
-		buffer_append_buf(st->obuf, st->tmpbuf);
+		charset_append_utf8(st->charset, st->obuf, tmpstr,
+		    st->tmpbuf->len);
+		log_output(st, st->argstr);
 		break;
 	case 11: /* Clear screen */
 		break;
@@ -131,7 +591,8 @@ on_close(struct bc_parser *parser)
 			    (rgb >> 8) & 0xff,
 			    rgb & 0xff);
 			buffer_append_str(st->obuf, color);
-			buffer_append_str(st->obuf, tmpstr);
+			charset_append_utf8(st->charset, st->obuf, tmpstr,
+			    st->tmpbuf->len);
 			buffer_append_str(st->obuf, "\x1b[0m");
 		}
 		break;
@@ -140,67 +601,48 @@ on_close(struct bc_parser *parser)
 	case 24: /* Underlined */
 	case 25: /* Blink */
 	case 31: /* "in-game link" */
-		buffer_append_buf(st->obuf, st->tmpbuf);
+		charset_append_utf8(st->charset, st->obuf, tmpstr,
+		    st->tmpbuf->len);
 		break;
 	case 40: /* clear skill/spell status */
-		buffer_append_str(st->obuf, MARKER "cast_cancelled\n");
+		status_line(st, 40, "cast_cancelled", NULL, 0);
 		break;
 	case 41: /* spell rounds left */
-		buffer_append_str(st->obuf, MARKER "cast ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 41, "cast", tmpstr, st->tmpbuf->len);
 		break;
 	case 42: /* skill rounds left */
-		buffer_append_str(st->obuf, MARKER "use ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 42, "use", tmpstr, st->tmpbuf->len);
 		break;
 	case 50: /* full hp/sp/ep status */
-		buffer_append_str(st->obuf, MARKER "hpstatus ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 50, "hpstatus", tmpstr, st->tmpbuf->len);
 		break;
 	case 51: /* partial hp/sp/ep status */
 		/* XXX I've never seen bat actually send this */
-		buffer_append_str(st->obuf, MARKER "partialhpstatus ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 51, "partialhpstatus", tmpstr, st->tmpbuf->len);
 		break;
 	case 52: /* player name, race, level etc. and exp */
 	case 53: /* exp */
 	case 54: /* player status */
 		break;
 	case 56: /* minion hp status */
-		buffer_append_str(st->obuf, MARKER "minionhpstatus ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 56, "minionhpstatus", tmpstr, st->tmpbuf->len);
 		break;
 	case 60: /* player location */
 		break;
 	case 61: /* party place */
-		buffer_append_str(st->obuf, MARKER "partyplace ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 61, "partyplace", tmpstr, st->tmpbuf->len);
 		break;
 	case 62: /* party status */
-		buffer_append_str(st->obuf, MARKER "party ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 62, "party", tmpstr, st->tmpbuf->len);
 		break;
 	case 63: /* player left party */
-		buffer_append_str(st->obuf, MARKER "partyleave ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 63, "partyleave", tmpstr, st->tmpbuf->len);
 		break;
 	case 64: /* prot status */
-		buffer_append_str(st->obuf, MARKER "prot ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 64, "prot", tmpstr, st->tmpbuf->len);
 		break;
 	case 70: /* target health */
-		buffer_append_str(st->obuf, MARKER "target ");
-		buffer_append_buf(st->obuf, st->tmpbuf);
-		buffer_append_str(st->obuf, "\n");
+		status_line(st, 70, "target", tmpstr, st->tmpbuf->len);
 		break;
 	case 99: /* mapper; requires 'set client_mapper_toggle on' ingame */
 		if (strncmp(tmpstr, "BAT_MAPPER;;", strlen("BAT_MAPPER;;")) == 0) {
@@ -210,6 +652,8 @@ on_close(struct bc_parser *parser)
 			if (strcmp(mappermsg, "REALM_MAP") == 0) {
 				asprintf(&msg, "Exited to map from %s.\n",
 				    st->room ? st->room->area : "(unknown)");
+				gamestate_update(&st->game, 99, "realm_map",
+				    NULL);
 			} else if (strncmp(mappermsg, "ROOM_UNKNOWN;;",
 			    strlen("ROOM_UNKNOWN;;")) == 0) {
 				char *cause = mappermsg + strlen("ROOM_UNKNOWN;;");
@@ -218,9 +662,8 @@ on_close(struct bc_parser *parser)
 					room_free(st->room);
 					st->room = NULL;
 				}
-				buffer_append_str(st->obuf, MARKER "room_unknown ");
-				buffer_append_str(st->obuf, cause);
-				buffer_append_str(st->obuf, "\n");
+				status_line(st, 99, "room_unknown", cause,
+				    strlen(cause));
 			} else {
 				new = room_new(mappermsg);
 				if (!new) {
@@ -228,35 +671,56 @@ on_close(struct bc_parser *parser)
 					   "%s", mappermsg);
 					break;
 				}
+				start = latency_now();
 				db_add_room(st->db, new);
-				if (!st->room || strcmp(st->room->area, new->area) != 0)
+				latency_add(st->latency, LATENCY_DB,
+				    latency_now() - start);
+				if (st->graph)
+					graph_add_room(st->graph, new->id,
+					    new->area);
+				if (!st->room || strcmp(st->room->area, new->area) != 0) {
 					asprintf(&msg, "Entered area %s with "
 					    "direction %s\n",
 					    new->area, new->direction);
-				else
+					livemap_visit(st->livemap, NULL, new);
+				} else {
+					start = latency_now();
 					db_add_exit(st->db, st->room, new);
-				buffer_append_str(st->obuf, MARKER "room ");
-				buffer_append_str(st->obuf, new->id);
-				buffer_append_str(st->obuf, " ");
-				buffer_append_str(st->obuf, new->area);
-				buffer_append_str(st->obuf, "\n");
+					latency_add(st->latency, LATENCY_DB,
+					    latency_now() - start);
+					if (st->graph)
+						graph_add_exit(st->graph,
+						    st->room->id, new->id,
+						    new->direction);
+					livemap_visit(st->livemap, st->room,
+					    new);
+				}
+				char *roomstr = NULL;
+				if (asprintf(&roomstr, "%s %s", new->id,
+				    new->area) == -1)
+					err(1, "room: asprintf");
+				status_line(st, 99, "room", roomstr,
+				    strlen(roomstr));
+				free(roomstr);
 			}
 			room_free(st->room);
 			st->room = new;
 			if (msg) {
-				buffer_append_str(st->obuf, msg);
+				charset_append_utf8(st->charset, st->obuf,
+				    msg, strlen(msg));
 				free(msg);
 			}
 		}
 		break;
 	default: {
-		char *str = NULL;
-		if (asprintf(&str, MARKER "unknown tag %d %s\n",
-		    parser->tag->code, tmpstr) == -1)
-			warnx("unknown tag: asprintf");
-		else
-			buffer_append_str(st->obuf, str);
-		free(str);
+		char code[16];
+		metrics_add(METRIC_UNKNOWN_TAGS, 1);
+		snprintf(code, sizeof(code), "%d ", parser->tag->code);
+		buffer_append_str(st->obuf, MARKER "unknown tag ");
+		buffer_append_str(st->obuf, code);
+		charset_append_utf8(st->charset, st->obuf, tmpstr,
+		    strlen(tmpstr));
+		buffer_append_str(st->obuf, "\n");
 		break;
 	}
 	}
@@ -267,11 +731,36 @@ on_close(struct bc_parser *parser)
 		buffer_clear(st->tmpbuf);
 }
 
+/*
+ * Gives up on the open tag when it is over a limit, which is most likely
+ * because its end was lost: the text collected so far is output as plain text,
+ * and so is the rest of it as it arrives, until the tag closes or is dropped.
+ * Tags nested in it are still parsed.
+ */
+static void
+tag_overflow(struct proxy_state *st, struct bc_parser *parser)
+{
+	metrics_add(METRIC_TAG_OVERFLOWS, 1);
+	charset_append_utf8(st->charset, st->obuf, st->tmpbuf->data,
+	    st->tmpbuf->len);
+	buffer_clear(st->tmpbuf);
+	free(st->argstr);
+	st->argstr = NULL;
+	st->overflow = parser->depth;
+}
+
 void
 on_tag_text(struct bc_parser *parser, const char *buf, size_t len)
 {
 	struct proxy_state *st = parser->data;
-	buffer_append_iso8859_1(st->tmpbuf, buf, len);
+	if (st->overflow != parser->depth &&
+	    st->tmpbuf->len + len > st->tag_max)
+		tag_overflow(st, parser);
+	/* tag text is kept in UTF-8, like everything the proxy keeps */
+	if (st->overflow == parser->depth)
+		charset_append(st->charset, st->obuf, buf, len);
+	else
+		buffer_append_iso8859_1(st->tmpbuf, buf, len);
 }
 
 void
@@ -283,6 +772,13 @@ on_arg_end(struct bc_parser *parser)
 	 * but if they do, the failure is graceful: string comparisons fail
 	 * earlier instead of at the end of the allocated buffer
 	 */
+	if (st->overflow && st->overflow == parser->depth)
+		return;
+	if (st->tmpbuf->len > st->arg_max) {
+		tag_overflow(st, parser);
+		return;
+	}
+	free(st->argstr);
 	st->argstr = malloc(st->tmpbuf->len + 1);
 	if (!st->argstr)
 		err(1, "argstr: malloc");
@@ -297,13 +793,460 @@ void
 on_text(struct bc_parser *parser, const char *buf, size_t len)
 {
 	struct proxy_state *st = parser->data;
-	buffer_append_iso8859_1(st->obuf, buf, len);
+	charset_append(st->charset, st->obuf, buf, len);
 }
 
 void
 on_telnet_command(struct bc_parser *parser, const char *buf, size_t len)
 {
-	/* Pass this as is - MUD clients usually understand TELNET */
 	struct proxy_state *st = parser->data;
+	/*
+	 * The proxy negotiates GMCP and CHARSET with the client itself, so
+	 * don't let the server's offers through.
+	 */
+	if (len == 3 && ((uint8_t)buf[2] == TELOPT_GMCP ||
+	    (uint8_t)buf[2] == TELOPT_CHARSET))
+		return;
+	/* Pass this as is - MUD clients usually understand TELNET */
 	buffer_append(st->obuf, buf, len);
 }
+
+/*
+ * Handles CHARSET negotiation (RFC 2066) with the client. If the client agrees
+ * to our offer, we request our charsets in order of preference; if it
+ * requests charsets, we accept the first one we know. Text to and from the
+ * client is converted to the accepted charset from then on. With -C the
+ * charset is fixed and the option is refused.
+ *
+ * The option is negotiated in each direction as GMCP is (see
+ * proxy_client_telnet): requests for the state it is already in, and the
+ * answer to our offer, are not acknowledged.
+ */
+static void
+client_charset_telnet(struct proxy_state *st, const char *cmd, size_t len)
+{
+	const struct charset *cs = NULL;
+	const char *p = cmd + 4, *end = cmd + len - 2, *q;
+	char sep;
+
+	switch ((uint8_t)cmd[1]) {
+	case 0xfb: /* WILL */
+		if (st->charset_fixed)
+			buffer_append_str(st->obuf, CHARSET_DONT);
+		else if (!st->charset_do) {
+			buffer_append_str(st->obuf, CHARSET_DO);
+			st->charset_do = 1;
+		}
+		return;
+	case 0xfc: /* WONT */
+		if (st->charset_do)
+			buffer_append_str(st->obuf, CHARSET_DONT);
+		st->charset_do = 0;
+		return;
+	case 0xfd: /* DO */
+		if (st->charset_fixed) {
+			buffer_append_str(st->obuf, CHARSET_WONT);
+			return;
+		}
+		if (st->charset_will)
+			return;
+		if (!st->charset_offer)
+			buffer_append_str(st->obuf, CHARSET_WILL);
+		st->charset_offer = 0;
+		st->charset_will = 1;
+		buffer_append_str(st->obuf, "\xff\xfa\x2a\x01");
+		charset_list(st->obuf, ';');
+		buffer_append_str(st->obuf, "\xff\xf0");
+		return;
+	case 0xfe: /* DONT */
+		if (!st->charset_offer && st->charset_will)
+			buffer_append_str(st->obuf, CHARSET_WONT);
+		st->charset_offer = 0;
+		st->charset_will = 0;
+		return;
+	case 0xfa: /* SB */
+		if (len < 6 || st->charset_fixed)
+			return;
+		break;
+	default:
+		return;
+	}
+
+	switch ((uint8_t)cmd[3]) {
+	case CHARSET_ACCEPTED:
+		cs = charset_find(p, end - p);
+		break;
+	case CHARSET_REQUEST:
+		if (end - p > 8 && memcmp(p, "[TTABLE]", 8) == 0)
+			p += 9;		/* and the version */
+		if (p >= end)
+			break;
+		for (sep = *p++; !cs && p < end; p = q + 1) {
+			if (!(q = memchr(p, sep, end - p)))
+				q = end;
+			cs = charset_find(p, q - p);
+		}
+		if (cs) {
+			buffer_append_str(st->obuf, "\xff\xfa\x2a\x02");
+			buffer_append_str(st->obuf, cs->name);
+		} else
+			buffer_append_str(st->obuf, "\xff\xfa\x2a\x03");
+		buffer_append_str(st->obuf, "\xff\xf0");
+		break;
+	case CHARSET_TTABLE_IS:
+		buffer_append_str(st->obuf, "\xff\xfa\x2a\x05\xff\xf0");
+		break;
+	}
+	if (cs) {
+		st->charset = cs;
+		client_charset(cs);
+	}
+}
+
+/*
+ * client_telnet_cb for TELNET commands from the client. Handles the client's
+ * answer to our GMCP offer and CHARSET negotiation, and swallows any GMCP the
+ * client sends.
+ *
+ * GMCP is negotiated as in RFC 854: a DO or DONT that answers our offer, or
+ * that asks for the state the option is already in, is not acknowledged;
+ * otherwise it is, with WILL or WONT. The client may not send GMCP, so its
+ * WILL is refused with DONT.
+ */
+int
+proxy_client_telnet(void *arg, const char *cmd, size_t len)
+{
+	struct proxy_state *st = arg;
+
+	if (len >= 3 && (uint8_t)cmd[2] == TELOPT_CHARSET) {
+		client_charset_telnet(st, cmd, len);
+		return 1;
+	}
+	if (len < 3 || (uint8_t)cmd[2] != TELOPT_GMCP)
+		return 0;
+	switch ((uint8_t)cmd[1]) {
+	case 0xfb: /* WILL */
+		buffer_append_str(st->obuf, GMCP_DONT);
+		break;
+	case 0xfd: /* DO */
+		if (!st->gmcp_offer && !st->gmcp)
+			buffer_append_str(st->obuf, GMCP_WILL);
+		st->gmcp_offer = 0;
+		st->gmcp = 1;
+		break;
+	case 0xfe: /* DONT */
+		if (!st->gmcp_offer && st->gmcp)
+			buffer_append_str(st->obuf, GMCP_WONT);
+		st->gmcp_offer = 0;
+		st->gmcp = 0;
+		break;
+	}
+	return 1;
+}
+
+/*
+ * Handles a proxy command line (without PROXY_COMMAND):
+ *     path <room id or area>	shows the shortest known path there
+ *     go <room id or area>	also sends the path to the server
+ */
+static void
+proxy_command(struct proxy_state *st, const char *line)
+{
+	const char **dirs;
+	const char *target;
+	int n, go;
+
+	if (strncmp(line, "path ", strlen("path ")) == 0)
+		go = 0;
+	else if (strncmp(line, "go ", strlen("go ")) == 0)
+		go = 1;
+	else {
+		buffer_append_str(st->obuf, MARKER "proxy_usage "
+		    PROXY_COMMAND "path|go <room id or area>\n");
+		return;
+	}
+	target = line + strcspn(line, " ") + 1;
+	if (!st->room || !st->graph ||
+	    (n = graph_path(st->graph, st->room->id, target, &dirs)) == -1) {
+		buffer_append_str(st->obuf, MARKER "path_unknown ");
+		buffer_append_str(st->obuf, target);
+		buffer_append_str(st->obuf, "\n");
+		return;
+	}
+	buffer_append_str(st->obuf, MARKER "path ");
+	for (int i = 0; i < n; i++) {
+		if (i)
+			buffer_append_str(st->obuf, ",");
+		buffer_append_str(st->obuf, dirs[i]);
+		if (go) {
+			buffer_append_str(st->sbuf, dirs[i]);
+			buffer_append_str(st->sbuf, "\n");
+		}
+	}
+	buffer_append_str(st->obuf, "\n");
+}
+
+/* Where client input is in a TELNET command */
+enum {
+	CLIENT_TEXT = 0,
+	CLIENT_IAC,
+	CLIENT_OPT,		/* after IAC WILL/WONT/DO/DONT */
+	CLIENT_SB,		/* in a subnegotiation */
+	CLIENT_SB_IAC,
+};
+
+/*
+ * Passes on the line held in st->cmdbuf, or only the TELNET commands that
+ * came with it if it was a proxy command.
+ */
+static void
+client_release(struct proxy_state *st, int command)
+{
+	buffer_append_buf(st->sbuf, command ? st->cmdtelnet : st->cmdin);
+	buffer_clear(st->cmdbuf);
+	buffer_clear(st->cmdin);
+	buffer_clear(st->cmdtelnet);
+}
+
+/*
+ * Appends n bytes of client text, which end at a newline if they contain one,
+ * to st->sbuf, except for lines starting with PROXY_COMMAND, which are
+ * handled by the proxy. A line start that may turn out to be a command is
+ * held in st->cmdbuf until the rest of the line arrives.
+ */
+static void
+client_text(struct proxy_state *st, const char *buf, size_t n)
+{
+	const size_t cmdlen = strlen(PROXY_COMMAND);
+	int nl = buf[n - 1] == '\n';
+
+	if (st->midline) {
+		buffer_append(st->sbuf, buf, n);
+		st->midline = !nl;
+		return;
+	}
+	buffer_append(st->cmdbuf, buf, n);
+	buffer_append(st->cmdin, buf, n);
+	if (memcmp(st->cmdbuf->data, PROXY_COMMAND,
+	    st->cmdbuf->len < cmdlen ? st->cmdbuf->len : cmdlen) != 0) {
+		/* not a command */
+		client_release(st, 0);
+		st->midline = !nl;
+		return;
+	}
+	if (!nl) {
+		if (st->cmdbuf->len <= PROXY_COMMAND_MAX)
+			return;
+		/* too long to be a command; pass it on */
+		client_release(st, 0);
+		st->midline = 1;
+		return;
+	}
+	st->cmdbuf->len--;
+	if (st->cmdbuf->len && st->cmdbuf->data[st->cmdbuf->len - 1] == '\r')
+		st->cmdbuf->len--;
+	buffer_append(st->cmdbuf, "", 1);
+	proxy_command(st, st->cmdbuf->data + cmdlen);
+	client_release(st, 1);
+}
+
+/*
+ * Appends n bytes of a TELNET command from the client to st->sbuf, or holds
+ * them with a line held in st->cmdbuf, so that they keep their place in the
+ * input if it is passed on.
+ */
+static void
+client_telnet(struct proxy_state *st, const char *buf, size_t n)
+{
+	if (!st->cmdbuf->len) {
+		buffer_append(st->sbuf, buf, n);
+		return;
+	}
+	buffer_append(st->cmdin, buf, n);
+	buffer_append(st->cmdtelnet, buf, n);
+}
+
+/*
+ * Appends len bytes of input from the client to st->sbuf, handling proxy
+ * commands as client_text does. TELNET commands, which may contain any byte,
+ * are passed on in their place and don't count towards lines; IAC IAC is text.
+ */
+void
+proxy_client_input(struct proxy_state *st, const char *buf, size_t len)
+{
+	const char *end = buf + len;
+
+	while (buf < end) {
+		if (st->telnet == CLIENT_TEXT && *buf != '\xff') {
+			const char *p = buf;
+			while (p < end && *p != '\n' && *p != '\xff')
+				p++;
+			if (p < end && *p == '\n')
+				p++;
+			client_text(st, buf, p - buf);
+			buf = p;
+			continue;
+		}
+		unsigned char ch = *buf++;
+		switch (st->telnet) {
+		case CLIENT_TEXT:
+			/* the IAC is output with the next byte */
+			st->telnet = CLIENT_IAC;
+			continue;
+		case CLIENT_IAC:
+			st->telnet = CLIENT_TEXT;
+			if (ch == 0xff) {
+				client_text(st, "\xff\xff", 2);
+				continue;
+			}
+			client_telnet(st, "\xff", 1);
+			if (ch == 0xfa)
+				st->telnet = CLIENT_SB;
+			else if (ch >= 0xfb)
+				st->telnet = CLIENT_OPT;
+			break;
+		case CLIENT_OPT:
+			st->telnet = CLIENT_TEXT;
+			break;
+		case CLIENT_SB:
+			if (ch == 0xff)
+				st->telnet = CLIENT_SB_IAC;
+			break;
+		case CLIENT_SB_IAC:
+			st->telnet = ch == 0xf0 ? CLIENT_TEXT : CLIENT_SB;
+			break;
+		}
+		client_telnet(st, (const char *)&ch, 1);
+	}
+}
+
+static void
+stats_json(struct proxy_state *st, buffer *out)
+{
+	const struct coalesce_stats *cs = coalesce_stats(st->coalesce);
+	const struct outq_stats *os = outq_stats(st->outq);
+	struct db_stats ds;
+
+	buffer_append_str(out, "{");
+	json_key(out, "coalesce", 1);
+	if (cs) {
+		buffer_append_str(out, "{");
+		json_int(out, "updates", cs->updates, 1);
+		json_int(out, "emitted", cs->emitted, 0);
+		json_int(out, "superseded", cs->superseded, 0);
+		json_int(out, "duplicates", cs->duplicates, 0);
+		json_int(out, "evicted", cs->evicted, 0);
+		json_int(out, "saved", cs->superseded + cs->duplicates, 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	json_key(out, "outq", 0);
+	if (os) {
+		buffer_append_str(out, "{");
+		json_int(out, "bytes", os->bytes, 1);
+		json_int(out, "highwater", os->highwater, 0);
+		json_int(out, "replaced", os->replaced, 0);
+		json_int(out, "spectators", fanout_count(st->fanout), 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	json_key(out, "db", 0);
+	if (db_stats(st->db, &ds) == 0) {
+		buffer_append_str(out, "{");
+		json_int(out, "queued", ds.queued, 1);
+		json_int(out, "written", ds.written, 0);
+		json_int(out, "failed", ds.failed, 0);
+		json_int(out, "dropped", ds.dropped, 0);
+		json_int(out, "highwater", ds.highwater, 0);
+		json_int(out, "hits", ds.hits, 0);
+		json_int(out, "misses", ds.misses, 0);
+		json_int(out, "changed", ds.changed, 0);
+		json_int(out, "seen", ds.seen, 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	json_key(out, "triggers", 0);
+	if (st->triggers) {
+		const struct trigger_stats *ts = triggers_stats(st->triggers);
+		buffer_append_str(out, "{");
+		json_int(out, "lines", ts->lines, 1);
+		json_int(out, "bytes", ts->bytes, 0);
+		json_int(out, "candidates", ts->candidates, 0);
+		json_int(out, "matches", ts->matches, 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	json_key(out, "graph", 0);
+	if (st->graph) {
+		struct graph_stats gs;
+		graph_stats(st->graph, &gs);
+		buffer_append_str(out, "{");
+		json_int(out, "rooms", gs.rooms, 1);
+		json_int(out, "exits", gs.exits, 0);
+		json_int(out, "areas", gs.areas, 0);
+		json_int(out, "delta", gs.delta, 0);
+		buffer_append_str(out, "}");
+	} else
+		buffer_append_str(out, "null");
+	buffer_append_str(out, "}");
+}
+
+/*
+ * Writes the shortest path from the current room to target as JSON.
+ */
+static void
+path_json(struct proxy_state *st, const char *target, buffer *out)
+{
+	const char **dirs;
+	int n = -1;
+
+	if (st->room && st->graph)
+		n = graph_path(st->graph, st->room->id, target, &dirs);
+	buffer_append_str(out, "{");
+	json_str(out, "target", target, 1);
+	json_key(out, "path", 0);
+	if (n == -1)
+		buffer_append_str(out, "null");
+	else {
+		buffer_append_str(out, "[");
+		for (int i = 0; i < n; i++) {
+			if (i)
+				buffer_append_str(out, ",");
+			buffer_append_json_str(out, dirs[i], strlen(dirs[i]));
+		}
+		buffer_append_str(out, "]");
+	}
+	buffer_append_str(out, "}");
+}
+
+/*
+ * events_request_cb for requests on the event feed socket.
+ *     state	returns the current game state (see gamestate_json)
+ *     stats	returns proxy counters
+ *     metrics	returns {"metrics":...}, metrics in the Prometheus text
+ *		format as a JSON string
+ *     latency	returns per-chunk latency percentiles (see latency_json)
+ *     path X	returns the shortest path to room id or area X
+ */
+void
+proxy_request(void *arg, const char *req, buffer *reply)
+{
+	struct proxy_state *st = arg;
+
+	if (strcmp(req, "state") == 0)
+		gamestate_json(&st->game, reply);
+	else if (strcmp(req, "stats") == 0)
+		stats_json(st, reply);
+	else if (strcmp(req, "metrics") == 0)
+		metrics_json(reply);
+	else if (strcmp(req, "latency") == 0)
+		latency_json(st->latency, reply);
+	else if (strncmp(req, "path ", strlen("path ")) == 0)
+		path_json(st, req + strlen("path "), reply);
+	else {
+		buffer_append_str(reply, "{\"error\":\"unknown request\","
+		    "\"request\":");
+		buffer_append_json_str(reply, req, strlen(req));
+		buffer_append_str(reply, "}");
+	}
+}
@@ -2,18 +2,81 @@
 #define PROXY_H
 #include "parser.h"
 #include "buffer.h"
+#include "charset.h"
+#include "coalesce.h"
 #include "db.h"
+#include "events.h"
+#include "fanout.h"
+#include "gamestate.h"
+#include "graph.h"
+#include "latency.h"
+#include "livemap.h"
+#include "logstore.h"
+#include "outq.h"
+#include "trigger.h"
 
 struct proxy_state {
 	buffer		*obuf;
 	buffer		*tmpbuf;
+	buffer		*linebuf;	/* status line being output */
 	char		*argstr;
+	size_t		tag_max;	/* most tag text collected */
+	size_t		arg_max;	/* longest tag argument */
+	int		overflow;	/* depth of the tag output as text */
 	struct room	*room;
 	struct db	*db;
+	struct events	*events;
+	int		gmcp;	/* client agreed to GMCP */
+	int		gmcp_offer;	/* our WILL GMCP is unanswered */
+	const struct charset *charset;	/* of the client */
+	int		charset_fixed;	/* set with -C, not negotiated */
+	int		charset_offer;	/* our WILL CHARSET is unanswered */
+	int		charset_will;	/* client agreed to our CHARSET */
+	int		charset_do;	/* we agreed to the client's CHARSET */
+	struct gamestate game;
+	struct coalesce	*coalesce;
+	struct outq	*outq;		/* client output; NULL in test mode */
+	struct graph	*graph;		/* known map; NULL in test mode */
+	struct livemap	*livemap;	/* NULL if not enabled */
+	struct fanout	*fanout;	/* spectators; NULL if not enabled */
+	struct triggers	*triggers;	/* NULL if not enabled */
+	struct latency	*latency;	/* NULL in test_parser */
+	struct logstore	*log;		/* NULL if not enabled */
+	buffer		*logline;	/* output line being logged */
+	buffer		*logtext;	/* its text */
+	char		logtype[64];	/* its message type */
+	size_t		logoff;		/* obuf bytes already logged */
+	buffer		*trigout;	/* obuf after triggers */
+	buffer		*trigline;	/* text of the line being matched */
+	buffer		*trigcmds;	/* TELNET commands in the line */
+	buffer		*trigsubst;	/* text after a subst trigger */
+	buffer		*trigtmp;	/* event data */
+	buffer		*trigemit;	/* emit lines to add after the line */
+	int		trigsent;	/* start of the line was output as is */
+	buffer		*sbuf;		/* client input for the server */
+	buffer		*cmdbuf;	/* line that may be a proxy command */
+	buffer		*cmdin;		/* its input, with TELNET commands */
+	buffer		*cmdtelnet;	/* TELNET commands in its input */
+	int		midline;	/* sbuf input ended mid-line */
+	int		telnet;		/* in a TELNET command */
 };
 
+/* Client lines starting with this are proxy commands */
+#define PROXY_COMMAND		"bcproxy "
+#define PROXY_COMMAND_MAX	1024
+
+/* Default limits on tags from the server */
+#define PROXY_TAG_DEPTH		16
+#define PROXY_TAG_MAX		65536
+#define PROXY_ARG_MAX		256
+
 struct proxy_state *	proxy_state_new(size_t, struct db *);
 void			proxy_state_free(struct proxy_state *);
+void			proxy_flush(struct proxy_state *);
+int			proxy_passthrough(struct proxy_state *,
+			    struct bc_parser *, const char *, size_t);
+void			proxy_expire(struct proxy_state *);
+void			proxy_finish(struct proxy_state *);
 
 void	on_open(struct bc_parser *);
 void	on_close(struct bc_parser *);
@@ -24,4 +87,8 @@ void	on_text(struct bc_parser *, const char *, size_t);
 void	on_tag_text(struct bc_parser *, const char *, size_t);
 void	on_telnet_command(struct bc_parser *, const char *, size_t);
 
+int	proxy_client_telnet(void *, const char *, size_t);
+void	proxy_client_input(struct proxy_state *, const char *, size_t);
+void	proxy_request(void *, const char *, buffer *);
+
 #endif /* PROXY_H */
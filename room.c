@@ -1,70 +1,93 @@
 #include <err.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
 #include "config.h"
+#include "hashset.h"
+#include "metrics.h"
 #include "room.h"
 
+/*
+ * Parses a BAT_MAPPER message (without the "BAT_MAPPER;;" prefix):
+ *     area;;id;;direction;;indoors;;shortdesc;;longdesc;;exits;;
+ * The room and its strings are one allocation: the message is copied once
+ * after the struct, and the fields point into the copy, with each ";;"
+ * separator overwritten by a NUL.
+ *
+ * The room's hash covers what a visit can find changed, so that the database
+ * writer can tell a changed room from one that is already stored.
+ */
 struct room *
 room_new(const char *mapmsg)
 {
 	struct room *room;
-	const char *cur;
-	size_t len;
-	const char *end;
+	char *fields[7];
+	char *cur, *end, *sep;
+	size_t len = strlen(mapmsg);
 
-	room = calloc(1, sizeof(struct room));
+	room = malloc(sizeof(struct room) + len + 1);
 	if (!room)
-		goto err;
-	cur = mapmsg;
-
-#define SEP ";;"
-#define SKIP() do {\
-	cur = strstr(cur, SEP);\
-	if (!cur)\
-		goto err;\
-	cur += strlen(SEP);\
-} while(0)
-#define NEXT(target) do {\
-	end = strstr(cur, SEP);\
-	if (!end)\
-		goto err;\
-	len = end - cur + 1;\
-	target = malloc(len);\
-	if (!target)\
-		err(1, "room_new: malloc");\
-	strlcpy(target, cur, len);\
-	cur = end + strlen(SEP);\
-} while(0)
-
-	NEXT(room->area);
-	NEXT(room->id);
-	NEXT(room->direction);
-	sscanf(cur, "%d" SEP, &room->indoors);
-	SKIP();
-	NEXT(room->shortdesc);
-	NEXT(room->longdesc);
-	NEXT(room->exits);
+		err(1, "room_new: malloc");
+	metrics_add(METRIC_ROOM_ALLOCS, 1);
+	room->size = len + 1;
+	cur = memcpy(room + 1, mapmsg, len + 1);
+	end = cur + len;
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		for (sep = cur; (sep = memchr(sep, ';', end - sep)) != NULL;
+		    sep++)
+			if (sep + 1 < end && sep[1] == ';')
+				break;
+		if (!sep) {
+			free(room);
+			return NULL;
+		}
+		*sep = '\0';
+		fields[i] = cur;
+		cur = sep + 2;
+	}
+	room->area = fields[0];
+	room->id = fields[1];
+	room->direction = fields[2];
+	room->indoors = strtol(fields[3], NULL, 10);
+	room->shortdesc = fields[4];
+	room->longdesc = fields[5];
+	room->exits = fields[6];
+	room->hash = HASH_INIT;
+	room->hash = hash_str(room->hash, room->area);
+	room->hash = hash_str(room->hash, fields[3]);
+	room->hash = hash_str(room->hash, room->shortdesc);
+	room->hash = hash_str(room->hash, room->longdesc);
+	room->hash = hash_str(room->hash, room->exits);
+	return room;
+}
 
-#undef SEP
-#undef NEXT
+/*
+ * Returns a copy of room, or NULL if out of memory.
+ */
+struct room *
+room_dup(const struct room *room)
+{
+	struct room *dup = malloc(sizeof(struct room) + room->size);
+	const char *base = (const char *)(room + 1);
+	char *dupbase;
 
-	return room;
-err:
-	room_free(room);
-	return NULL;
+	if (!dup)
+		return NULL;
+	dupbase = (char *)(dup + 1);
+	metrics_add(METRIC_ROOM_ALLOCS, 1);
+	memcpy(dup, room, sizeof(struct room) + room->size);
+#define REBASE(field) dup->field = dupbase + (room->field - base)
+	REBASE(area);
+	REBASE(id);
+	REBASE(direction);
+	REBASE(shortdesc);
+	REBASE(longdesc);
+	REBASE(exits);
+#undef REBASE
+	return dup;
 }
 
 void
 room_free(struct room *room)
 {
-	if (room) {
-		free(room->area);
-		free(room->id);
-		free(room->direction);
-		free(room->shortdesc);
-		free(room->longdesc);
-		free(room->exits);
-		free(room);
-	}
+	free(room);
 }
@@ -1,5 +1,7 @@
 #ifndef ROOM_H
 #define ROOM_H
+#include <stddef.h>
+#include <stdint.h>
 
 struct room {
 	char *	id;
@@ -9,9 +11,12 @@ struct room {
 	char *	area;
 	char *	exits;
 	int	indoors;
+	uint64_t hash;		/* of everything but id and direction */
+	size_t	size;		/* of the strings following the struct */
 };
 
 struct room *	room_new(const char *);
+struct room *	room_dup(const struct room *);
 void		room_free(struct room *);
 
 #endif /* ROOM_H */
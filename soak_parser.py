@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+
+# Feeds malformed BatClient tags to test_parser and checks that the proxy's
+# memory use stays bounded (see -b in bcproxy.1): an unterminated tag, unclosed
+# nested tags, a runaway argument and repeated argument ends, about 200 MB of
+# each. Also checks that the text of an unterminated tag is output as it
+# arrives, also after a tag nested in it.
+#
+# usage: soak_parser.py [path/to/test_parser [max_rss_kb]]
+
+import os
+import select
+import subprocess
+import sys
+import time
+
+LINE = b"You are in a dark room. " * 3 + b"\n"
+COUNT = 2000000
+
+
+def unterminated(out):
+    out.write(b"\x1b<10chan_sales\x1b|")
+    for i in range(COUNT):
+        out.write(LINE)
+
+
+def nested(out):
+    for i in range(COUNT):
+        out.write(b"\x1b<20ff0000\x1b|" + LINE)
+
+
+def arg(out):
+    out.write(b"\x1b<10")
+    for i in range(COUNT):
+        out.write(LINE)
+    out.write(b"\x1b|x\x1b>10")
+
+
+def args(out):
+    for i in range(COUNT):
+        out.write(b"\x1b<10" + LINE + b"\x1b|" + LINE)
+
+
+def soak(prog, name, gen, max_rss):
+    p = subprocess.Popen([prog], stdin=subprocess.PIPE,
+                         stdout=subprocess.DEVNULL)
+    gen(p.stdin)
+    p.stdin.close()
+    _, status, usage = os.wait4(p.pid, 0)
+    ok = status == 0 and usage.ru_maxrss <= max_rss
+    print('%s: %s, peak RSS %d KB' % (name, 'ok' if ok else 'FAIL',
+                                      usage.ru_maxrss))
+    return ok
+
+
+def prompt(prog):
+    """Text after the size limit and a nested tag arrives without more input"""
+    p = subprocess.Popen([prog], stdin=subprocess.PIPE,
+                         stdout=subprocess.PIPE)
+    p.stdin.write(b"\x1b<10chan_sales\x1b|" + b"x" * 70000 +
+                  b"\x1b<20ff0000\x1b|red\x1b>20after\n")
+    p.stdin.flush()
+    out = b''
+    end = time.time() + 2
+    while b'after' not in out and time.time() < end:
+        r, _, _ = select.select([p.stdout], [], [], 0.1)
+        if r:
+            out += os.read(p.stdout.fileno(), 1 << 16)
+    p.stdin.close()
+    p.stdout.close()
+    p.wait()
+    ok = b'after' in out
+    print('unterminated, nested: %s' % ('ok' if ok else 'FAIL'))
+    return ok
+
+
+prog = sys.argv[1] if len(sys.argv) > 1 else './test_parser'
+max_rss = int(sys.argv[2]) if len(sys.argv) > 2 else 32768
+ok = prompt(prog)
+for gen in (unterminated, nested, arg, args):
+    ok = soak(prog, gen.__name__, gen, max_rss) and ok
+sys.exit(0 if ok else 1)
@@ -0,0 +1,343 @@
+#include <sqlite3.h>
+#include <err.h>
+#include <stdlib.h>
+#include "db.h"
+#include "sqlite.h"
+
+/*
+ * Map store in a local SQLite file, for running without a postgresql server.
+ * The schema matches initdb.sql, so area_to_json.py can read either. The file
+ * is created and initialized if it doesn't exist.
+ *
+ * A changed room is updated with an upsert, which needs SQLite 3.24, after
+ * copying the previous version to room_version.
+ *
+ * The database is in WAL mode with synchronous=NORMAL: a crash may lose the
+ * last transactions, but never corrupts the file. Writes are grouped into
+ * transactions that are committed by sqlite_flush (see DB_BATCH_MAX). A
+ * statement or COMMIT that fails rolls its transaction back.
+ */
+
+struct lite {
+	sqlite3		*db;
+	sqlite3_stmt	*add_desc;
+	sqlite3_stmt	*add_version;
+	sqlite3_stmt	*add_room;
+	sqlite3_stmt	*add_exit;
+	int		pending;	/* statements in the open transaction */
+};
+
+static const char schema_sql[] =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS description ("
+    "    hash BIGINT PRIMARY KEY,"
+    "    text TEXT NOT NULL"
+    ");"
+    "CREATE TABLE IF NOT EXISTS room ("
+    "    key BIGINT PRIMARY KEY,"
+    "    id TEXT UNIQUE NOT NULL,"
+    "    shortdesc BIGINT NOT NULL REFERENCES description(hash),"
+    "    longdesc BIGINT NOT NULL REFERENCES description(hash),"
+    "    area TEXT,"
+    "    indoors BOOLEAN,"
+    "    exits TEXT,"
+    "    hash BIGINT"
+    ");"
+    "CREATE INDEX IF NOT EXISTS room_area ON room(area);"
+    "CREATE TABLE IF NOT EXISTS room_version ("
+    "    key BIGINT REFERENCES room(key),"
+    "    hash BIGINT,"
+    "    shortdesc BIGINT NOT NULL REFERENCES description(hash),"
+    "    longdesc BIGINT NOT NULL REFERENCES description(hash),"
+    "    area TEXT,"
+    "    indoors BOOLEAN,"
+    "    exits TEXT,"
+    "    replaced TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
+    ");"
+    "CREATE INDEX IF NOT EXISTS room_version_key ON room_version(key);"
+    "CREATE TABLE IF NOT EXISTS exit ("
+    "    source BIGINT REFERENCES room(key),"
+    "    destination BIGINT REFERENCES room(key),"
+    "    direction TEXT,"
+    "    PRIMARY KEY(source, destination)"
+    ");";
+static const char add_desc_sql[] =
+    "INSERT OR IGNORE INTO description(hash, text) "
+    "SELECT CASE WHEN EXISTS (SELECT 1 FROM description "
+    "WHERE hash=?1 AND text<>?3) THEN ?2 ELSE ?1 END, ?3";
+static const char add_version_sql[] =
+    "INSERT INTO room_version"
+    "(key, hash, shortdesc, longdesc, area, indoors, exits) "
+    "SELECT key, hash, shortdesc, longdesc, area, indoors, exits FROM room "
+    "WHERE key=?1 AND hash IS NOT ?2";
+static const char add_room_sql[] =
+    "INSERT INTO room(key, id, shortdesc, longdesc, area, exits, indoors, "
+    "hash) VALUES (?1, ?2, "
+    "(SELECT hash FROM description WHERE hash IN (?3, ?9) AND text=?11), "
+    "(SELECT hash FROM description WHERE hash IN (?4, ?10) AND text=?12), "
+    "?5, ?6, ?7, ?8) "
+    "ON CONFLICT (key) DO UPDATE SET shortdesc=excluded.shortdesc, "
+    "longdesc=excluded.longdesc, area=excluded.area, exits=excluded.exits, "
+    "indoors=excluded.indoors, hash=excluded.hash "
+    "WHERE hash IS NOT excluded.hash";
+static const char add_exit_sql[] =
+    "INSERT OR IGNORE INTO exit(source, destination, direction) "
+    "SELECT ?1, ?2, ?3 WHERE EXISTS (SELECT 1 FROM room WHERE key=?1) "
+    "AND EXISTS (SELECT 1 FROM room WHERE key=?2)";
+static const char exits_sql[] =
+    "SELECT s.id, d.id, direction FROM exit "
+    "JOIN room s ON s.key=source JOIN room d ON d.key=destination";
+
+static void
+prepare(struct lite *lite, sqlite3_stmt **stmt, const char *sql)
+{
+	if (sqlite3_prepare_v2(lite->db, sql, -1, stmt, NULL) != SQLITE_OK)
+		errx(1, "sqlite_init: %s", sqlite3_errmsg(lite->db));
+}
+
+void *
+sqlite_init(const char *path)
+{
+	struct lite *lite;
+	char *errmsg;
+
+	if (!path || !*path)
+		errx(1, "sqlite_init: no database file given");
+	if (!(lite = calloc(1, sizeof(struct lite))))
+		err(1, "sqlite_init: malloc");
+	if (sqlite3_open(path, &lite->db) != SQLITE_OK)
+		errx(1, "sqlite_init: %s: %s", path, sqlite3_errmsg(lite->db));
+	sqlite3_busy_timeout(lite->db, 5000);
+	if (sqlite3_exec(lite->db, schema_sql, NULL, NULL, &errmsg) !=
+	    SQLITE_OK)
+		errx(1, "sqlite_init: %s: %s", path, errmsg);
+	prepare(lite, &lite->add_desc, add_desc_sql);
+	prepare(lite, &lite->add_version, add_version_sql);
+	prepare(lite, &lite->add_room, add_room_sql);
+	prepare(lite, &lite->add_exit, add_exit_sql);
+	return lite;
+}
+
+void
+sqlite_free(void *dbp)
+{
+	struct lite *lite = dbp;
+	sqlite_flush(lite);
+	sqlite3_finalize(lite->add_desc);
+	sqlite3_finalize(lite->add_version);
+	sqlite3_finalize(lite->add_room);
+	sqlite3_finalize(lite->add_exit);
+	sqlite3_close(lite->db);
+	free(lite);
+}
+
+static int
+exec(struct lite *lite, const char *sql)
+{
+	char *errmsg;
+
+	if (sqlite3_exec(lite->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+		warnx("sqlite: %s: %s", sql, errmsg);
+		sqlite3_free(errmsg);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Ends the open transaction after a failure, if it is still open.
+ */
+static void
+rollback(struct lite *lite)
+{
+	lite->pending = 0;
+	if (!sqlite3_get_autocommit(lite->db))
+		exec(lite, "ROLLBACK");
+}
+
+int
+sqlite_flush(void *dbp)
+{
+	struct lite *lite = dbp;
+
+	if (!lite->pending)
+		return 0;
+	lite->pending = 0;
+	if (exec(lite, "COMMIT") == -1) {
+		rollback(lite);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Binds the parameters to stmt and runs it in the open transaction, which is
+ * rolled back if it fails. A parameter with a NULL text is bound to the db_key
+ * of the key string (or its db_key_alt if alt is set), or to num if key is
+ * NULL too.
+ */
+struct param {
+	const char	*text;
+	const char	*key;
+	int		alt;
+	int64_t		num;
+};
+
+static int
+run(struct lite *lite, sqlite3_stmt *stmt, int nparams,
+    const struct param *params)
+{
+	int status = 0;
+
+	if (!lite->pending && exec(lite, "BEGIN") == -1)
+		return -1;
+	lite->pending++;
+	for (int i = 0; i < nparams; i++)
+		if (params[i].text)
+			sqlite3_bind_text(stmt, i + 1, params[i].text, -1,
+			    SQLITE_STATIC);
+		else if (params[i].key)
+			sqlite3_bind_int64(stmt, i + 1, params[i].alt ?
+			    db_key_alt(params[i].key) : db_key(params[i].key));
+		else
+			sqlite3_bind_int64(stmt, i + 1, params[i].num);
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		warnx("sqlite: %s", sqlite3_errmsg(lite->db));
+		status = -1;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	if (status == -1)
+		rollback(lite);
+	return status;
+}
+
+static int
+add_desc(struct lite *lite, const char *desc)
+{
+	const struct param params[] = {
+		{ .key = desc }, { .key = desc, .alt = 1 }, { .text = desc }
+	};
+	return run(lite, lite->add_desc, 3, params);
+}
+
+int
+sqlite_add_room(void *dbp, struct room *room)
+{
+	struct lite *lite = dbp;
+	const struct param params[] = {
+		{ .key = room->id }, { .text = room->id },
+		{ .key = room->shortdesc }, { .key = room->longdesc },
+		{ .text = room->area }, { .text = room->exits },
+		{ .text = room->indoors ? "1" : "0" },
+		{ .num = (int64_t)room->hash },
+		{ .key = room->shortdesc, .alt = 1 },
+		{ .key = room->longdesc, .alt = 1 },
+		{ .text = room->shortdesc }, { .text = room->longdesc },
+	};
+	const struct param version[] = {
+		{ .key = room->id }, { .num = (int64_t)room->hash },
+	};
+	if (add_desc(lite, room->shortdesc) == -1 ||
+	    add_desc(lite, room->longdesc) == -1 ||
+	    run(lite, lite->add_version, 2, version) == -1)
+		return -1;
+	return run(lite, lite->add_room, 12, params);
+}
+
+int
+sqlite_add_exit(void *dbp, struct room *src, struct room *dest)
+{
+	struct lite *lite = dbp;
+	const struct param params[] = {
+		{ .key = src->id }, { .key = dest->id },
+		{ .text = dest->direction },
+	};
+	return run(lite, lite->add_exit, 3, params);
+}
+
+static const char *
+text(sqlite3_stmt *stmt, int col)
+{
+	const char *s = (const char *)sqlite3_column_text(stmt, col);
+	return s ? s : "";
+}
+
+/*
+ * Runs sql, which selects either room id, area and hash or exit source,
+ * destination and direction, and passes the rows to cb.
+ */
+static int
+load(struct lite *lite, const char *sql, int exits, db_load_cb cb, void *arg)
+{
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (sqlite3_prepare_v2(lite->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		warnx("sqlite_load: %s", sqlite3_errmsg(lite->db));
+		return -1;
+	}
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+		if (!exits)
+			cb(arg, text(stmt, 0), text(stmt, 1), NULL, NULL,
+			    (uint64_t)sqlite3_column_int64(stmt, 2));
+		else
+			cb(arg, text(stmt, 0), NULL, text(stmt, 1),
+			    text(stmt, 2), 0);
+	if (rc != SQLITE_DONE)
+		warnx("sqlite_load: %s", sqlite3_errmsg(lite->db));
+	sqlite3_finalize(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * Lists the stored rooms and exits.
+ */
+int
+sqlite_load(void *dbp, db_load_cb cb, void *arg)
+{
+	struct lite *lite = dbp;
+
+	if (load(lite, "SELECT id, area, hash FROM room", 0, cb, arg) == -1 ||
+	    load(lite, exits_sql, 1, cb, arg) == -1)
+		return -1;
+	return 0;
+}
+
+static const char rooms_full_sql[] =
+    "SELECT r.id, r.area, r.indoors, r.exits, s.text, l.text FROM room r "
+    "JOIN description s ON s.hash=r.shortdesc "
+    "JOIN description l ON l.hash=r.longdesc";
+
+/*
+ * Lists the stored rooms with their descriptions.
+ */
+int
+sqlite_rooms(void *dbp, db_room_cb cb, void *arg)
+{
+	struct lite *lite = dbp;
+	sqlite3_stmt *stmt;
+	int rc;
+
+	if (sqlite3_prepare_v2(lite->db, rooms_full_sql, -1, &stmt, NULL) !=
+	    SQLITE_OK) {
+		warnx("sqlite_rooms: %s", sqlite3_errmsg(lite->db));
+		return -1;
+	}
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		struct room room = {
+			.id = (char *)text(stmt, 0),
+			.area = (char *)text(stmt, 1),
+			.indoors = sqlite3_column_int(stmt, 2),
+			.exits = (char *)text(stmt, 3),
+			.shortdesc = (char *)text(stmt, 4),
+			.longdesc = (char *)text(stmt, 5),
+		};
+		cb(arg, &room);
+	}
+	if (rc != SQLITE_DONE)
+		warnx("sqlite_rooms: %s", sqlite3_errmsg(lite->db));
+	sqlite3_finalize(stmt);
+	return rc == SQLITE_DONE ? 0 : -1;
+}
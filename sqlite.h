@@ -0,0 +1,14 @@
+#ifndef SQLITE_H
+#define SQLITE_H
+#include "db.h"
+#include "room.h"
+
+void *sqlite_init(const char *);
+void sqlite_free(void *);
+int sqlite_add_room(void *, struct room *);
+int sqlite_add_exit(void *, struct room *, struct room *);
+int sqlite_flush(void *);
+int sqlite_load(void *, db_load_cb, void *);
+int sqlite_rooms(void *, db_room_cb, void *);
+
+#endif /* SQLITE_H */
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "json.h"
+#include "status.h"
+
+const char *party_flag_names[PARTY_NFLAGS] = {
+	"creator", "formation", "member", "entry", "following", "leader",
+	"linkdead", "resting", "idle", "invisible", "dead", "stunned",
+	"unconscious",
+};
+
+/*
+ * The parse functions fill in the given record from the contents of the
+ * corresponding tag and return 0, or -1 if the tag could not be parsed.
+ */
+
+/* "hp hpmax sp spmax ep epmax" */
+int
+vitals_parse(struct vitals *v, const char *s)
+{
+	if (sscanf(s, "%d %d %d %d %d %d", &v->hp, &v->maxhp, &v->sp,
+	    &v->maxsp, &v->ep, &v->maxep) != 6)
+		return -1;
+	return 0;
+}
+
+/* "effect_name time_left" */
+int
+prot_parse(struct prot *p, const char *s)
+{
+	if (sscanf(s, "%31s %d", p->name, &p->time) != 2)
+		return -1;
+	return 0;
+}
+
+/*
+ * "player race gender level hp maxhp sp maxsp ep maxep party_name x y
+ * <13 flags> party_exp total_party_exp party_length creation_time"
+ * The trailing exp and time fields are ignored.
+ */
+int
+party_member_parse(struct party_member *m, const char *s)
+{
+	int n = 0;
+	struct vitals *v = &m->vitals;
+
+	if (sscanf(s, "%31s %31s %d %d %d %d %d %d %d %d %31s %d %d%n",
+	    m->name, m->race, &m->gender, &m->level, &v->hp, &v->maxhp,
+	    &v->sp, &v->maxsp, &v->ep, &v->maxep, m->party, &m->x, &m->y,
+	    &n) != 13)
+		return -1;
+	s += n;
+	m->flags = 0;
+	for (int i = 0; i < PARTY_NFLAGS; i++) {
+		char *end;
+		long flag = strtol(s, &end, 10);
+		if (end == s)
+			return -1;
+		if (flag)
+			m->flags |= 1 << i;
+		s = end;
+	}
+	return 0;
+}
+
+/* "target percentage"; "0 0" means no target */
+int
+target_parse(struct target *t, const char *s)
+{
+	if (sscanf(s, "%31s %d", t->name, &t->health) != 2)
+		return -1;
+	return 0;
+}
+
+/* "skill_or_spell rounds_left" */
+int
+cast_parse(struct cast *c, const char *s)
+{
+	if (sscanf(s, "%31s %d", c->name, &c->rounds) != 2)
+		return -1;
+	return 0;
+}
+
+/*
+ * The json functions append the record's fields as JSON object members (but
+ * not the surrounding braces). first is passed on to json_key.
+ */
+
+void
+vitals_json(buffer *out, const struct vitals *v, int first)
+{
+	json_int(out, "hp", v->hp, first);
+	json_int(out, "maxhp", v->maxhp, 0);
+	json_int(out, "sp", v->sp, 0);
+	json_int(out, "maxsp", v->maxsp, 0);
+	json_int(out, "ep", v->ep, 0);
+	json_int(out, "maxep", v->maxep, 0);
+}
+
+void
+prot_json(buffer *out, const struct prot *p, int first)
+{
+	json_str(out, "name", p->name, first);
+	json_int(out, "time", p->time, 0);
+}
+
+void
+party_member_json(buffer *out, const struct party_member *m, int first)
+{
+	json_str(out, "name", m->name, first);
+	json_str(out, "race", m->race, 0);
+	json_int(out, "gender", m->gender, 0);
+	json_int(out, "level", m->level, 0);
+	vitals_json(out, &m->vitals, 0);
+	json_str(out, "party", m->party, 0);
+	json_int(out, "x", m->x, 0);
+	json_int(out, "y", m->y, 0);
+	for (int i = 0; i < PARTY_NFLAGS; i++)
+		json_bool(out, party_flag_names[i], m->flags & (1 << i), 0);
+}
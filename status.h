@@ -0,0 +1,76 @@
+#ifndef STATUS_H
+#define STATUS_H
+#include "buffer.h"
+
+/*
+ * Parsed forms of the BatClient status tags. All records are fixed-size;
+ * names longer than STATUS_NAME_MAX - 1 bytes are truncated.
+ */
+#define STATUS_NAME_MAX	32
+
+/* tag 50 */
+struct vitals {
+	int	hp, maxhp;
+	int	sp, maxsp;
+	int	ep, maxep;
+};
+
+/* tag 64 */
+struct prot {
+	char	name[STATUS_NAME_MAX];
+	int	time;		/* seconds left; 0 = ended, -1 = not timed */
+};
+
+/* Party status flags, in the order BatMUD sends them after PLACE_X/Y */
+#define PARTY_CREATOR		(1 << 0)
+#define PARTY_FORMATION		(1 << 1)
+#define PARTY_MEMBER		(1 << 2)
+#define PARTY_ENTRY		(1 << 3)
+#define PARTY_FOLLOWING		(1 << 4)
+#define PARTY_LEADER		(1 << 5)
+#define PARTY_LINKDEAD		(1 << 6)
+#define PARTY_RESTING		(1 << 7)
+#define PARTY_IDLE		(1 << 8)
+#define PARTY_INVISIBLE		(1 << 9)
+#define PARTY_DEAD		(1 << 10)
+#define PARTY_STUNNED		(1 << 11)
+#define PARTY_UNCONSCIOUS	(1 << 12)
+#define PARTY_NFLAGS		13
+
+extern const char *party_flag_names[PARTY_NFLAGS];
+
+/* tag 62 */
+struct party_member {
+	char		name[STATUS_NAME_MAX];
+	char		race[STATUS_NAME_MAX];
+	int		gender;
+	int		level;
+	struct vitals	vitals;
+	char		party[STATUS_NAME_MAX];
+	int		x, y;
+	unsigned	flags;		/* PARTY_* */
+};
+
+/* tag 70 */
+struct target {
+	char	name[STATUS_NAME_MAX];
+	int	health;		/* percent */
+};
+
+/* tags 41 and 42 */
+struct cast {
+	char	name[STATUS_NAME_MAX];
+	int	rounds;		/* 0 = unknown */
+};
+
+int	vitals_parse(struct vitals *, const char *);
+int	prot_parse(struct prot *, const char *);
+int	party_member_parse(struct party_member *, const char *);
+int	target_parse(struct target *, const char *);
+int	cast_parse(struct cast *, const char *);
+
+void	vitals_json(buffer *, const struct vitals *, int);
+void	prot_json(buffer *, const struct prot *, int);
+void	party_member_json(buffer *, const struct party_member *, int);
+
+#endif /* STATUS_H */
@@ -0,0 +1,584 @@
+#include <ctype.h>
+#include <err.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "hashset.h"
+#include "trigger.h"
+#include "xmalloc.h"
+
+/*
+ * Triggers are matched against a line in one pass: the literal strings that
+ * a match of each pattern must contain are looked for with an Aho-Corasick
+ * automaton, and only the triggers all of whose literals were found are
+ * confirmed with regexec. The automaton is a full transition table over byte
+ * classes (bytes that don't occur in any literal share class 0), so scanning
+ * costs one table lookup per byte however many triggers there are. Patterns
+ * without a usable literal, eg. because of a top-level alternation, are run
+ * on every line.
+ *
+ * Trigger file lines look like
+ *
+ *	gag			/pattern/
+ *	highlight	rrggbb	/pattern/
+ *	subst			/pattern/replacement/
+ *	emit		name	/pattern/
+ *	event		name	/pattern/
+ *
+ * where the pattern is a POSIX extended regular expression and / can be any
+ * punctuation character not otherwise used in the pattern, or escaped with
+ * a backslash. Empty lines and lines starting with # are ignored.
+ */
+
+struct posting {
+	int	trig;
+	int	next;		/* next posting of the same literal or -1 */
+};
+
+struct triggers {
+	struct trigger	*trig;
+	int		*nreq;		/* number of literals by trigger */
+	int		ntrig;
+	int		trigcap;
+	int		*always;	/* triggers without literals */
+	int		nalways;
+
+	char		**lit;
+	int		*lithead;	/* first posting of the literal */
+	int		nlit;
+	int		litcap;
+	struct hashset	*litset;	/* literal hash -> index */
+	struct posting	*post;		/* triggers requiring each literal */
+	int		npost;
+	int		postcap;
+
+	/* automaton */
+	uint8_t		class[256];
+	int		nclass;
+	int32_t		*delta;		/* [state * nclass + class] */
+	int32_t		*out;		/* literal ending at the state or -1 */
+	int32_t		*hit;		/* self or nearest suffix with output */
+	int32_t		*dict;		/* nearest proper suffix with output */
+
+	/* per line scratch space */
+	uint32_t	*litstamp;	/* literal found if == gen */
+	uint32_t	*stamp;		/* count is valid if == gen */
+	int		*count;		/* literals of the trigger found */
+	uint32_t	gen;
+	int		*cand;
+
+	struct trigger_stats stats;
+};
+
+struct runs {
+	char	buf[TRIGGER_LINE_MAX * 2];
+	size_t	len;
+	char	*run[TRIGGER_LINE_MAX];
+	int	n;
+};
+
+/*
+ * Ends the literal run of n bytes at the end of r->buf.
+ */
+static void
+end_run(struct runs *r, size_t *n)
+{
+	if (*n) {
+		r->run[r->n++] = r->buf + r->len;
+		r->len += *n;
+		r->buf[r->len++] = '\0';
+	}
+	*n = 0;
+}
+
+/*
+ * Finds the strings that every match of the extended regular expression re
+ * must contain, not looking inside parentheses, and stores them in r.
+ * Returns their number, which is 0 if there are none, eg. because of a
+ * top-level alternation.
+ */
+static int
+required_literals(const char *re, struct runs *r)
+{
+	size_t n = 0;
+	int depth = 0;
+
+	r->len = 0;
+	r->n = 0;
+	for (const char *p = re; *p; p++) {
+		char *run = r->buf + r->len;
+
+		switch (*p) {
+		case '|':
+			if (depth == 0)
+				return r->n = 0;
+			break;
+		case '(':
+			end_run(r, &n);
+			depth++;
+			break;
+		case ')':
+			if (depth)
+				depth--;
+			break;
+		case '*':
+		case '?':
+		case '{':
+			/* the preceding character, if any, is optional */
+			while (n && ((unsigned char)run[n - 1] & 0xc0) == 0x80)
+				n--;
+			if (n)
+				n--;
+			if (*p == '{' && strchr(p, '}'))
+				p = strchr(p, '}');
+			/* FALLTHROUGH */
+		case '+':
+		case '.':
+		case '^':
+		case '$':
+			end_run(r, &n);
+			break;
+		case '[':
+			end_run(r, &n);
+			p++;
+			if (*p == '^')
+				p++;
+			if (*p == ']')
+				p++;
+			while (*p && *p != ']') {
+				if (*p == '[' && p[1] && strchr(":=.", p[1])) {
+					const char *end = strchr(p + 2, ']');
+					if (!end)
+						return r->n = 0;
+					p = end;
+				}
+				p++;
+			}
+			if (!*p)
+				return r->n = 0;
+			break;
+		case '\\':
+			if (!*++p)
+				return r->n = 0;
+			if (isalnum((unsigned char)*p))
+				/* \w, \b and the like */
+				end_run(r, &n);
+			else if (depth == 0)
+				run[n++] = *p;
+			break;
+		default:
+			if (depth == 0)
+				run[n++] = *p;
+			break;
+		}
+	}
+	end_run(r, &n);
+	return r->n;
+}
+
+/*
+ * Terminates the string at *pp at the first unescaped delim, removes the
+ * backslashes escaping delim, and advances *pp past it. Returns the string,
+ * or NULL if there is no closing delim.
+ */
+static char *
+delimited(char **pp, int delim)
+{
+	char *s = *pp, *r, *w;
+
+	for (r = w = s; *r && *r != delim; r++) {
+		if (r[0] == '\\' && r[1] == delim)
+			r++;
+		*w++ = *r;
+	}
+	if (!*r)
+		return NULL;
+	*w = '\0';
+	*pp = r + 1;
+	return s;
+}
+
+/*
+ * Adds lit to the literals required by trigger idx, unless it already is.
+ */
+static void
+add_literal(struct triggers *t, const char *lit, int idx)
+{
+	uint64_t h = hash_str(HASH_INIT, lit), v;
+
+	if (!hashset_get(t->litset, h, &v)) {
+		if (t->nlit == t->litcap) {
+			t->litcap = t->litcap ? t->litcap * 2 : 64;
+			t->lit = xreallocarray(t->lit, t->litcap,
+			    sizeof(char *));
+			t->lithead = xreallocarray(t->lithead, t->litcap,
+			    sizeof(int));
+		}
+		v = t->nlit++;
+		if (!(t->lit[v] = strdup(lit)))
+			err(1, "triggers: strdup");
+		t->lithead[v] = -1;
+		hashset_put(t->litset, h, v);
+	}
+	if (t->lithead[v] != -1 && t->post[t->lithead[v]].trig == idx)
+		return;
+	if (t->npost == t->postcap) {
+		t->postcap = t->postcap ? t->postcap * 2 : 64;
+		t->post = xreallocarray(t->post, t->postcap,
+		    sizeof(struct posting));
+	}
+	t->post[t->npost].trig = idx;
+	t->post[t->npost].next = t->lithead[v];
+	t->lithead[v] = t->npost++;
+	t->nreq[idx]++;
+}
+
+/*
+ * Parses one line of a trigger file and adds its trigger.
+ */
+static void
+parse_line(struct triggers *t, char *line, const char *path, int lineno)
+{
+	char *p = line + strspn(line, " \t"), *word, *arg = NULL, *pattern;
+	struct runs runs;
+	struct trigger *tr;
+	int flags = REG_EXTENDED, delim, ret, len, longest = 0;
+
+	if (*p == '\0' || *p == '#')
+		return;
+	if (t->ntrig == t->trigcap) {
+		t->trigcap = t->trigcap ? t->trigcap * 2 : 64;
+		t->trig = xreallocarray(t->trig, t->trigcap,
+		    sizeof(struct trigger));
+		t->nreq = xreallocarray(t->nreq, t->trigcap, sizeof(int));
+	}
+	t->nreq[t->ntrig] = 0;
+	tr = &t->trig[t->ntrig];
+	memset(tr, 0, sizeof(*tr));
+
+	word = p;
+	p += strcspn(p, " \t");
+	if (*p)
+		*p++ = '\0';
+	if (strcmp(word, "gag") == 0)
+		tr->action = TRIGGER_GAG;
+	else if (strcmp(word, "highlight") == 0)
+		tr->action = TRIGGER_HIGHLIGHT;
+	else if (strcmp(word, "subst") == 0)
+		tr->action = TRIGGER_SUBST;
+	else if (strcmp(word, "emit") == 0)
+		tr->action = TRIGGER_EMIT;
+	else if (strcmp(word, "event") == 0)
+		tr->action = TRIGGER_EVENT;
+	else
+		errx(1, "%s:%d: unknown action %s", path, lineno, word);
+
+	if (tr->action == TRIGGER_HIGHLIGHT || tr->action == TRIGGER_EMIT ||
+	    tr->action == TRIGGER_EVENT) {
+		p += strspn(p, " \t");
+		arg = p;
+		p += strcspn(p, " \t");
+		if (*p)
+			*p++ = '\0';
+		if (!*arg)
+			errx(1, "%s:%d: %s needs an argument", path, lineno,
+			    word);
+	}
+	if (tr->action == TRIGGER_HIGHLIGHT) {
+		if (sscanf(arg, "%6x%n", &tr->rgb, &len) != 1 ||
+		    len != 6 || arg[len])
+			errx(1, "%s:%d: invalid color %s", path, lineno, arg);
+	} else if (arg && !(tr->name = strdup(arg)))
+		err(1, "triggers: strdup");
+
+	p += strspn(p, " \t");
+	delim = (unsigned char)*p;
+	if (!delim || isalnum(delim) || isspace(delim) || delim == '\\')
+		errx(1, "%s:%d: missing pattern", path, lineno);
+	p++;
+	if (!(pattern = delimited(&p, delim)))
+		errx(1, "%s:%d: unterminated pattern", path, lineno);
+	if (tr->action == TRIGGER_SUBST) {
+		char *repl = delimited(&p, delim);
+		if (!repl)
+			errx(1, "%s:%d: unterminated replacement", path,
+			    lineno);
+		if (!(tr->replacement = strdup(repl)))
+			err(1, "triggers: strdup");
+	}
+	p += strspn(p, " \t");
+	if (*p && *p != '#')
+		errx(1, "%s:%d: trailing characters: %s", path, lineno, p);
+	if (!*pattern)
+		errx(1, "%s:%d: empty pattern", path, lineno);
+
+	if (tr->action != TRIGGER_SUBST)
+		flags |= REG_NOSUB;
+	if ((ret = regcomp(&tr->re, pattern, flags)) != 0) {
+		char msg[128];
+		regerror(ret, &tr->re, msg, sizeof(msg));
+		errx(1, "%s:%d: %s: %s", path, lineno, pattern, msg);
+	}
+	tr->literal = !strpbrk(pattern, ".[]()*+?{}|^$\\");
+
+	/* single characters are too common to be worth looking for */
+	required_literals(pattern, &runs);
+	for (int i = 0; i < runs.n; i++)
+		if (strlen(runs.run[i]) > strlen(runs.run[longest]))
+			longest = i;
+	for (int i = 0; i < runs.n; i++)
+		if (i == longest || strlen(runs.run[i]) > 1)
+			add_literal(t, runs.run[i], t->ntrig);
+	if (!t->nreq[t->ntrig]) {
+		t->always = xreallocarray(t->always, t->nalways + 1,
+		    sizeof(int));
+		t->always[t->nalways++] = t->ntrig;
+	}
+	t->ntrig++;
+}
+
+/*
+ * Builds the automaton from the literals: first a trie, whose missing
+ * transitions are then filled in breadth-first from the failure links.
+ */
+static void
+build(struct triggers *t)
+{
+	int32_t *fail, *queue, nstates = 1, maxstates = 1, qh = 0, qt = 0;
+	int nc;
+
+	for (int l = 0; l < t->nlit; l++)
+		for (const unsigned char *s = (unsigned char *)t->lit[l]; *s;
+		    s++) {
+			if (!t->class[*s])
+				t->class[*s] = ++t->nclass;
+			maxstates++;
+		}
+	nc = ++t->nclass;
+	if ((size_t)maxstates > SIZE_MAX / sizeof(int32_t) / nc)
+		errx(1, "triggers: too many literals");
+	if (!(t->delta = calloc((size_t)maxstates * nc, sizeof(int32_t))) ||
+	    !(t->hit = calloc(maxstates, sizeof(int32_t))) ||
+	    !(t->dict = calloc(maxstates, sizeof(int32_t))) ||
+	    !(fail = calloc(maxstates, sizeof(int32_t))))
+		err(1, "triggers: malloc");
+	t->out = xreallocarray(NULL, maxstates, sizeof(int32_t));
+	queue = xreallocarray(NULL, maxstates, sizeof(int32_t));
+	for (int32_t s = 0; s < maxstates; s++)
+		t->out[s] = -1;
+
+	for (int l = 0; l < t->nlit; l++) {
+		int32_t s = 0;
+		for (const unsigned char *p = (unsigned char *)t->lit[l]; *p;
+		    p++) {
+			int32_t *next = &t->delta[s * nc + t->class[*p]];
+			if (!*next)
+				*next = nstates++;
+			s = *next;
+		}
+		t->out[s] = l;
+	}
+
+	for (int c = 0; c < nc; c++)
+		if (t->delta[c])
+			queue[qt++] = t->delta[c];
+	while (qh < qt) {
+		int32_t u = queue[qh++], f = fail[u];
+
+		t->dict[u] = t->out[f] >= 0 ? f : t->dict[f];
+		t->hit[u] = t->out[u] >= 0 ? u : t->dict[u];
+		for (int c = 0; c < nc; c++) {
+			int32_t *v = &t->delta[u * nc + c];
+			if (*v) {
+				fail[*v] = u ? t->delta[f * nc + c] : 0;
+				queue[qt++] = *v;
+			} else
+				*v = t->delta[f * nc + c];
+		}
+	}
+	free(fail);
+	free(queue);
+}
+
+/*
+ * Reads triggers from the file at path. Returns NULL if path is NULL.
+ * Exits on errors in the file.
+ */
+struct triggers *
+triggers_new(const char *path)
+{
+	struct triggers *t;
+	char line[TRIGGER_LINE_MAX + 1];
+	int lineno = 0;
+	FILE *fp;
+
+	if (!path)
+		return NULL;
+	if (!(fp = fopen(path, "r")))
+		err(1, "%s", path);
+	if (!(t = calloc(1, sizeof(struct triggers))))
+		err(1, "triggers_new: malloc");
+	t->litset = hashset_new();
+	while (fgets(line, sizeof(line), fp)) {
+		size_t len = strlen(line);
+		lineno++;
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		else if (!feof(fp))
+			errx(1, "%s:%d: line too long", path, lineno);
+		parse_line(t, line, path, lineno);
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	fclose(fp);
+	hashset_free(t->litset);
+	t->litset = NULL;
+
+	build(t);
+	if (!(t->stamp = calloc(t->ntrig + 1, sizeof(uint32_t))) ||
+	    !(t->litstamp = calloc(t->nlit + 1, sizeof(uint32_t))))
+		err(1, "triggers_new: malloc");
+	t->count = xreallocarray(NULL, t->ntrig + 1, sizeof(int));
+	t->cand = xreallocarray(NULL, t->ntrig + 1, sizeof(int));
+	return t;
+}
+
+void
+triggers_free(struct triggers *t)
+{
+	if (!t)
+		return;
+	for (int i = 0; i < t->ntrig; i++) {
+		regfree(&t->trig[i].re);
+		free(t->trig[i].name);
+		free(t->trig[i].replacement);
+	}
+	for (int i = 0; i < t->nlit; i++)
+		free(t->lit[i]);
+	free(t->trig);
+	free(t->nreq);
+	free(t->always);
+	free(t->lit);
+	free(t->lithead);
+	free(t->post);
+	free(t->delta);
+	free(t->out);
+	free(t->hit);
+	free(t->dict);
+	free(t->litstamp);
+	free(t->stamp);
+	free(t->count);
+	free(t->cand);
+	free(t);
+}
+
+static int
+intcmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Matches the NUL-terminated line of len bytes against the triggers and calls
+ * cb for each match. Returns the number of matches.
+ */
+int
+triggers_match(struct triggers *t, const char *line, size_t len,
+    trigger_cb cb, void *arg)
+{
+	const unsigned char *s = (const unsigned char *)line;
+	regmatch_t m[TRIGGER_NMATCH];
+	int32_t state = 0;
+	int ncand = 0, nmatch = 0;
+
+	if (++t->gen == 0) {
+		memset(t->stamp, 0, t->ntrig * sizeof(uint32_t));
+		memset(t->litstamp, 0, t->nlit * sizeof(uint32_t));
+		t->gen = 1;
+	}
+	for (size_t i = 0; i < len; i++) {
+		state = t->delta[state * t->nclass + t->class[s[i]]];
+		if (!t->hit[state])
+			continue;
+		for (int32_t o = t->hit[state]; o; o = t->dict[o]) {
+			int l = t->out[o];
+			if (t->litstamp[l] == t->gen)
+				continue;
+			t->litstamp[l] = t->gen;
+			for (int p = t->lithead[l]; p != -1;
+			    p = t->post[p].next) {
+				int j = t->post[p].trig;
+				if (t->stamp[j] != t->gen) {
+					t->stamp[j] = t->gen;
+					t->count[j] = 0;
+				}
+				if (++t->count[j] == t->nreq[j])
+					t->cand[ncand++] = j;
+			}
+		}
+	}
+	for (int i = 0; i < t->nalways; i++)
+		t->cand[ncand++] = t->always[i];
+	if (ncand > 1)
+		qsort(t->cand, ncand, sizeof(int), intcmp);
+
+	for (int i = 0; i < ncand; i++) {
+		const struct trigger *tr = &t->trig[t->cand[i]];
+		int subst = tr->action == TRIGGER_SUBST;
+
+		if (!tr->literal || subst) {
+			if (regexec(&tr->re, line, subst ? TRIGGER_NMATCH : 0,
+			    m, 0) != 0)
+				continue;
+		}
+		cb(arg, tr, subst ? m : NULL);
+		nmatch++;
+	}
+	t->stats.lines++;
+	t->stats.bytes += len;
+	t->stats.candidates += ncand;
+	t->stats.matches += nmatch;
+	return nmatch;
+}
+
+/*
+ * Appends line with the match m replaced by the replacement of the subst
+ * trigger tr, in which \0 to \9 stand for the subexpression matches and \\
+ * for a backslash.
+ */
+void
+trigger_subst(const struct trigger *tr, const char *line,
+    const regmatch_t *m, buffer *out)
+{
+	const char *p = tr->replacement;
+
+	buffer_append(out, line, m[0].rm_so);
+	while (*p) {
+		size_t n = strcspn(p, "\\");
+		buffer_append(out, p, n);
+		p += n;
+		if (!*p)
+			break;
+		if (p[1] >= '0' && p[1] <= '9') {
+			const regmatch_t *sub = &m[p[1] - '0'];
+			if (sub->rm_so != -1)
+				buffer_append(out, line + sub->rm_so,
+				    sub->rm_eo - sub->rm_so);
+			p += 2;
+		} else if (p[1] == '\\') {
+			buffer_append(out, "\\", 1);
+			p += 2;
+		} else
+			buffer_append(out, p++, 1);
+	}
+	buffer_append_str(out, line + m[0].rm_eo);
+}
+
+const struct trigger_stats *
+triggers_stats(const struct triggers *t)
+{
+	return t ? &t->stats : NULL;
+}
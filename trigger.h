@@ -0,0 +1,54 @@
+#ifndef TRIGGER_H
+#define TRIGGER_H
+#include <regex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+
+/* Longest line in a trigger file */
+#define TRIGGER_LINE_MAX	1024
+/* Subexpressions available to subst replacements as \0 to \9 */
+#define TRIGGER_NMATCH		10
+
+enum trigger_action {
+	TRIGGER_GAG,		/* drop the line */
+	TRIGGER_HIGHLIGHT,	/* color the line */
+	TRIGGER_SUBST,		/* replace the match */
+	TRIGGER_EMIT,		/* add a marker line after the line */
+	TRIGGER_EVENT,		/* publish the line on the event feed */
+};
+
+struct trigger {
+	enum trigger_action action;
+	char		*name;		/* emit and event */
+	char		*replacement;	/* subst */
+	uint32_t	rgb;		/* highlight */
+	regex_t		re;
+	int		literal;	/* pattern has no special characters */
+};
+
+struct trigger_stats {
+	unsigned long	lines;		/* lines matched against */
+	unsigned long	bytes;
+	unsigned long	candidates;	/* triggers whose literals were found */
+	unsigned long	matches;	/* triggers that matched */
+};
+
+struct triggers;
+
+/*
+ * Called for each matching trigger, in the order of the trigger file. The
+ * subexpression matches are NULL for a literal trigger other than subst.
+ */
+typedef void (*trigger_cb)(void *, const struct trigger *,
+    const regmatch_t *);
+
+struct triggers *	triggers_new(const char *);
+void			triggers_free(struct triggers *);
+int			triggers_match(struct triggers *, const char *, size_t,
+			    trigger_cb, void *);
+void			trigger_subst(const struct trigger *, const char *,
+			    const regmatch_t *, buffer *);
+const struct trigger_stats *triggers_stats(const struct triggers *);
+
+#endif /* TRIGGER_H */
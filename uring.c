@@ -0,0 +1,432 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uring.h"
+
+/*
+ * A minimal io_uring wrapper over the raw system calls, so that the proxy
+ * needs no liburing: one submission and completion ring in a single mapping,
+ * fixed buffers, and one ring of provided buffers for multishot receives.
+ * Submissions are handed to the kernel by uring_wait, which submits and waits
+ * in the same system call, unless the submission ring fills up before.
+ */
+
+struct uring {
+	int			fd;
+	void			*ring;
+	size_t			ringsz;
+	struct io_uring_sqe	*sqes;
+	size_t			sqesz;
+	unsigned		*sqhead, *sqtail, sqmask, sqentries;
+	unsigned		*cqhead, *cqtail, cqmask;
+	struct io_uring_cqe	*cqes;
+	unsigned		tail;	/* of the SQEs being filled in */
+	unsigned		pending;	/* SQEs not yet submitted */
+	unsigned		inflight;	/* requests not yet completed */
+	struct io_uring_buf_ring *br;	/* provided buffers */
+	char			*bufs;
+	size_t			bufsz;
+	unsigned		nbufs;
+};
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* Buffer group of the buffer uring_new probes multishot receives with */
+#define PROBE_BGID	1
+
+static int	probe(struct uring *);
+
+static int
+enter(struct uring *r, unsigned submit, unsigned wait, unsigned flags,
+    void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, r->fd, submit, wait, flags, arg,
+	    argsz);
+}
+
+/*
+ * Returns a ring with room for entries submissions, or NULL with errno set if
+ * the kernel lacks io_uring or a feature the proxy uses: buffer rings (Linux
+ * 5.19) and multishot receives (Linux 6.0) are tried out before the ring is
+ * returned.
+ */
+struct uring *
+uring_new(unsigned entries)
+{
+	struct io_uring_params p;
+	struct uring *r;
+	unsigned *array;
+	char *ring;
+
+	if (!(r = calloc(1, sizeof(struct uring))))
+		err(1, "uring_new: malloc");
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1)
+		goto fail;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+	    !(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+	r->ringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) >
+	    r->ringsz)
+		r->ringsz = p.cq_off.cqes +
+		    p.cq_entries * sizeof(struct io_uring_cqe);
+	r->ring = mmap(NULL, r->ringsz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->ring == MAP_FAILED) {
+		r->ring = NULL;
+		goto fail;
+	}
+	r->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqesz, PROT_READ|PROT_WRITE,
+	    MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+	ring = r->ring;
+	r->sqhead = (unsigned *)(ring + p.sq_off.head);
+	r->sqtail = (unsigned *)(ring + p.sq_off.tail);
+	r->sqmask = *(unsigned *)(ring + p.sq_off.ring_mask);
+	r->sqentries = p.sq_entries;
+	r->cqhead = (unsigned *)(ring + p.cq_off.head);
+	r->cqtail = (unsigned *)(ring + p.cq_off.tail);
+	r->cqmask = *(unsigned *)(ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+	/* SQE i always goes in slot i */
+	array = (unsigned *)(ring + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	r->tail = *r->sqtail;
+	if (probe(r) == -1) {
+		errno = ENOSYS;
+		goto fail;
+	}
+	return r;
+fail:
+	uring_free(r);
+	return NULL;
+}
+
+void
+uring_free(struct uring *r)
+{
+	int saved = errno;
+
+	if (!r)
+		return;
+	if (r->sqes)
+		munmap(r->sqes, r->sqesz);
+	if (r->ring)
+		munmap(r->ring, r->ringsz);
+	if (r->fd != -1)
+		close(r->fd);
+	free(r->br);
+	free(r->bufs);
+	free(r);
+	errno = saved;
+}
+
+/*
+ * Registers n buffers for IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED; the
+ * index of the iovec is the buf_index of the operations using it. Returns -1
+ * on error.
+ */
+int
+uring_register(struct uring *r, const struct iovec *iov, unsigned n)
+{
+	return syscall(__NR_io_uring_register, r->fd,
+	    IORING_REGISTER_BUFFERS, iov, n);
+}
+
+/*
+ * Provides count buffers of size bytes, count a power of two, in the buffer
+ * group URING_BGID. Returns -1 on error.
+ */
+int
+uring_provide(struct uring *r, size_t size, unsigned count)
+{
+	struct io_uring_buf_reg reg;
+	void *br;
+
+	if (posix_memalign(&br, sysconf(_SC_PAGESIZE),
+	    count * sizeof(struct io_uring_buf)) != 0 ||
+	    !(r->bufs = malloc(count * size)))
+		err(1, "uring_provide: malloc");
+	memset(br, 0, count * sizeof(struct io_uring_buf));
+	r->br = br;
+	r->bufsz = size;
+	r->nbufs = count;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)br;
+	reg.ring_entries = count;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1)
+		return -1;
+	for (unsigned i = 0; i < count; i++)
+		uring_recycle(r, i);
+	return 0;
+}
+
+char *
+uring_buffer(struct uring *r, unsigned bid)
+{
+	return r->bufs + bid * r->bufsz;
+}
+
+/*
+ * Gives the provided buffer bid back to the kernel once its data has been
+ * used.
+ */
+void
+uring_recycle(struct uring *r, unsigned bid)
+{
+	unsigned short tail = r->br->tail;
+	struct io_uring_buf *b = &r->br->bufs[tail & (r->nbufs - 1)];
+
+	b->addr = (uintptr_t)uring_buffer(r, bid);
+	b->len = r->bufsz;
+	b->bid = bid;
+	STORE(&r->br->tail, tail + 1);
+}
+
+/*
+ * Returns a cleared SQE to fill in. If the ring is full, what is in it is
+ * submitted first.
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	while (r->tail - LOAD(r->sqhead) >= r->sqentries) {
+		int n = enter(r, r->pending, 0, 0, NULL, 0);
+		if (n == -1 && errno != EINTR)
+			err(1, "io_uring_enter");
+		if (n > 0)
+			r->pending -= n;
+	}
+	sqe = &r->sqes[r->tail & r->sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	r->tail++;
+	STORE(r->sqtail, r->tail);
+	r->pending++;
+	r->inflight++;
+	return sqe;
+}
+
+static struct io_uring_sqe *
+prep(struct uring *r, int op, int fd, const void *buf, size_t len,
+    uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(r);
+
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->user_data = data;
+	return sqe;
+}
+
+/*
+ * Reads from fd into the registered buffer index, at buf.
+ */
+void
+uring_read_fixed(struct uring *r, int fd, char *buf, size_t len, int index,
+    uint64_t data)
+{
+	prep(r, IORING_OP_READ_FIXED, fd, buf, len, data)->buf_index = index;
+}
+
+void
+uring_write_fixed(struct uring *r, int fd, const char *buf, size_t len,
+    int index, uint64_t data)
+{
+	prep(r, IORING_OP_WRITE_FIXED, fd, buf, len, data)->buf_index = index;
+}
+
+void
+uring_send(struct uring *r, int fd, const char *buf, size_t len,
+    uint64_t data)
+{
+	prep(r, IORING_OP_SEND, fd, buf, len, data)->msg_flags = MSG_NOSIGNAL;
+}
+
+/*
+ * Receives from fd into provided buffers until an error or the end of the
+ * stream, or until the buffers run out. The completions without
+ * IORING_CQE_F_MORE end it.
+ */
+void
+uring_recv_multishot(struct uring *r, int fd, uint64_t data)
+{
+	struct io_uring_sqe *sqe = prep(r, IORING_OP_RECV, fd, NULL, 0, data);
+
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+}
+
+/*
+ * Completes once with the poll(2) revents of fd.
+ */
+void
+uring_poll(struct uring *r, int fd, short events, uint64_t data)
+{
+	uint32_t ev = (unsigned short)events;
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	ev = ev << 16 | ev >> 16;
+#endif
+	prep(r, IORING_OP_POLL_ADD, fd, NULL, 0, data)->poll32_events = ev;
+}
+
+/*
+ * Cancels the uring_poll with target as its data.
+ */
+void
+uring_poll_remove(struct uring *r, uint64_t target, uint64_t data)
+{
+	prep(r, IORING_OP_POLL_REMOVE, -1, (void *)(uintptr_t)target, 0,
+	    data);
+}
+
+/*
+ * Submits the SQEs filled in since the last call and waits until there is a
+ * completion, or for at most timeout milliseconds if timeout is not negative.
+ * Returns -1 on error, 0 on timeout or signal, 1 otherwise.
+ */
+int
+uring_wait(struct uring *r, int timeout)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = timeout % 1000 * 1000000L,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = timeout < 0 ? 0 : (uintptr_t)&ts,
+	};
+	int n;
+
+	n = enter(r, r->pending, 1, IORING_ENTER_GETEVENTS |
+	    IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if (n == -1)
+		return errno == ETIME || errno == EINTR ? 0 : -1;
+	r->pending -= n;
+	return 1;
+}
+
+/*
+ * Returns the oldest completion not yet marked seen, or NULL if there is none.
+ */
+struct io_uring_cqe *
+uring_cqe(struct uring *r)
+{
+	unsigned head = *r->cqhead;
+
+	if (head == LOAD(r->cqtail))
+		return NULL;
+	return &r->cqes[head & r->cqmask];
+}
+
+void
+uring_seen(struct uring *r)
+{
+	struct io_uring_cqe *cqe = &r->cqes[*r->cqhead & r->cqmask];
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		r->inflight--;
+	STORE(r->cqhead, *r->cqhead + 1);
+}
+
+/*
+ * Cancels all requests and waits until they have completed, so that the
+ * kernel no longer uses their buffers. Closing the ring would cancel them
+ * too, but only asynchronously. Returns -1 on error.
+ */
+int
+uring_drain(struct uring *r)
+{
+	prep(r, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0)->cancel_flags =
+	    IORING_ASYNC_CANCEL_ANY;
+	while (r->inflight) {
+		if (uring_cqe(r))
+			uring_seen(r);
+		else if (uring_wait(r, -1) == -1)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Returns 0 if the kernel has buffer rings and multishot receives, which it
+ * tells by receiving a byte over a socket pair that way, or -1 if it hasn't.
+ */
+static int
+probe(struct uring *r)
+{
+	struct io_uring_buf_reg reg;
+	struct io_uring_buf_ring *br;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	char buf[16];
+	int sv[2], status = -1;
+	void *p;
+
+	if (posix_memalign(&p, sysconf(_SC_PAGESIZE),
+	    sizeof(struct io_uring_buf)) != 0)
+		err(1, "uring_new: malloc");
+	br = memset(p, 0, sizeof(struct io_uring_buf));
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)br;
+	reg.ring_entries = 1;
+	reg.bgid = PROBE_BGID;
+	if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING,
+	    &reg, 1) == -1) {
+		free(br);
+		return -1;
+	}
+	br->bufs[0].addr = (uintptr_t)buf;
+	br->bufs[0].len = sizeof(buf);
+	STORE(&br->tail, 1);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err(1, "uring_new: socketpair");
+	if (write(sv[1], "", 1) != 1)
+		err(1, "uring_new: write");
+
+	sqe = prep(r, IORING_OP_RECV, sv[0], NULL, 0, 0);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = PROBE_BGID;
+	/* the byte, then the end of the stream or the lack of buffers */
+	while (r->inflight) {
+		if (!(cqe = uring_cqe(r))) {
+			if (uring_wait(r, -1) == -1)
+				err(1, "io_uring_enter");
+			continue;
+		}
+		if (cqe->res == 1 && cqe->flags & IORING_CQE_F_MORE) {
+			status = 0;
+			shutdown(sv[1], SHUT_WR);
+		}
+		uring_seen(r);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING,
+	    &reg, 1);
+	free(br);
+	return status;
+}
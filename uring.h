@@ -0,0 +1,34 @@
+#ifndef URING_H
+#define URING_H
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buffer group of the buffers given with uring_provide */
+#define URING_BGID	0
+
+struct uring;
+
+struct uring *		uring_new(unsigned);
+void			uring_free(struct uring *);
+int			uring_register(struct uring *, const struct iovec *,
+			    unsigned);
+int			uring_provide(struct uring *, size_t, unsigned);
+char *			uring_buffer(struct uring *, unsigned);
+void			uring_recycle(struct uring *, unsigned);
+void			uring_read_fixed(struct uring *, int, char *, size_t,
+			    int, uint64_t);
+void			uring_write_fixed(struct uring *, int, const char *,
+			    size_t, int, uint64_t);
+void			uring_send(struct uring *, int, const char *, size_t,
+			    uint64_t);
+void			uring_recv_multishot(struct uring *, int, uint64_t);
+void			uring_poll(struct uring *, int, short, uint64_t);
+void			uring_poll_remove(struct uring *, uint64_t, uint64_t);
+int			uring_wait(struct uring *, int);
+struct io_uring_cqe *	uring_cqe(struct uring *);
+void			uring_seen(struct uring *);
+int			uring_drain(struct uring *);
+
+#endif /* URING_H */
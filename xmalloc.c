@@ -0,0 +1,18 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "xmalloc.h"
+
+/*
+ * Resizes p to n elements of size bytes, like reallocarray, but exits if the
+ * size overflows or memory runs out.
+ */
+void *
+xreallocarray(void *p, size_t n, size_t size)
+{
+	if (size && n > SIZE_MAX / size)
+		errx(1, "xreallocarray: allocation too large");
+	if (!(p = realloc(p, n * size)))
+		err(1, "xreallocarray: malloc");
+	return p;
+}
@@ -0,0 +1,7 @@
+#ifndef XMALLOC_H
+#define XMALLOC_H
+#include <stddef.h>
+
+void *	xreallocarray(void *, size_t, size_t);
+
+#endif /* XMALLOC_H */